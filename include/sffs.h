@@ -30,6 +30,76 @@
 
 #define SFFS_MAGIC              0x53FF5346
 
+/**
+ *  Superblock s_features flags
+*/
+#define SFFS_FEATURE_GROUP_DESC 0x0001      // Group descriptor area is present
+#define SFFS_FEATURE_EXTENTS    0x0002      // Inodes map data blocks with extents
+
+#ifndef SFFS_BCACHE_SIZE
+/**
+ *  Default number of blocks held by the block cache. Might be 
+ *  overridden by --cache-size mount option
+*/
+#define SFFS_BCACHE_SIZE        1024
+#endif
+
+#ifndef SFFS_ICACHE_SIZE
+/**
+ *  Default number of GIT entries held by the inode cache. Might be 
+ *  overridden by --icache-size mount option
+*/
+#define SFFS_ICACHE_SIZE        4096
+#endif
+
+#ifndef SFFS_IO_DEPTH
+/**
+ *  Default io_uring queue depth used for batched reads. Might be 
+ *  overridden by --io-depth mount option
+*/
+#define SFFS_IO_DEPTH           64
+#endif
+
+#ifndef SFFS_BCACHE_FLUSH_INTERVAL
+/**
+ *  Interval in seconds between two runs of the background 
+ *  flusher. Zero disables the flusher
+*/
+#define SFFS_BCACHE_FLUSH_INTERVAL  5
+#endif
+
+#ifndef SFFS_BUFPOOL_SIZE
+/**
+ *  Number of preallocated block-aligned buffers used for 
+ *  temporary block copies
+*/
+#define SFFS_BUFPOOL_SIZE       64
+#endif
+
+#ifndef SFFS_READAHEAD
+/**
+ *  Default upper bound of the readahead window in blocks. Might 
+ *  be overridden by --readahead mount option, zero disables readahead
+*/
+#define SFFS_READAHEAD          128
+#endif
+
+#ifndef SFFS_STRIPE_UNIT
+/**
+ *  Default stripe unit in blocks of a striped volume. Might be 
+ *  overridden by -s option of mkfs.sffs
+*/
+#define SFFS_STRIPE_UNIT        16
+#endif
+
+#ifndef SFFS_DIRECT_ALIGN
+/**
+ *  Buffer, offset and length alignment assumed for O_DIRECT 
+ *  on regular files
+*/
+#define SFFS_DIRECT_ALIGN       4096
+#endif
+
 /**
  *  SFFS file permission flags
 */
@@ -101,6 +171,14 @@
 #define SFFS_GET_BLK_LT             0000002     // Get last block of the inode
 
 #define SFFS_MAX_DIR_ENTRY          256         // The maximum size of the struct sffs_direntry
+#define SFFS_DIR_BATCH              32          // Directory blocks read with a single batch
+#define SFFS_IOV_MAX                256         // Blocks merged into a single vectored transfer
+#define SFFS_RA_SLOTS               64          // Inodes tracked by readahead at once
+#define SFFS_BMAP_SLOTS             64          // Inodes with a cached block map at once
+#define SFFS_RA_QUEUE               16          // Readahead windows waiting for the worker
+#define SFFS_STATS_BUCKETS          32          // Latency histogram buckets, powers of two of ns
+#define SFFS_FREEIDX_ORDER          16          // Minimum degree of free extent B-trees
+#define SFFS_FREEIDX_REGION         4096        // Data blocks per stale flag of the free extent index
 
 typedef uint32_t blk32_t;       // Data block ID
 typedef uint32_t ino32_t;       // Inode ID
@@ -126,24 +204,24 @@ typedef enum
     */
     SFFS_ERR_INVARG = -1,       // Invalid arguments passed to a handler
     SFFS_ERR_INVBLK = -2,       // Invalid block
-    SFFS_ERR_INIT,              // Common error occured during mounting
-    SFFS_ERR_MEMALLOC,          // Cannot allocate memory       
-    SFFS_ERR_FS,                // File system structure is corrupted
-    SFFS_ERR_NOSPC,             // No free space
+    SFFS_ERR_INIT = -3,         // Common error occured during mounting
+    SFFS_ERR_MEMALLOC = -4,     // Cannot allocate memory       
+    SFFS_ERR_FS = -5,           // File system structure is corrupted
+    SFFS_ERR_NOSPC = -6,        // No free space
 
     /**
      *  Device error codes
     */
-    SFFS_ERR_DEV_WRITE,         // Device write operation error
-    SFFS_ERR_DEV_READ,          // Device read operation error
-    SFFS_ERR_DEV_SEEK,          // Device seek operation error
-    SFFS_ERR_DEV_STAT,          // Device stat or statfs error
+    SFFS_ERR_DEV_WRITE = -7,    // Device write operation error
+    SFFS_ERR_DEV_READ = -8,     // Device read operation error
+    SFFS_ERR_DEV_SEEK = -9,     // Device seek operation error
+    SFFS_ERR_DEV_STAT = -10,    // Device stat or statfs error
 
     /**
      *  Other error codes
     */
-    SFFS_ERR_NOENT,             // No requested entry
-    SFFS_ERR_ENTEXIS,           // Requested entry exist
+    SFFS_ERR_NOENT = -11,       // No requested entry
+    SFFS_ERR_ENTEXIS = -12,     // Requested entry exist
 }sffs_err_t;
 
 /**
@@ -191,7 +269,9 @@ struct __attribute__ ((__packed__)) sffs_inode
         } t64;
     } tv;
 
-    uint8_t __align1[58];       // padding (reserved for future use)
+    uint32_t i_extents_count;   // Extents in use, see SFFS_FEATURE_EXTENTS
+    uint64_t i_size;            // File size in bytes
+    uint8_t __align1[46];       // padding (reserved for future use)
 };
 
 /**
@@ -220,6 +300,19 @@ struct sffs_inode_list
     blk32_t  blks[];
 };
 
+/**
+ *  If SFFS_FEATURE_EXTENTS is set, primary and supplementary inodes 
+ *  hold extents in place of block ids. Extent maps e_len consecutive 
+ *  data blocks starting from e_start
+ * 
+ *  Rev. 1
+*/
+struct sffs_inode_extent
+{
+    blk32_t  e_start;           // First data block
+    uint32_t e_len;             // Number of data blocks
+};
+
 /**
  *  SFFS superblock resides at the header and footer 
  *  in metadata area. Holds the basic set of a file system 
@@ -262,16 +355,40 @@ struct __attribute__ ((__packed__)) sffs_superblock
     blk32_t s_GIT_bitmap_size;          // Global Inode Table bitmap size in blocks
     blk32_t s_GIT_start;                // Global Inode Table starting block
     blk32_t s_GIT_size;                 // Global Inode Table size in blocks
+
+    // Striped volume, see sffs_stripe.c
+    uint32_t s_stripe_count;            // Number of member images, 0 for a plain image
+    uint32_t s_stripe_unit;             // Stripe unit in blocks
+    uint32_t s_stripe_index;            // Position of this image within the volume
+    uint32_t s_volume_id;               // Same on every member of the volume
+
+    // Group descriptors, a free blocks counter per group
+    blk32_t s_group_desc_start;         // Group descriptor area starting block
+    blk32_t s_group_desc_size;          // Group descriptor area size in blocks
 };
 
 #define SFFS_SB_SIZE        sizeof(struct sffs_superblock)
 
 typedef struct sffs_context
 {
-    int disk_id;                // Image file descriptor
+    int disk_id;                // Image file descriptor (-1 if backend has none)
     int log_id;                 // Log file descriptor
     struct sffs_superblock sb;  // Super block instance
     void *cache;                // Private data
+    struct sffs_bcache *bcache; // Block cache (optional)
+    struct sffs_icache *icache; // Inode cache (optional)
+    struct sffs_uring *uring;   // io_uring instance for batched I/O (optional)
+    const struct sffs_dev_ops *dev_ops; // Device backend
+    void *dev_priv;             // Backend private data
+    size_t dev_align;           // I/O alignment demanded by the device, 0 if none
+    struct sffs_bufpool *bufpool;   // Block-aligned scratch buffers (optional)
+    struct sffs_readahead *ra;  // Readahead engine (optional)
+    struct sffs_bmap *bmap;     // Logical to physical block maps (optional)
+    struct sffs_discard *discard;   // Discard queue for freed blocks (optional)
+    struct sffs_commit *commit; // Group commit state for sffs_sync (optional)
+    struct sffs_stats *stats;   // Block I/O statistics (optional)
+    struct sffs_bitmaps *bitmaps;   // In-memory bitmap mirrors (optional)
+    struct sffs_freeidx *freeidx;   // Free extent index (optional)
 } sffs_context_t;
 
 /**
@@ -311,6 +428,13 @@ struct sffs_options
 {
     const char *fs_image;
     const char *log_file;
+    unsigned int cache_size;    // Block cache size in blocks
+    unsigned int icache_size;   // Inode cache size in inodes
+    int io_depth;               // io_uring queue depth, 0 disables io_uring
+    const char *backend;        // Device backend name, NULL to detect
+    int direct_io;              // Open image with O_DIRECT
+    unsigned int readahead;     // Maximum readahead window in blocks, 0 disables readahead
+    int discard;                // Discard freed blocks on the device
 };
 
 #define SFFS_OPT_INIT(t, p) { t, offsetof(struct sffs_options, p), 1 }
@@ -389,6 +513,16 @@ sffs_err_t sffs_alloc_inode(sffs_context_t *sffs_ctx, ino32_t *ino_id, mode_t mo
 sffs_err_t sffs_alloc_data_blocks(sffs_context_t *sffs_ctx, size_t blk_count, 
     struct sffs_inode_mem *inode);
 
+/**
+ *  Releases the last blk_count data blocks of inode. Released blocks 
+ *  are dropped from the block cache and, if enabled, discarded on the 
+ *  device. Inode list entries are kept for later growth
+ * 
+ *  If handler fails, the error code is returned
+*/
+sffs_err_t sffs_free_data_blocks(sffs_context_t *sffs_ctx, size_t blk_count, 
+    struct sffs_inode_mem *ino_mem);
+
 /**
  *  Allocates size additional inode list entries. Inode list entries will
  *  be appended to ino_mem inode with all subsequent changes.
@@ -400,15 +534,60 @@ sffs_err_t sffs_alloc_inode_list(sffs_context_t *sffs_ctx, ino32_t size,
 
 /**
  *  Reads the data block information from inode and block itself 
- *  if needed. If caller requested data block to be read in memory
- *  then he is responsible for deallocating memory that's being 
- *  allocated into db_info->content
+ *  if needed. If caller requested data block to be read in memory, 
+ *  block is read into db_info->content. If content is NULL, buffer 
+ *  is taken from the buffer pool and caller is responsible for 
+ *  returning it with sffs_buf_put. Without SFFS_GET_BLK_RD, content 
+ *  is set to NULL
  * 
  *  If handler fails, the error code is returned
 */
 sffs_err_t sffs_get_data_block_info(sffs_context_t *sffs_ctx, blk32_t block_number, 
     int flags, struct sffs_data_block_info *db_info, struct sffs_inode_mem *ino_mem);
 
+/**
+ *  Translates count logical blocks of inode starting from first into 
+ *  data block ids. Unlike sffs_get_data_block_info, the inode list is 
+ *  walked only once for the whole range
+ * 
+ *  If handler fails, the error code is returned
+*/
+sffs_err_t sffs_get_data_blocks(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem, 
+    blk32_t first, u32_t count, blk32_t *blocks);
+
+/**
+ *  Returns size of the file in bytes. Size is kept apart from the 
+ *  block count, which also covers preallocated blocks
+*/
+u64_t sffs_inode_size(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem);
+
+/**
+ *  Sets size of the file in bytes. Blocks must already be allocated, 
+ *  writing the inode is left to the caller
+*/
+void sffs_inode_set_size(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem, 
+    u64_t size);
+
+/**
+ *  Reads up to size bytes of file content starting from offset into 
+ *  buf. Adjacent data blocks are read with vectored transfers
+ * 
+ *  Returns number of bytes read or the error code
+*/
+ssize_t sffs_read_data(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem, 
+    void *buf, size_t size, u64_t offset);
+
+/**
+ *  Returns length of the run of consecutive blocks at the beginning 
+ *  of blocks, count must not be zero
+*/
+u32_t sffs_blk_run(const blk32_t *blocks, size_t count);
+
+/**
+ *  Compares two block ids, to be used with qsort(3)
+*/
+int sffs_blk_cmp(const void *a, const void *b);
+
 /*      sffs_direntry.c     */
 
 /**
@@ -451,6 +630,19 @@ sffs_err_t sffs_unset_data_bm(sffs_context_t *sffs_ctx, bmap_t);
 sffs_err_t sffs_check_data_bm(sffs_context_t *sffs_ctx, bmap_t);
 sffs_err_t __set_bm(blk32_t *, bmap_t, u8_t);
 
+/**
+ *  Range versions of the handlers above, for bits [start, start + count).
+ *  Each bitmap block is written at most once. Nothing is changed and 
+ *  SFFS_ERR_FS is returned if any bit in the range already holds the value.
+ *  On mirrors bits are claimed atomically, a failed range may be seen 
+ *  partly set by other threads until it is rolled back
+*/
+sffs_err_t sffs_set_data_bm_range(sffs_context_t *sffs_ctx, bmap_t start, u32_t count);
+sffs_err_t sffs_unset_data_bm_range(sffs_context_t *sffs_ctx, bmap_t start, u32_t count);
+sffs_err_t sffs_set_GIT_bm_range(sffs_context_t *sffs_ctx, bmap_t start, u32_t count);
+sffs_err_t sffs_unset_GIT_bm_range(sffs_context_t *sffs_ctx, bmap_t start, u32_t count);
+sffs_err_t __set_range_bm(void *bm, u64_t start, u64_t end, u8_t value);
+
 /**
  *  Bitmap handlers for Global Inode Table.
  *  If bitmap handlers fails, the error code is returned
@@ -460,4 +652,199 @@ sffs_err_t sffs_unset_GIT_bm(sffs_context_t *sffs_ctx, bmap_t);
 sffs_err_t sffs_check_GIT_bm(sffs_context_t *sffs_ctx, bmap_t);
 sffs_err_t __check_bm(blk32_t *, bmap_t);
 
+/**
+ *  Search primitives working on a raw bitmap buffer, bits are searched 
+ *  within [start, end). Return the id of the first zero bit, of the first 
+ *  one bit, of the first bit of len zero bits in a row, or end if there 
+ *  is no such bit
+*/
+u64_t __find_zero_bm(const void *bm, u64_t start, u64_t end);
+u64_t __find_one_bm(const void *bm, u64_t start, u64_t end);
+u64_t __find_zero_run_bm(const void *bm, u64_t start, u64_t end, u64_t len);
+
+/**
+ *  Returns number of zero bits within [start, end)
+*/
+u64_t __count_zero_bm(const void *bm, u64_t start, u64_t end);
+
+/**
+ *  Group lookup. Finds the first group, starting with group from, which 
+ *  has all its blocks free (sffs_grp_find_empty) or at least one free 
+ *  block (sffs_grp_find_avail). Found group is stored in grp, 
+ *  SFFS_ERR_NOSPC is returned if there is none
+*/
+sffs_err_t sffs_grp_find_empty(sffs_context_t *sffs_ctx, u32_t from, u32_t *grp);
+sffs_err_t sffs_grp_find_avail(sffs_context_t *sffs_ctx, u32_t from, u32_t *grp);
+
+/**
+ *  Stores number of free blocks of group grp in count
+*/
+sffs_err_t sffs_grp_free_blocks(sffs_context_t *sffs_ctx, u32_t grp, u32_t *count);
+
+/**
+ *  Finds a free GIT entry within [start, end) and stores it in res. 
+ *  Search starts where the previous one has stopped and wraps around, 
+ *  SFFS_ERR_NOSPC is returned if there is none. Found entry is not 
+ *  claimed, sffs_set_GIT_bm does that
+*/
+sffs_err_t sffs_ino_find_free(sffs_context_t *sffs_ctx, bmap_t start, bmap_t end, 
+    bmap_t *res);
+
+/**
+ *  The same searches on the bitmap starting at block bm (data or GIT 
+ *  bitmap start). Found bit is stored in res, SFFS_ERR_NOSPC is 
+ *  returned if there is none
+*/
+sffs_err_t sffs_bm_find_zero(sffs_context_t *sffs_ctx, blk32_t bm, bmap_t start, 
+    bmap_t end, bmap_t *res);
+sffs_err_t sffs_bm_find_zero_run(sffs_context_t *sffs_ctx, blk32_t bm, bmap_t start, 
+    bmap_t end, u32_t len, bmap_t *res);
+sffs_err_t sffs_bm_count_zero(sffs_context_t *sffs_ctx, blk32_t bm, bmap_t start, 
+    bmap_t end, u32_t *count);
+
+/**
+ *  Loads data and GIT bitmaps into memory. From now on bitmap handlers 
+ *  work on the mirrors and the device is updated by sffs_bm_flush
+*/
+sffs_err_t sffs_bm_load(sffs_context_t *sffs_ctx);
+
+/**
+ *  Writes bitmap blocks modified since the last flush
+*/
+sffs_err_t sffs_bm_flush(sffs_context_t *sffs_ctx);
+
+/**
+ *  Flushes and releases the mirrors
+*/
+sffs_err_t sffs_bm_unload(sffs_context_t *sffs_ctx);
+
+/*      sffs_freeidx.c      */
+
+/**
+ *  Builds the free extent index from data bitmap bits, which must 
+ *  outlive the index. Once built, the index must be told about every 
+ *  change of the data bitmap with sffs_freeidx_stale
+*/
+sffs_err_t sffs_freeidx_init(sffs_context_t *sffs_ctx, const void *bits);
+void sffs_freeidx_destroy(sffs_context_t *sffs_ctx);
+
+/**
+ *  Records that bits of data blocks [start, start + count) have changed. 
+ *  Takes no lock, the index catches up on the next sffs_freeidx_take
+*/
+void sffs_freeidx_stale(sffs_context_t *sffs_ctx, bmap_t start, u32_t count);
+
+/**
+ *  Takes at most len free blocks in a row out of the index. These are 
+ *  the blocks starting at goal if goal is free, otherwise the best fit 
+ *  extent. First block is stored in start and number of blocks in 
+ *  count. SFFS_ERR_INIT is returned if the index cannot be used. The 
+ *  blocks are not marked in the data bitmap, the caller claims them 
+ *  there and must expect some to be claimed by another thread
+*/
+sffs_err_t sffs_freeidx_take(sffs_context_t *sffs_ctx, blk32_t goal, u32_t len, 
+    blk32_t *start, u32_t *count);
+
+/*      sffs_icache.c       */
+
+/**
+ *  Creates inode cache of nr_inodes GIT entries and attaches it to 
+ *  sffs_ctx. Once cache is attached, sffs_read_inode and 
+ *  sffs_write_inode are served by the cache
+*/
+sffs_err_t sffs_icache_init(sffs_context_t *sffs_ctx, size_t nr_inodes);
+
+/**
+ *  Writes back dirty entries and releases the cache
+*/
+sffs_err_t sffs_icache_destroy(sffs_context_t *sffs_ctx);
+
+/**
+ *  Cached versions of GIT entry read and write. Writes only mark 
+ *  the entry dirty, GIT is not touched. Validity of the inode 
+ *  number is checked by the caller
+*/
+sffs_err_t sffs_icache_read(sffs_context_t *sffs_ctx, ino32_t ino, 
+    struct sffs_inode_mem *ino_mem);
+sffs_err_t sffs_icache_write(sffs_context_t *sffs_ctx, const struct sffs_inode_mem *ino_mem);
+
+/**
+ *  Returns cached GIT entry of ino for in place modification. Entry 
+ *  stays in the cache until it is released with sffs_icache_put, 
+ *  which marks it dirty if the entry has been modified
+*/
+sffs_err_t sffs_icache_get(sffs_context_t *sffs_ctx, ino32_t ino, 
+    struct sffs_inode_mem **ino_mem);
+void sffs_icache_put(sffs_context_t *sffs_ctx, ino32_t ino, bool dirty);
+
+/**
+ *  Patches dirty entries into their GIT blocks. Every touched block 
+ *  is written once
+*/
+sffs_err_t sffs_icache_flush(sffs_context_t *sffs_ctx);
+
+/*      sffs_bmap.c     */
+
+/**
+ *  Attaches block map cache to sffs_ctx. Once attached, data block 
+ *  lookups past the primary inode are served by the cache
+*/
+sffs_err_t sffs_bmap_init(sffs_context_t *sffs_ctx);
+void sffs_bmap_destroy(sffs_context_t *sffs_ctx);
+
+/**
+ *  Translates count logical blocks of ino_mem starting from first 
+ *  into data block ids, building the map of the inode on a miss. If 
+ *  entry is not NULL, the inode list entry holding first is stored 
+ *  there. SFFS_ERR_INIT is returned if no cache is attached
+*/
+sffs_err_t sffs_bmap_lookup(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem, 
+    blk32_t first, u32_t count, blk32_t *blocks, ino32_t *entry);
+
+/**
+ *  Records that blocks have been appended to ino as logical blocks 
+ *  [first, first + count)
+*/
+void sffs_bmap_append(sffs_context_t *sffs_ctx, ino32_t ino, blk32_t first, 
+    const blk32_t *blocks, u32_t count);
+
+/**
+ *  Records that ino has been shrunk to count blocks. Count of zero 
+ *  drops the map of ino entirely
+*/
+void sffs_bmap_truncate(sffs_context_t *sffs_ctx, ino32_t ino, blk32_t count);
+
+/*      sffs_extent.c       */
+
+/**
+ *  Translates logical block of ino_mem into data block id. If entry 
+ *  and ext_id are not NULL, inode holding the extent and position 
+ *  of the extent within it are stored there
+*/
+sffs_err_t sffs_ext_lookup(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem, 
+    blk32_t block, blk32_t *block_id, ino32_t *entry, u32_t *ext_id);
+
+/**
+ *  Translates count logical blocks of ino_mem starting from first 
+ *  into data block ids with a single walk of its extents
+*/
+sffs_err_t sffs_ext_get_blocks(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem, 
+    blk32_t first, u32_t count, blk32_t *blocks);
+
+/**
+ *  Appends blocks to the extents of ino_mem. Leading blocks continuing 
+ *  the last extent are merged into it, every other run of consecutive 
+ *  blocks takes a new extent. Inode list is extended if needed. 
+ *  i_blks_count is left to the caller, as is writing ino_mem itself
+*/
+sffs_err_t sffs_ext_append(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem, 
+    const blk32_t *blocks, u32_t count);
+
+/**
+ *  Cuts extents of ino_mem down to its first count blocks. Writing 
+ *  ino_mem is left to the caller
+*/
+sffs_err_t sffs_ext_truncate(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem, 
+    blk32_t count);
+
 #endif  // SFFS_H
\ No newline at end of file
@@ -7,8 +7,116 @@
 #define SFFS_DEVICE_H
 
 #include <unistd.h>
+#include <sys/uio.h>
 #include <sffs.h>
 
+/**
+ *  sffs_backend.c
+*/
+
+/**
+ *  Device backend operations. Backend is chosen at mount time 
+ *  and hides the nature of the underlying storage from the device 
+ *  layer. All offsets are in bytes. pread and pwrite must transfer 
+ *  the whole range or fail and must be safe to be called concurrently
+*/
+struct sffs_dev_ops
+{
+    const char *name;
+    int (*open)(sffs_context_t *sffs_ctx, const char *path, int oflags);
+    void (*close)(sffs_context_t *sffs_ctx);
+    ssize_t (*pread)(sffs_context_t *sffs_ctx, void *data, size_t bytes, 
+        uint64_t offset);
+    ssize_t (*pwrite)(sffs_context_t *sffs_ctx, const void *data, size_t bytes, 
+        uint64_t offset);
+    int (*sync)(sffs_context_t *sffs_ctx);
+    int (*size)(sffs_context_t *sffs_ctx, uint64_t *size);
+
+    /**
+     *  Optional. Scatter/gather versions of pread and pwrite. If not 
+     *  provided, the device layer splits vectors into single transfers
+    */
+    ssize_t (*preadv)(sffs_context_t *sffs_ctx, const struct iovec *iov, int iovcnt, 
+        uint64_t offset);
+    ssize_t (*pwritev)(sffs_context_t *sffs_ctx, const struct iovec *iov, int iovcnt, 
+        uint64_t offset);
+
+    /**
+     *  Optional. Backends which keep the image addressable in memory 
+     *  return pointer to the byte range, NULL otherwise
+    */
+    void *(*map)(sffs_context_t *sffs_ctx, uint64_t offset, size_t bytes);
+
+    /**
+     *  Optional. Tells the storage that the byte range is no longer 
+     *  used, so it might be deallocated. Range reads back as zeros
+    */
+    int (*discard)(sffs_context_t *sffs_ctx, uint64_t offset, uint64_t bytes);
+};
+
+/**
+ *  Regular image file, block device, in-memory and memory-mapped 
+ *  backends. File, block device and mmap backends keep their 
+ *  descriptor in sffs_ctx.disk_id, RAM backend sets it to -1
+*/
+extern const struct sffs_dev_ops sffs_file_ops;
+extern const struct sffs_dev_ops sffs_blkdev_ops;
+extern const struct sffs_dev_ops sffs_ram_ops;
+extern const struct sffs_dev_ops sffs_mmap_ops;
+
+/**
+ *  sffs_stripe.c
+ * 
+ *  Striped volume over several images. Path is a comma separated 
+ *  list of member images in volume order, every member gets the 
+ *  backend matching its type (file or blkdev). sffs_ctx.disk_id 
+ *  is set to -1
+*/
+extern const struct sffs_dev_ops sffs_stripe_ops;
+
+/**
+ *  Opens path with backend named backend ("file", "blkdev", "ram", "mmap" 
+ *  or "stripe") and attaches it to sffs_ctx. If backend is NULL, it is 
+ *  chosen depending on the type of path. A comma separated list of 
+ *  paths selects stripe. oflags are additional open(2) flags, only 
+ *  O_DIRECT is meaningful and only for file and blkdev backends. 
+ *  With O_DIRECT, sffs_ctx.dev_align is set and unaligned transfers 
+ *  are bounced through an aligned buffer
+*/
+int sffs_dev_open(sffs_context_t *sffs_ctx, const char *path, const char *backend, 
+    int oflags);
+void sffs_dev_close(sffs_context_t *sffs_ctx);
+
+/**
+ *  sffs_bufpool.c
+*/
+
+/**
+ *  Creates pool of nr_bufs block-sized buffers aligned to the device 
+ *  alignment (or to the page size if device has none) and attaches 
+ *  it to sffs_ctx
+*/
+int sffs_bufpool_init(sffs_context_t *sffs_ctx, size_t nr_bufs);
+void sffs_bufpool_destroy(sffs_context_t *sffs_ctx);
+
+/**
+ *  Takes one block-sized aligned buffer from the pool. If the pool 
+ *  is exhausted or not attached, buffer is allocated on demand. 
+ *  Returns NULL only if allocation fails
+*/
+void *sffs_buf_get(sffs_context_t *sffs_ctx);
+
+/**
+ *  Returns buffer obtained by sffs_buf_get. NULL is ignored
+*/
+void sffs_buf_put(sffs_context_t *sffs_ctx, void *buf);
+
+/**
+ *  Allocates bytes of memory suitable for direct device I/O. 
+ *  Released with free(3)
+*/
+void *sffs_aligned_alloc(sffs_context_t *sffs_ctx, size_t bytes);
+
 /**
  *  sffs_device.c
 */
@@ -16,7 +124,8 @@
 /**
  *  Device write operation.
  *  Issues write to underlying device denoted by global
- *  sffs_ctx.disk_id file descriptor. 
+ *  sffs_ctx.disk_id file descriptor. Device operations use 
+ *  positional I/O and might be called from several threads
  *  
  *  block - block id where to write
  *  size  - number of blocks how many to write
@@ -57,4 +166,328 @@ int sffs_write_data_blk(sffs_context_t *sffs_ctx, blk32_t block,
 int sffs_read_data_blk(sffs_context_t *sffs_ctx, blk32_t block, 
     void *data, size_t blks);
 
+/**
+ *  Scatter/gather block operations. blocks[i] is transferred from or 
+ *  into bufs[i], every buffer holds exactly one block. Block numbers 
+ *  are arbitrary, runs of adjacent blocks are detected and each run 
+ *  is issued to the device as a single vectored transfer. Blocks held 
+ *  by the block cache are served from it
+*/
+int sffs_read_blkv(sffs_context_t *sffs_ctx, const blk32_t *blocks, 
+    void **bufs, size_t count);
+int sffs_write_blkv(sffs_context_t *sffs_ctx, const blk32_t *blocks, 
+    void **bufs, size_t count);
+
+/**
+ *  The same as sffs_read_blkv and sffs_write_blkv but blocks are 
+ *  relative to a data blocks region
+*/
+int sffs_read_data_blkv(sffs_context_t *sffs_ctx, const blk32_t *blocks, 
+    void **bufs, size_t count);
+int sffs_write_data_blkv(sffs_context_t *sffs_ctx, const blk32_t *blocks, 
+    void **bufs, size_t count);
+
+/**
+ *  Returns pointer to blks absolute blocks starting from block if 
+ *  the backend keeps the image in memory and no block cache is 
+ *  attached, NULL otherwise. Pointer must only be used for reading, 
+ *  modifications still go through sffs_write_blk
+*/
+void *sffs_map_blk(sffs_context_t *sffs_ctx, blk32_t block, size_t blks);
+
+/**
+ *  Returns absolute block number of the first data block
+*/
+blk32_t sffs_data_start(sffs_context_t *sffs_ctx);
+
+/**
+ *  Flushes every dirty block held by the block cache and 
+ *  forces the underlying device to commit them. This is 
+ *  the only point where data reaches the stable storage
+*/
+int sffs_sync(sffs_context_t *sffs_ctx);
+
+/**
+ *  Attaches group commit state to sffs_ctx. Concurrent sffs_sync 
+ *  calls are then merged: one thread flushes and syncs the device 
+ *  on behalf of every caller that arrived before it started
+*/
+int sffs_commit_init(sffs_context_t *sffs_ctx);
+void sffs_commit_destroy(sffs_context_t *sffs_ctx);
+
+/**
+ *  Raw device operations. Bypass the block cache and 
+ *  go straight to the backend. Intended to be used 
+ *  only by the cache itself
+*/
+int __sffs_dev_write(sffs_context_t *sffs_ctx, blk32_t block, 
+    void *data, size_t blks);
+int __sffs_dev_read(sffs_context_t *sffs_ctx, blk32_t block, 
+    void *data, size_t blks);
+
+/**
+ *  Raw scatter/gather operations, see sffs_read_blkv
+*/
+int __sffs_dev_readv(sffs_context_t *sffs_ctx, const blk32_t *blocks, 
+    void **bufs, size_t count);
+int __sffs_dev_writev(sffs_context_t *sffs_ctx, const blk32_t *blocks, 
+    void **bufs, size_t count);
+
+/**
+ *  Byte granular positional versions of raw device operations. 
+ *  Used for structures which are not block aligned, such as 
+ *  superblock. Short transfers are retried internally, so on 
+ *  success exactly bytes are transferred
+*/
+int __sffs_dev_pread(sffs_context_t *sffs_ctx, void *data, size_t bytes, 
+    uint64_t offset);
+int __sffs_dev_pwrite(sffs_context_t *sffs_ctx, const void *data, size_t bytes, 
+    uint64_t offset);
+
+/**
+ *  sffs_cache.c
+*/
+
+/**
+ *  Creates block cache of nr_blocks blocks and attaches it to 
+ *  sffs_ctx. Once cache is attached, sffs_read_blk and 
+ *  sffs_write_blk are served by the cache. If flush_interval 
+ *  is not 0, background flusher is started which writes dirty 
+ *  blocks back every flush_interval seconds
+*/
+int sffs_bcache_init(sffs_context_t *sffs_ctx, size_t nr_blocks, 
+    unsigned int flush_interval);
+
+/**
+ *  Stops background flusher, writes back dirty blocks and 
+ *  releases the cache
+*/
+int sffs_bcache_destroy(sffs_context_t *sffs_ctx);
+
+/**
+ *  Cached versions of sffs_read_blk and sffs_write_blk. 
+ *  Writes only mark blocks dirty, device is not touched
+*/
+int sffs_bcache_read(sffs_context_t *sffs_ctx, blk32_t block, 
+    void *data, size_t blks);
+int sffs_bcache_write(sffs_context_t *sffs_ctx, blk32_t block, 
+    void *data, size_t blks);
+
+/**
+ *  Returns 1 if block is cached and differs from its on-disk copy, 
+ *  0 otherwise
+*/
+int sffs_bcache_dirty(sffs_context_t *sffs_ctx, blk32_t block);
+
+/**
+ *  Drops blks blocks starting at block from the cache without 
+ *  writing them back. Used for blocks which have been freed
+*/
+int sffs_bcache_forget(sffs_context_t *sffs_ctx, blk32_t block, size_t blks);
+
+/**
+ *  Writes every dirty block back to the device in ascending 
+ *  block order, adjacent blocks are merged into vectored writes. 
+ *  Does not issue fsync, see sffs_sync
+*/
+int sffs_bcache_flush(sffs_context_t *sffs_ctx);
+
+/**
+ *  Copies block into data if it is cached and returns 1, otherwise 
+ *  returns 0. Current write sequence number is stored into seq, it 
+ *  must be passed to sffs_bcache_insert for a block read on a miss
+*/
+int sffs_bcache_lookup(sffs_context_t *sffs_ctx, blk32_t block, void *data, 
+    u64_t *seq);
+
+/**
+ *  Inserts clean block read from the device bypassing the cache. 
+ *  Block is dropped silently if it is already cached or if any 
+ *  write happened since sffs_bcache_lookup returned seq
+*/
+int sffs_bcache_insert(sffs_context_t *sffs_ctx, blk32_t block, void *data, 
+    u64_t seq);
+
+/**
+ *  sffs_io.c
+*/
+
+/**
+ *  Single request of a batch. block is an absolute block number
+*/
+struct sffs_io_req
+{
+    blk32_t block;          // First block to read
+    size_t blks;            // Number of blocks
+    void *data;             // Destination buffer
+    int res;                // Number of bytes transferred or error code
+    bool cached;            // Request has been served by the block cache
+    u64_t seq;              // Cache write sequence at lookup time
+};
+
+struct sffs_io_batch
+{
+    struct sffs_io_req *reqs;
+    size_t count;           // Number of queued requests
+    size_t size;            // Capacity of reqs
+};
+
+/**
+ *  Sets up io_uring instance with depth submission queue entries and 
+ *  attaches it to sffs_ctx. If io_uring is not supported by the kernel 
+ *  or by the build, error is returned and batches are executed 
+ *  synchronously
+*/
+int sffs_uring_init(sffs_context_t *sffs_ctx, unsigned int depth);
+void sffs_uring_destroy(sffs_context_t *sffs_ctx);
+
+/**
+ *  Batch is allocated with initial capacity of size requests and 
+ *  grows on demand
+*/
+int sffs_io_batch_init(struct sffs_io_batch *batch, size_t size);
+void sffs_io_batch_release(struct sffs_io_batch *batch);
+
+/**
+ *  Queues read of one absolute (or relative to the data region) block 
+ *  into data. Nothing is issued until sffs_io_submit
+*/
+int sffs_io_queue_read(sffs_context_t *sffs_ctx, struct sffs_io_batch *batch, 
+    blk32_t block, void *data);
+int sffs_io_queue_read_data(sffs_context_t *sffs_ctx, struct sffs_io_batch *batch, 
+    blk32_t block, void *data);
+
+/**
+ *  Submits every queued request. Requests are served by the block 
+ *  cache when possible, the remaining ones go to the device all at once
+*/
+int sffs_io_submit(sffs_context_t *sffs_ctx, struct sffs_io_batch *batch);
+
+/**
+ *  Waits for submitted requests, populates block cache with read 
+ *  blocks and empties batch for reuse. Returns the first error 
+ *  encountered, if any
+*/
+int sffs_io_wait(sffs_context_t *sffs_ctx, struct sffs_io_batch *batch);
+
+/**
+ *  sffs_discard.c
+*/
+
+/**
+ *  Starts discard worker. Does nothing if the backend cannot 
+ *  discard ranges
+*/
+int sffs_discard_init(sffs_context_t *sffs_ctx);
+
+/**
+ *  Issues every queued discard and stops the worker
+*/
+void sffs_discard_destroy(sffs_context_t *sffs_ctx);
+
+/**
+ *  Queues discard of count freed blocks, relative to the data region. 
+ *  Adjacent blocks are merged into extents. Blocks must still be marked 
+ *  in the data bitmap, they are cleared there and counted free once 
+ *  their discard has been issued. Returns SFFS_ERR_INIT without doing 
+ *  anything if discard is not enabled
+*/
+int sffs_discard(sffs_context_t *sffs_ctx, const blk32_t *blocks, size_t count);
+
+/**
+ *  Waits until every queued discard has been issued and its blocks 
+ *  have been released
+*/
+void sffs_discard_drain(sffs_context_t *sffs_ctx);
+
+/**
+ *  sffs_stats.c
+*/
+
+/**
+ *  Image regions I/O is accounted to. Superblock region includes 
+ *  the boot region
+*/
+enum sffs_region
+{
+    SFFS_REGION_SB,
+    SFFS_REGION_GROUP_DESC,
+    SFFS_REGION_DATA_BM,
+    SFFS_REGION_GIT_BM,
+    SFFS_REGION_GIT,
+    SFFS_REGION_DATA,
+    SFFS_REGION_COUNT
+};
+
+#define SFFS_STAT_READ      0
+#define SFFS_STAT_WRITE     1
+
+/**
+ *  Copy of the counters of one region and direction. hist[k] counts 
+ *  operations which took [2^(k-1), 2^k) nanoseconds, the last bucket 
+ *  counts all the slower ones
+*/
+struct sffs_io_stat_snap
+{
+    u64_t count;
+    u64_t bytes;
+    u64_t time_ns;
+    u64_t hist[SFFS_STATS_BUCKETS];
+};
+
+int sffs_stats_init(sffs_context_t *sffs_ctx);
+void sffs_stats_destroy(sffs_context_t *sffs_ctx);
+
+/**
+ *  Accounting is done in pairs. sffs_stats_start returns the start 
+ *  timestamp, sffs_stats_account records an operation of bytes on 
+ *  the region holding absolute block. Both are no-ops if statistics 
+ *  are not attached
+*/
+u64_t sffs_stats_start(sffs_context_t *sffs_ctx);
+void sffs_stats_account(sffs_context_t *sffs_ctx, blk32_t block, int op, 
+    size_t bytes, u64_t start);
+
+/**
+ *  Reads current counters of region for op (SFFS_STAT_READ or 
+ *  SFFS_STAT_WRITE)
+*/
+int sffs_stats_get(sffs_context_t *sffs_ctx, int region, int op, 
+    struct sffs_io_stat_snap *snap);
+
+/**
+ *  Formats human readable report into buf like snprintf does and 
+ *  returns the length of the whole report
+*/
+size_t sffs_stats_format(sffs_context_t *sffs_ctx, char *buf, size_t size);
+
+/**
+ *  Writes report into the log file, or to stderr if there is none
+*/
+void sffs_stats_dump(sffs_context_t *sffs_ctx);
+
+/**
+ *  sffs_readahead.c
+*/
+
+/**
+ *  Starts readahead worker with windows of at most max_window blocks. 
+ *  Readahead fills the block cache, so nothing is done if max_window 
+ *  is 0 or no cache is attached
+*/
+int sffs_ra_init(sffs_context_t *sffs_ctx, u32_t max_window);
+
+/**
+ *  Stops the worker, pending windows are dropped
+*/
+void sffs_ra_destroy(sffs_context_t *sffs_ctx);
+
+/**
+ *  Records read of count logical blocks of ino_mem starting at block. 
+ *  If the access continues a sequential stream, the next window is 
+ *  mapped and queued for asynchronous read into the block cache
+*/
+void sffs_readahead(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem,
+    blk32_t block, u32_t count);
+
 #endif  // SFFS_DEVICE_H
\ No newline at end of file
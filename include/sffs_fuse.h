@@ -41,6 +41,14 @@
 #define THUMB_FUNC
 #endif
 
+/**
+ *  Extended attribute holding the I/O statistics report. Report is 
+ *  formatted anew on every call, so the size returned to a sizing 
+ *  call includes slack for the counters growing in between
+*/
+#define SFFS_XATTR_STATS            "user.sffs.stats"
+#define SFFS_XATTR_STATS_SLACK      1024
+
 // sffs.c
 int sffs_getattr(const char *, struct stat *);
 
@@ -3,11 +3,79 @@
  *  Copyright (c) 2023 Danylo Malapura
 */
 
+/**
+ *  Bitmap handlers. After sffs_bm_load both bitmaps are mirrored in 
+ *  memory: bits are tested and flipped there and bitmap blocks changed 
+ *  since the last writeback are flagged dirty. sffs_bm_flush writes the 
+ *  dirty blocks back, it runs as part of every sync. Contexts without 
+ *  mirrors go to the device for every access.
+ *
+ *  Mirrors take no lock. Bits are flipped with atomic operations on the
+ *  64-bit words holding them, so of the threads racing for a bit exactly
+ *  one gets it and the others get SFFS_ERR_FS. Dirty flags and group
+ *  counters are atomic as well.
+ *
+ *  Along with the data bitmap, number of free blocks of every group is 
+ *  kept. The counters are the group descriptor area on the device and 
+ *  are written back like bitmap blocks. Two summary bitmaps over groups, 
+ *  groups with a free block and groups with all blocks free, answer 
+ *  which group to allocate from without scanning the data bitmap. The 
+ *  same kind of summary over words of the GIT bitmap, words with a free 
+ *  entry, and a rotating cursor make finding a free inode independent 
+ *  of how full the table is
+*/
+
 #include <sffs.h>
 #include <sffs_device.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SFFS_BM_AVX2
+#endif
+
+struct sffs_bm_mirror
+{
+    blk32_t start;          // First bitmap block on the device
+    blk32_t size;           // Bitmap size in blocks
+    u8_t *bits;
+    u8_t *dirty;            // One flag per bitmap block, accessed atomically
+};
+
+/**
+ *  Two level bitmap over groups. Bit of l1 is set when the corresponding 
+ *  word of l0 is not zero, so a set bit is found looking at a couple of 
+ *  words at most
+*/
+struct sffs_grp_map
+{
+    u64_t *l0;              // One bit per group
+    u64_t *l1;              // One bit per word of l0
+    u32_t words;            // Number of words in l0
+};
+
+struct sffs_bitmaps
+{
+    struct sffs_bm_mirror data;
+    struct sffs_bm_mirror GIT;
+    struct sffs_bm_mirror desc; // Free blocks per group (u32_t), size 0 if not on disk
+    u32_t group_count;
+    struct sffs_grp_map avail;  // Groups with at least one free block
+    struct sffs_grp_map empty;  // Groups with all blocks free
+    struct sffs_grp_map ifree;  // GIT bitmap words with a free entry
+    u32_t ino_words;            // Number of GIT bitmap words covering the inodes
+    bmap_t ino_cursor;          // Where the next free inode is looked for
+};
 
 static sffs_err_t __sffs_set_bm(sffs_context_t *sffs_ctx, blk32_t, bmap_t, u8_t);
 static sffs_err_t __sffs_check_bm(sffs_context_t *sffs_ctx, blk32_t, bmap_t);
+static sffs_err_t __sffs_set_bm_range(sffs_context_t *sffs_ctx, blk32_t, bmap_t, u32_t, u8_t);
+static void __sffs_grp_account(sffs_context_t *sffs_ctx, bmap_t, u32_t, u8_t);
+static void __sffs_ino_account(struct sffs_bitmaps *, u64_t, u64_t);
+static sffs_err_t __sffs_bm_mirror_load(sffs_context_t *sffs_ctx, struct sffs_bm_mirror *, 
+    blk32_t, blk32_t);
 sffs_err_t __set_bm(blk32_t *, bmap_t, u8_t);
 sffs_err_t __check_bm(blk32_t *, bmap_t);
 
@@ -41,15 +109,76 @@ sffs_err_t sffs_check_GIT_bm(sffs_context_t *sffs_ctx, bmap_t id)
     return __sffs_check_bm(sffs_ctx, sffs_ctx->sb.s_GIT_bitmap_start, id);
 }
 
+sffs_err_t sffs_set_data_bm_range(sffs_context_t *sffs_ctx, bmap_t start, u32_t count)
+{
+    return __sffs_set_bm_range(sffs_ctx, sffs_ctx->sb.s_data_bitmap_start, start, count, 1);
+}
+
+sffs_err_t sffs_unset_data_bm_range(sffs_context_t *sffs_ctx, bmap_t start, u32_t count)
+{
+    return __sffs_set_bm_range(sffs_ctx, sffs_ctx->sb.s_data_bitmap_start, start, count, 0);
+}
+
+sffs_err_t sffs_set_GIT_bm_range(sffs_context_t *sffs_ctx, bmap_t start, u32_t count)
+{
+    return __sffs_set_bm_range(sffs_ctx, sffs_ctx->sb.s_GIT_bitmap_start, start, count, 1);
+}
+
+sffs_err_t sffs_unset_GIT_bm_range(sffs_context_t *sffs_ctx, bmap_t start, u32_t count)
+{
+    return __sffs_set_bm_range(sffs_ctx, sffs_ctx->sb.s_GIT_bitmap_start, start, count, 0);
+}
+
+static struct sffs_bm_mirror *__sffs_bm_mirror(sffs_context_t *sffs_ctx, blk32_t bm)
+{
+    struct sffs_bitmaps *bms = sffs_ctx->bitmaps;
+    if(!bms)
+        return NULL;
+    if(bm == bms->data.start)
+        return &bms->data;
+    if(bm == bms->GIT.start)
+        return &bms->GIT;
+    return NULL;
+}
+
+/**
+ *  Flag is raised after the bits have changed, so a flush which takes it
+ *  down sees the change, a flush which has already taken it down is
+ *  followed by another one
+*/
+static inline void __bm_mark_dirty(struct sffs_bm_mirror *mirror, blk32_t block)
+{
+    __atomic_store_n(&mirror->dirty[block], 1, __ATOMIC_RELEASE);
+}
+
 static sffs_err_t __sffs_set_bm(sffs_context_t *sffs_ctx, blk32_t bm, bmap_t id, u8_t value)
 {
     value &= 0x1;
     blk32_t block_size = sffs_ctx->sb.s_block_size;
     blk32_t bm_start = bm;
-    blk32_t bm_block = id / block_size;     // Block number that holds id bitmap value
-    bmap_t bm_id = id % block_size;         // Bit number wihtin victim block
+    blk32_t bm_block = id / (block_size * 8);   // Block number that holds id bitmap value
+    bmap_t bm_id = id % (block_size * 8);       // Bit number wihtin victim block
 
     sffs_err_t errc;
+    struct sffs_bm_mirror *mirror = __sffs_bm_mirror(sffs_ctx, bm);
+    if(mirror)
+    {
+        if(bm_block >= mirror->size)
+            return SFFS_ERR_INVARG;
+
+        errc = __set_bm((blk32_t *) (mirror->bits + (size_t) bm_block * block_size),
+            bm_id, value);
+        if(errc >= 0)
+        {
+            __bm_mark_dirty(mirror, bm_block);
+            if(mirror == &sffs_ctx->bitmaps->data)
+                __sffs_grp_account(sffs_ctx, id, 1, value);
+            else
+                __sffs_ino_account(sffs_ctx->bitmaps, id, (u64_t) id + 1);
+        }
+        return errc;
+    }
+
     errc = sffs_read_blk(sffs_ctx, bm_start + bm_block, sffs_ctx->cache, 1);
     if(errc < 0)
         return errc;
@@ -64,12 +193,81 @@ static sffs_err_t __sffs_set_bm(sffs_context_t *sffs_ctx, blk32_t bm, bmap_t id,
     return true;
 }
 
+/**
+ *  Every bitmap block the range touches is changed in memory and 
+ *  written once: mirrored blocks are just flagged dirty, otherwise 
+ *  the blocks are read and written back with a single call each
+*/
+static sffs_err_t __sffs_set_bm_range(sffs_context_t *sffs_ctx, blk32_t bm, bmap_t start, 
+    u32_t count, u8_t value)
+{
+    if(count == 0)
+        return 0;
+
+    value &= 0x1;
+    blk32_t block_size = sffs_ctx->sb.s_block_size;
+    u64_t bits_per_blk = (u64_t) block_size * 8;
+    u64_t end = (u64_t) start + count;
+    blk32_t first = start / bits_per_blk;
+    blk32_t last = (end - 1) / bits_per_blk;
+
+    sffs_err_t errc;
+    struct sffs_bm_mirror *mirror = __sffs_bm_mirror(sffs_ctx, bm);
+    if(mirror)
+    {
+        if(last >= mirror->size)
+            return SFFS_ERR_INVARG;
+
+        errc = __set_range_bm(mirror->bits, start, end, value);
+        if(errc >= 0)
+        {
+            for(blk32_t i = first; i <= last; i++)
+                __bm_mark_dirty(mirror, i);
+            if(mirror == &sffs_ctx->bitmaps->data)
+                __sffs_grp_account(sffs_ctx, start, count, value);
+            else
+                __sffs_ino_account(sffs_ctx->bitmaps, start, end);
+        }
+        return errc;
+    }
+
+    blk32_t blks = last - first + 1;
+    u8_t *buf = sffs_aligned_alloc(sffs_ctx, (size_t) blks * block_size);
+    if(!buf)
+        return SFFS_ERR_MEMALLOC;
+
+    u64_t base = (u64_t) first * bits_per_blk;
+    errc = sffs_read_blk(sffs_ctx, bm + first, buf, blks);
+    if(errc >= 0)
+        errc = __set_range_bm(buf, start - base, end - base, value);
+    if(errc >= 0)
+        errc = sffs_write_blk(sffs_ctx, bm + first, buf, blks);
+
+    free(buf);
+    return errc < 0 ? errc : 0;
+}
+
 sffs_err_t __sffs_check_bm(sffs_context_t *sffs_ctx, blk32_t bm, bmap_t id)
 {
     blk32_t block_size = sffs_ctx->sb.s_block_size;
     blk32_t bm_start = bm;
-    blk32_t bm_block = id / block_size;     // Block number that holds id bitmap value
-    bmap_t bm_id = id % block_size;         // Bit number wihtin victim block
+    blk32_t bm_block = id / (block_size * 8);   // Block number that holds id bitmap value
+    bmap_t bm_id = id % (block_size * 8);       // Bit number wihtin victim block
+
+    struct sffs_bm_mirror *mirror = __sffs_bm_mirror(sffs_ctx, bm);
+    if(mirror)
+    {
+        if(bm_block >= mirror->size)
+            return SFFS_ERR_INVARG;
+
+        return __check_bm((blk32_t *) (mirror->bits + (size_t) bm_block * block_size),
+            bm_id);
+    }
+
+    // Mapped image needs neither a read nor a copy
+    void *bm_ptr = sffs_map_blk(sffs_ctx, bm_start + bm_block, 1);
+    if(bm_ptr)
+        return __check_bm(bm_ptr, bm_id);
 
     sffs_err_t errc;
     errc = sffs_read_blk(sffs_ctx, bm_start + bm_block, sffs_ctx->cache, 1);
@@ -79,35 +277,897 @@ sffs_err_t __sffs_check_bm(sffs_context_t *sffs_ctx, blk32_t bm, bmap_t id)
     return __check_bm(sffs_ctx->cache, bm_id);
 }
 
+/**
+ *  Bit id lives in byte id / 8 at position id % 8, that is at position 
+ *  id % 64 of little-endian word id / 64. Bitmap buffers are whole 
+ *  blocks, aligned at least to a word
+*/
+static inline u64_t *__bm_wordp(void *bm, u64_t id)
+{
+    return (u64_t *) bm + id / 64;
+}
+
+/**
+ *  Mask of bits [start, end) within their common word, in memory order
+*/
+static inline u64_t __bm_mask(u64_t start, u64_t end)
+{
+    u64_t mask = ~0ULL << (start % 64);
+    if(end % 64 != 0)
+        mask &= ~0ULL >> (64 - end % 64);
+    return htole64(mask);
+}
+
 sffs_err_t __check_bm(blk32_t *bm, bmap_t id)
 {
-    u32_t byte_id = id / 8;
-    u32_t bit_id = id % 8;
-    u8_t *byte = (u8_t *)(bm) + byte_id;
-    if((*byte & (1 << bit_id)) == (1 << bit_id))
-        return true;
-    else 
-        return false;
+    u64_t word = __atomic_load_n(__bm_wordp(bm, id), __ATOMIC_ACQUIRE);
+    return (word & __bm_mask(id, id + 1)) != 0;
 }
 
+/**
+ *  Test and set (or clear) in a single atomic operation, the bit has 
+ *  been claimed by this call only if it held the other value before
+*/
 sffs_err_t __set_bm(blk32_t *bm, bmap_t id, u8_t value)
 {   
-    u32_t byte_id = id / 8;
-    u32_t bit_id = id % 8;
-    u8_t *byte = (u8_t *)(bm) + byte_id;
+    u64_t *word = __bm_wordp(bm, id);
+    u64_t mask = __bm_mask(id, id + 1);
+    u64_t old;
+
+    if(value)
+        old = __atomic_fetch_or(word, mask, __ATOMIC_ACQ_REL);
+    else
+        old = __atomic_fetch_and(word, ~mask, __ATOMIC_ACQ_REL);
+
+    // Bit already holding the value means double allocation or double free
+    if(((old & mask) != 0) == (value != 0))
+        return SFFS_ERR_FS;
+    return true;
+}
+
+/**
+ *  Flips bits [start, end) of words claimed by __set_range_bm back
+*/
+static void __undo_range_bm(void *bm, u64_t start, u64_t end, u8_t value)
+{
+    for(u64_t pos = start; pos < end; )
+    {
+        u64_t next = (pos / 64 + 1) * 64;
+        if(next > end)
+            next = end;
+
+        u64_t mask = __bm_mask(pos, next);
+        if(value)
+            __atomic_fetch_and(__bm_wordp(bm, pos), ~mask, __ATOMIC_ACQ_REL);
+        else
+            __atomic_fetch_or(__bm_wordp(bm, pos), mask, __ATOMIC_ACQ_REL);
+        pos = next;
+    }
+}
+
+sffs_err_t __set_range_bm(void *bm, u64_t start, u64_t end, u8_t value)
+{
+    /**
+     *  Words are claimed one by one with compare-and-swap, a word only if 
+     *  none of its bits within the range holds the value yet. The whole 
+     *  range is refused if a single bit does, words claimed so far are 
+     *  flipped back then
+    */
+    for(u64_t pos = start; pos < end; )
+    {
+        u64_t next = (pos / 64 + 1) * 64;
+        if(next > end)
+            next = end;
+
+        u64_t *word = __bm_wordp(bm, pos);
+        u64_t mask = __bm_mask(pos, next);
+        u64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+        u64_t new;
+        do
+        {
+            if((value ? old : ~old) & mask)
+            {
+                __undo_range_bm(bm, start, pos, value);
+                return SFFS_ERR_FS;
+            }
+            new = value ? old | mask : old & ~mask;
+        } while(!__atomic_compare_exchange_n(word, &old, new, true, __ATOMIC_ACQ_REL, 
+            __ATOMIC_RELAXED));
+        pos = next;
+    }
+    return 0;
+}
+
+/*          Search primitives           */
 
-    if((*byte & (1 << bit_id)) != (1 << bit_id))
+/**
+ *  Bitmaps are searched 64 bits at a time, a little-endian load of word 
+ *  w yields bits [64 * w, 64 * w + 64) in order. Buffers are whole bitmap 
+ *  blocks, thus any word touching the searched range can be loaded. 
+ *  Mirrors change under the search, words are loaded atomically and what 
+ *  has been found is only a candidate until it is claimed
+*/
+static inline u64_t __bm_word(const u8_t *bm, u64_t w)
+{
+    return le64toh(__atomic_load_n((const u64_t *) bm + w, __ATOMIC_RELAXED));
+}
+
+/**
+ *  Returns the first word in [w, last) which differs from pattern 
+ *  (all zeros or all ones), last if there is none
+*/
+static u64_t __bm_skip_words_scalar(const u8_t *bm, u64_t w, u64_t last, u64_t pattern)
+{
+    while(w < last && __bm_word(bm, w) == pattern)
+        w++;
+    return w;
+}
+
+#ifdef SFFS_BM_AVX2
+/**
+ *  Vector loads are not atomic. Words are only skipped here, the word 
+ *  the search stops at is loaded again by __bm_word
+*/
+__attribute__((target("avx2"), no_sanitize("thread")))
+static u64_t __bm_skip_words_avx2(const u8_t *bm, u64_t w, u64_t last, u64_t pattern)
+{
+    __m256i pat = _mm256_set1_epi64x((long long) pattern);
+
+    // 256 bits at once, until a word of the quad differs from the pattern
+    while(w + 4 <= last)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (bm + w * 8));
+        if(!_mm256_testc_si256(_mm256_cmpeq_epi64(v, pat), _mm256_set1_epi64x(-1)))
+            break;
+        w += 4;
+    }
+    return __bm_skip_words_scalar(bm, w, last, pattern);
+}
+#endif
+
+static u64_t __bm_skip_words(const u8_t *bm, u64_t w, u64_t last, u64_t pattern)
+{
+#ifdef SFFS_BM_AVX2
+    static int has_avx2 = -1;
+    int avx2 = __atomic_load_n(&has_avx2, __ATOMIC_RELAXED);
+    if(avx2 < 0)
+    {
+        avx2 = __builtin_cpu_supports("avx2");
+        __atomic_store_n(&has_avx2, avx2, __ATOMIC_RELAXED);
+    }
+    if(avx2)
+        return __bm_skip_words_avx2(bm, w, last, pattern);
+#endif
+    return __bm_skip_words_scalar(bm, w, last, pattern);
+}
+
+/**
+ *  Finds the first bit in [start, end) equal to value, end if none
+*/
+static u64_t __find_bit_bm(const u8_t *bm, u64_t start, u64_t end, u8_t value)
+{
+    if(start >= end)
+        return end;
+
+    u64_t flip = value ? 0 : ~0ULL;     // Searched bits become ones
+    u64_t w = start / 64;
+    u64_t word = (__bm_word(bm, w) ^ flip) & (~0ULL << (start % 64));
+
+    while(word == 0)
+    {
+        if(++w * 64 >= end)
+            return end;
+
+        // Words completely inside the range are skipped in bulk
+        w = __bm_skip_words(bm, w, end / 64, flip);
+        if(w * 64 >= end)
+            return end;
+        word = __bm_word(bm, w) ^ flip;
+    }
+
+    u64_t bit = w * 64 + __builtin_ctzll(word);
+    return bit < end ? bit : end;
+}
+
+u64_t __find_zero_bm(const void *bm, u64_t start, u64_t end)
+{
+    return __find_bit_bm((const u8_t *) bm, start, end, 0);
+}
+
+u64_t __find_one_bm(const void *bm, u64_t start, u64_t end)
+{
+    return __find_bit_bm((const u8_t *) bm, start, end, 1);
+}
+
+u64_t __find_zero_run_bm(const void *bm, u64_t start, u64_t end, u64_t len)
+{
+    const u8_t *bits = (const u8_t *) bm;
+    if(len == 0)
+        return start < end ? start : end;
+
+    while(start < end)
+    {
+        u64_t zero = __find_bit_bm(bits, start, end, 0);
+        if(zero >= end || end - zero < len)
+            return end;
+
+        // Run is long enough if no set bit shows up within len bits
+        u64_t one = __find_bit_bm(bits, zero, zero + len, 1);
+        if(one == zero + len)
+            return zero;
+        start = one + 1;
+    }
+    return end;
+}
+
+u64_t __count_zero_bm(const void *bm, u64_t start, u64_t end)
+{
+    const u8_t *bits = (const u8_t *) bm;
+    u64_t count = 0;
+
+    for(u64_t pos = start; pos < end; )
     {
-        if(value == 1)
-            *byte |= (1 << bit_id);     // set bit to 1
-        else if(value == 0)
+        u64_t w = pos / 64;
+        u64_t word = ~__bm_word(bits, w) & (~0ULL << (pos % 64));
+        u64_t next = (w + 1) * 64;
+        if(next > end)
         {
-            u8_t mask = ~(1 << bit_id);
-            *byte &= mask;                  // set bit to 0
+            word &= ~0ULL >> (next - end);
+            next = end;
         }
+        count += __builtin_popcountll(word);
+        pos = next;
     }
-    else 
-        return SFFS_ERR_FS;
+    return count;
+}
 
-    return true;
-}
\ No newline at end of file
+/**
+ *  Gives access to bits [start, end) of the bitmap at bm. Mirrored 
+ *  bitmaps are used in place, otherwise the blocks 
+ *  covering the range are read into a temporary buffer. *base is the 
+ *  id of the first bit of *bits
+*/
+static sffs_err_t __sffs_bm_view(sffs_context_t *sffs_ctx, blk32_t bm, bmap_t start, 
+    bmap_t end, const u8_t **bits, u64_t *base)
+{
+    u64_t bits_per_blk = (u64_t) sffs_ctx->sb.s_block_size * 8;
+    struct sffs_bm_mirror *mirror = __sffs_bm_mirror(sffs_ctx, bm);
+    if(mirror)
+    {
+        if(end > mirror->size * bits_per_blk)
+            return SFFS_ERR_INVARG;
+
+        *bits = mirror->bits;
+        *base = 0;
+        return 0;
+    }
+
+    blk32_t first = start / bits_per_blk;
+    blk32_t count = (end - 1) / bits_per_blk - first + 1;
+    u8_t *buf = malloc((size_t) count * sffs_ctx->sb.s_block_size);
+    if(!buf)
+        return SFFS_ERR_MEMALLOC;
+
+    for(blk32_t i = 0; i < count; i++)
+    {
+        sffs_err_t errc = sffs_read_blk(sffs_ctx, bm + first + i, 
+            buf + (size_t) i * sffs_ctx->sb.s_block_size, 1);
+        if(errc < 0)
+        {
+            free(buf);
+            return errc;
+        }
+    }
+
+    *bits = buf;
+    *base = (u64_t) first * bits_per_blk;
+    return 0;
+}
+
+static void __sffs_bm_unview(sffs_context_t *sffs_ctx, blk32_t bm, const u8_t *bits)
+{
+    if(!__sffs_bm_mirror(sffs_ctx, bm))
+        free((void *) bits);
+}
+
+sffs_err_t sffs_bm_find_zero(sffs_context_t *sffs_ctx, blk32_t bm, bmap_t start, 
+    bmap_t end, bmap_t *res)
+{
+    if(!sffs_ctx || !res)
+        return SFFS_ERR_INVARG;
+    if(start >= end)
+        return SFFS_ERR_NOSPC;
+
+    const u8_t *bits;
+    u64_t base;
+    sffs_err_t errc = __sffs_bm_view(sffs_ctx, bm, start, end, &bits, &base);
+    if(errc < 0)
+        return errc;
+
+    u64_t found = __find_zero_bm(bits, start - base, end - base) + base;
+    __sffs_bm_unview(sffs_ctx, bm, bits);
+
+    if(found >= end)
+        return SFFS_ERR_NOSPC;
+    *res = found;
+    return 0;
+}
+
+sffs_err_t sffs_bm_find_zero_run(sffs_context_t *sffs_ctx, blk32_t bm, bmap_t start, 
+    bmap_t end, u32_t len, bmap_t *res)
+{
+    if(!sffs_ctx || !res)
+        return SFFS_ERR_INVARG;
+    if(start >= end)
+        return SFFS_ERR_NOSPC;
+
+    const u8_t *bits;
+    u64_t base;
+    sffs_err_t errc = __sffs_bm_view(sffs_ctx, bm, start, end, &bits, &base);
+    if(errc < 0)
+        return errc;
+
+    u64_t found = __find_zero_run_bm(bits, start - base, end - base, len) + base;
+    __sffs_bm_unview(sffs_ctx, bm, bits);
+
+    if(found >= end)
+        return SFFS_ERR_NOSPC;
+    *res = found;
+    return 0;
+}
+
+sffs_err_t sffs_bm_count_zero(sffs_context_t *sffs_ctx, blk32_t bm, bmap_t start, 
+    bmap_t end, u32_t *count)
+{
+    if(!sffs_ctx || !count)
+        return SFFS_ERR_INVARG;
+
+    *count = 0;
+    if(start >= end)
+        return 0;
+
+    const u8_t *bits;
+    u64_t base;
+    sffs_err_t errc = __sffs_bm_view(sffs_ctx, bm, start, end, &bits, &base);
+    if(errc < 0)
+        return errc;
+
+    *count = __count_zero_bm(bits, start - base, end - base);
+    __sffs_bm_unview(sffs_ctx, bm, bits);
+    return 0;
+}
+
+/*          Groups          */
+
+static inline u32_t *__grp_free(struct sffs_bitmaps *bms)
+{
+    return (u32_t *) bms->desc.bits;
+}
+
+static inline void __grp_bit_set(u64_t *word, u32_t bit, bool on)
+{
+    if(on)
+        __atomic_fetch_or(word, 1ULL << bit, __ATOMIC_SEQ_CST);
+    else
+        __atomic_fetch_and(word, ~(1ULL << bit), __ATOMIC_SEQ_CST);
+}
+
+/**
+ *  Bit of l1 is derived from a word of l0 other threads change as well. 
+ *  It is set again until the word has not changed meanwhile, so the 
+ *  last thread to set it has seen the final word
+*/
+static void __grp_map_set(struct sffs_grp_map *map, u32_t grp, bool on)
+{
+    u32_t w = grp / 64;
+    u64_t word;
+
+    __grp_bit_set(&map->l0[w], grp % 64, on);
+    do
+    {
+        word = __atomic_load_n(&map->l0[w], __ATOMIC_SEQ_CST);
+        __grp_bit_set(&map->l1[w / 64], w % 64, word != 0);
+    } while(__atomic_load_n(&map->l0[w], __ATOMIC_SEQ_CST) != word);
+}
+
+/**
+ *  Returns the first group at or after from with its bit set, 
+ *  count if there is none
+*/
+static u32_t __grp_map_find(struct sffs_grp_map *map, u32_t from, u32_t count)
+{
+    u32_t w = from / 64;
+    if(from >= count)
+        return count;
+
+    u64_t word = __atomic_load_n(&map->l0[w], __ATOMIC_RELAXED) & (~0ULL << (from % 64));
+    if(word)
+        return w * 64 + __builtin_ctzll(word);
+
+    // Word of l0 might have been cleared since l1 was looked at
+    for(u32_t next = w + 1; next < map->words; )
+    {
+        u64_t l1_word = __atomic_load_n(&map->l1[next / 64], __ATOMIC_RELAXED) & 
+            (~0ULL << (next % 64));
+        if(l1_word)
+        {
+            u32_t idx = (next / 64) * 64 + __builtin_ctzll(l1_word);
+            word = __atomic_load_n(&map->l0[idx], __ATOMIC_RELAXED);
+            if(word)
+                return idx * 64 + __builtin_ctzll(word);
+            next = idx + 1;
+            continue;
+        }
+        next = (next / 64 + 1) * 64;
+    }
+    return count;
+}
+
+static sffs_err_t __grp_map_init(struct sffs_grp_map *map, u32_t count)
+{
+    map->words = (count + 63) / 64;
+    map->l0 = calloc(map->words + 1, sizeof(u64_t));
+    map->l1 = calloc(map->words / 64 + 1, sizeof(u64_t));
+    if(!map->l0 || !map->l1)
+        return SFFS_ERR_MEMALLOC;
+    return 0;
+}
+
+/**
+ *  Summary bits follow the counter the same way l1 follows l0
+*/
+static void __grp_update(struct sffs_bitmaps *bms, u32_t grp, u32_t grp_size)
+{
+    u32_t *counter = &__grp_free(bms)[grp];
+    u32_t free_blks;
+    do
+    {
+        free_blks = __atomic_load_n(counter, __ATOMIC_SEQ_CST);
+        __grp_map_set(&bms->avail, grp, free_blks != 0);
+        __grp_map_set(&bms->empty, grp, free_blks == grp_size);
+    } while(__atomic_load_n(counter, __ATOMIC_SEQ_CST) != free_blks);
+}
+
+/**
+ *  Accounts data blocks [start, start + count) which have just been 
+ *  set to value in the group counters and flags them stale in the free 
+ *  extent index
+*/
+static void __sffs_grp_account(sffs_context_t *sffs_ctx, bmap_t start, u32_t count, 
+    u8_t value)
+{
+    struct sffs_bitmaps *bms = sffs_ctx->bitmaps;
+    u32_t grp_size = sffs_ctx->sb.s_blocks_per_group;
+    u32_t per_blk = sffs_ctx->sb.s_block_size / sizeof(u32_t);
+    u64_t end = (u64_t) start + count;
+
+    sffs_freeidx_stale(sffs_ctx, start, count);
+
+    // Blocks past the last whole group belong to none
+    for(u64_t pos = start; pos < end; )
+    {
+        u32_t grp = pos / grp_size;
+        if(grp >= bms->group_count)
+            break;
+
+        u64_t grp_end = (u64_t) (grp + 1) * grp_size;
+        u32_t blks = (end < grp_end ? end : grp_end) - pos;
+        u32_t *free_blks = &__grp_free(bms)[grp];
+
+        /**
+         *  Superblock count of free groups follows the counters. Exactly 
+         *  one update sees a counter leave or reach the group size
+        */
+        if(value)
+        {
+            if(__atomic_fetch_sub(free_blks, blks, __ATOMIC_ACQ_REL) == grp_size)
+                __atomic_fetch_sub(&sffs_ctx->sb.s_free_groups, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            if(__atomic_add_fetch(free_blks, blks, __ATOMIC_ACQ_REL) == grp_size)
+                __atomic_fetch_add(&sffs_ctx->sb.s_free_groups, 1, __ATOMIC_RELAXED);
+        }
+
+        __grp_update(bms, grp, grp_size);
+        if(bms->desc.size != 0)
+            __bm_mark_dirty(&bms->desc, grp / per_blk);
+        pos = grp_end;
+    }
+}
+
+/**
+ *  Group counters are taken from the group descriptor area when the 
+ *  image has one, otherwise (or if they do not make sense) they are 
+ *  counted from the data bitmap mirror
+*/
+static sffs_err_t __sffs_grp_load(sffs_context_t *sffs_ctx, struct sffs_bitmaps *bms)
+{
+    struct sffs_superblock *sb = &sffs_ctx->sb;
+    u32_t grp_size = sb->s_blocks_per_group;
+    u32_t count = grp_size ? sb->s_group_count : 0;
+    sffs_err_t errc;
+
+    bms->group_count = count;
+    if((sb->s_features & SFFS_FEATURE_GROUP_DESC) && (u64_t) count * sizeof(u32_t) 
+        <= (u64_t) sb->s_group_desc_size * sb->s_block_size)
+    {
+        errc = __sffs_bm_mirror_load(sffs_ctx, &bms->desc, sb->s_group_desc_start, 
+            sb->s_group_desc_size);
+        if(errc < 0)
+            return errc;
+    }
+    else
+    {
+        bms->desc.bits = calloc(count + 1, sizeof(u32_t));
+        if(!bms->desc.bits)
+            return SFFS_ERR_MEMALLOC;
+    }
+
+    errc = __grp_map_init(&bms->avail, count);
+    if(errc == 0)
+        errc = __grp_map_init(&bms->empty, count);
+    if(errc < 0)
+        return errc;
+
+    bool valid = bms->desc.size != 0;
+    for(u32_t i = 0; i < count && valid; i++)
+        valid = __grp_free(bms)[i] <= grp_size;
+
+    // Free groups are counted again, updates only follow transitions
+    sb->s_free_groups = 0;
+    for(u32_t i = 0; i < count; i++)
+    {
+        if(!valid)
+        {
+            __grp_free(bms)[i] = __count_zero_bm(bms->data.bits, (u64_t) i * grp_size, 
+                (u64_t) (i + 1) * grp_size);
+            if(bms->desc.size != 0)
+                bms->desc.dirty[i / (sb->s_block_size / sizeof(u32_t))] = true;
+        }
+        if(__grp_free(bms)[i] == grp_size)
+            sb->s_free_groups++;
+        __grp_update(bms, i, grp_size);
+    }
+    return 0;
+}
+
+static sffs_err_t __sffs_grp_find(sffs_context_t *sffs_ctx, u32_t from, bool empty, 
+    u32_t *grp)
+{
+    if(!sffs_ctx || !grp)
+        return SFFS_ERR_INVARG;
+
+    struct sffs_bitmaps *bms = sffs_ctx->bitmaps;
+    u32_t grp_size = sffs_ctx->sb.s_blocks_per_group;
+    u32_t count = sffs_ctx->sb.s_group_count;
+    u32_t found = count;
+
+    if(bms)
+    {
+        found = __grp_map_find(empty ? &bms->empty : &bms->avail, from, bms->group_count);
+        count = bms->group_count;
+    }
+    else
+    {
+        // No counters, every group is counted on the device
+        for(found = from; found < count; found++)
+        {
+            u32_t free_blks;
+            sffs_err_t errc = sffs_grp_free_blocks(sffs_ctx, found, &free_blks);
+            if(errc < 0)
+                return errc;
+            if(empty ? free_blks == grp_size : free_blks != 0)
+                break;
+        }
+    }
+
+    if(found >= count)
+        return SFFS_ERR_NOSPC;
+    *grp = found;
+    return 0;
+}
+
+sffs_err_t sffs_grp_find_empty(sffs_context_t *sffs_ctx, u32_t from, u32_t *grp)
+{
+    return __sffs_grp_find(sffs_ctx, from, true, grp);
+}
+
+sffs_err_t sffs_grp_find_avail(sffs_context_t *sffs_ctx, u32_t from, u32_t *grp)
+{
+    return __sffs_grp_find(sffs_ctx, from, false, grp);
+}
+
+sffs_err_t sffs_grp_free_blocks(sffs_context_t *sffs_ctx, u32_t grp, u32_t *count)
+{
+    if(!sffs_ctx || !count || grp >= sffs_ctx->sb.s_group_count)
+        return SFFS_ERR_INVARG;
+
+    struct sffs_bitmaps *bms = sffs_ctx->bitmaps;
+    if(bms)
+    {
+        *count = __atomic_load_n(&__grp_free(bms)[grp], __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    bmap_t grp_size = sffs_ctx->sb.s_blocks_per_group;
+    return sffs_bm_count_zero(sffs_ctx, sffs_ctx->sb.s_data_bitmap_start, 
+        grp * grp_size, (grp + 1) * grp_size, count);
+}
+
+/*          Inodes          */
+
+/**
+ *  Bit w of the summary is set while word w of the GIT bitmap mirror has 
+ *  a zero bit. It follows the word the same way l1 follows l0
+*/
+static void __sffs_ino_word_update(struct sffs_bitmaps *bms, u32_t w)
+{
+    const u64_t *word = (const u64_t *) bms->GIT.bits + w;
+    u64_t bits;
+    do
+    {
+        bits = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+        __grp_map_set(&bms->ifree, w, bits != ~0ULL);
+    } while(__atomic_load_n(word, __ATOMIC_SEQ_CST) != bits);
+}
+
+/**
+ *  Accounts GIT entries [start, end) which have just changed
+*/
+static void __sffs_ino_account(struct sffs_bitmaps *bms, u64_t start, u64_t end)
+{
+    for(u64_t w = start / 64; w * 64 < end && w < bms->ino_words; w++)
+        __sffs_ino_word_update(bms, w);
+}
+
+static sffs_err_t __sffs_ino_load(sffs_context_t *sffs_ctx, struct sffs_bitmaps *bms)
+{
+    u64_t words = ((u64_t) sffs_ctx->sb.s_inodes_count + 63) / 64;
+    u64_t max = (u64_t) bms->GIT.size * sffs_ctx->sb.s_block_size / sizeof(u64_t);
+
+    bms->ino_words = words < max ? words : max;
+    bms->ino_cursor = sffs_ctx->sb.s_inodes_reserved;
+    sffs_err_t errc = __grp_map_init(&bms->ifree, bms->ino_words);
+    if(errc < 0)
+        return errc;
+
+    for(u32_t w = 0; w < bms->ino_words; w++)
+        __sffs_ino_word_update(bms, w);
+    return 0;
+}
+
+/**
+ *  Returns the first free entry within [start, end), end if there is 
+ *  none. Summary only points at words, the word itself has the final say
+*/
+static u64_t __sffs_ino_find(struct sffs_bitmaps *bms, u64_t start, u64_t end)
+{
+    for(u64_t w = start / 64; ; w++)
+    {
+        w = __grp_map_find(&bms->ifree, w, bms->ino_words);
+        if(w >= bms->ino_words || w * 64 >= end)
+            return end;
+
+        u64_t from = w * 64 > start ? w * 64 : start;
+        u64_t to = (w + 1) * 64 < end ? (w + 1) * 64 : end;
+        u64_t found = __find_zero_bm(bms->GIT.bits, from, to);
+        if(found < to)
+            return found;
+    }
+}
+
+sffs_err_t sffs_ino_find_free(sffs_context_t *sffs_ctx, bmap_t start, bmap_t end, 
+    bmap_t *res)
+{
+    if(!sffs_ctx || !res)
+        return SFFS_ERR_INVARG;
+
+    struct sffs_bitmaps *bms = sffs_ctx->bitmaps;
+    if(!bms)
+        return sffs_bm_find_zero(sffs_ctx, sffs_ctx->sb.s_GIT_bitmap_start, start, end, res);
+
+    if((u64_t) end > (u64_t) bms->ino_words * 64)
+        end = (u64_t) bms->ino_words * 64;
+    if(start >= end)
+        return SFFS_ERR_NOSPC;
+
+    // Search goes on from the cursor and wraps around to start
+    bmap_t cursor = __atomic_load_n(&bms->ino_cursor, __ATOMIC_RELAXED);
+    if(cursor < start || cursor >= end)
+        cursor = start;
+
+    u64_t found = __sffs_ino_find(bms, cursor, end);
+    if(found >= end)
+    {
+        found = __sffs_ino_find(bms, start, cursor);
+        if(found >= cursor)
+            return SFFS_ERR_NOSPC;
+    }
+
+    __atomic_store_n(&bms->ino_cursor, found + 1, __ATOMIC_RELAXED);
+    *res = found;
+    return 0;
+}
+
+static sffs_err_t __sffs_bm_mirror_load(sffs_context_t *sffs_ctx, 
+    struct sffs_bm_mirror *mirror, blk32_t start, blk32_t size)
+{
+    blk32_t block_size = sffs_ctx->sb.s_block_size;
+
+    mirror->start = start;
+    mirror->size = size;
+    mirror->bits = sffs_aligned_alloc(sffs_ctx, (size_t) size * block_size);
+    mirror->dirty = calloc(size, sizeof(u8_t));
+    blk32_t *blocks = malloc(sizeof(blk32_t) * size);
+    void **bufs = malloc(sizeof(void *) * size);
+
+    sffs_err_t errc = 0;
+    if(!mirror->bits || !mirror->dirty || !blocks || !bufs)
+        errc = SFFS_ERR_MEMALLOC;
+
+    if(errc == 0)
+    {
+        for(blk32_t i = 0; i < size; i++)
+        {
+            blocks[i] = start + i;
+            bufs[i] = mirror->bits + (size_t) i * block_size;
+        }
+        errc = sffs_read_blkv(sffs_ctx, blocks, bufs, size);
+    }
+
+    free(blocks);
+    free(bufs);
+    return errc;
+}
+
+static void __sffs_bm_free(struct sffs_bitmaps *bms)
+{
+    struct sffs_bm_mirror *mirrors[] = { &bms->data, &bms->GIT, &bms->desc };
+    for(size_t i = 0; i < sizeof(mirrors) / sizeof(mirrors[0]); i++)
+    {
+        free(mirrors[i]->bits);
+        free(mirrors[i]->dirty);
+    }
+    free(bms->avail.l0);
+    free(bms->avail.l1);
+    free(bms->empty.l0);
+    free(bms->empty.l1);
+    free(bms->ifree.l0);
+    free(bms->ifree.l1);
+    free(bms);
+}
+
+sffs_err_t sffs_bm_load(sffs_context_t *sffs_ctx)
+{
+    if(!sffs_ctx)
+        return SFFS_ERR_INVARG;
+
+    struct sffs_bitmaps *bms = calloc(1, sizeof(struct sffs_bitmaps));
+    if(!bms)
+        return SFFS_ERR_MEMALLOC;
+
+    sffs_err_t errc = __sffs_bm_mirror_load(sffs_ctx, &bms->data, 
+        sffs_ctx->sb.s_data_bitmap_start, sffs_ctx->sb.s_data_bitmap_size);
+    if(errc == 0)
+        errc = __sffs_bm_mirror_load(sffs_ctx, &bms->GIT, 
+            sffs_ctx->sb.s_GIT_bitmap_start, sffs_ctx->sb.s_GIT_bitmap_size);
+    if(errc == 0)
+        errc = __sffs_grp_load(sffs_ctx, bms);
+    if(errc == 0)
+        errc = __sffs_ino_load(sffs_ctx, bms);
+    if(errc == 0)
+        errc = sffs_freeidx_init(sffs_ctx, bms->data.bits);
+
+    if(errc < 0)
+    {
+        __sffs_bm_free(bms);
+        return errc;
+    }
+
+    sffs_ctx->bitmaps = bms;
+    return 0;
+}
+
+/**
+ *  Collects dirty blocks of the mirror and takes their flags down. 
+ *  srcs point to the blocks within the mirror
+*/
+static size_t __sffs_bm_collect(sffs_context_t *sffs_ctx, struct sffs_bm_mirror *mirror,
+    blk32_t *blocks, const u8_t **srcs)
+{
+    size_t count = 0;
+    for(blk32_t i = 0; i < mirror->size; i++)
+    {
+        if(!__atomic_exchange_n(&mirror->dirty[i], 0, __ATOMIC_ACQUIRE))
+            continue;
+
+        blocks[count] = mirror->start + i;
+        srcs[count] = mirror->bits + (size_t) i * sffs_ctx->sb.s_block_size;
+        count++;
+    }
+    return count;
+}
+
+static void __sffs_bm_redirty(struct sffs_bitmaps *bms, const blk32_t *blocks, size_t count)
+{
+    struct sffs_bm_mirror *mirrors[] = { &bms->data, &bms->GIT, &bms->desc };
+    for(size_t i = 0; i < count; i++)
+    {
+        for(size_t k = 0; k < sizeof(mirrors) / sizeof(mirrors[0]); k++)
+        {
+            struct sffs_bm_mirror *mirror = mirrors[k];
+            if(blocks[i] >= mirror->start && blocks[i] < mirror->start + mirror->size)
+                __bm_mark_dirty(mirror, blocks[i] - mirror->start);
+        }
+    }
+}
+
+sffs_err_t sffs_bm_flush(sffs_context_t *sffs_ctx)
+{
+    struct sffs_bitmaps *bms = sffs_ctx->bitmaps;
+    if(!bms)
+        return 0;
+
+    blk32_t block_size = sffs_ctx->sb.s_block_size;
+    size_t max = (size_t) bms->data.size + bms->GIT.size + bms->desc.size;
+    blk32_t *blocks = malloc(sizeof(blk32_t) * max);
+    const u8_t **srcs = malloc(sizeof(u8_t *) * max);
+    void **bufs = malloc(sizeof(void *) * max);
+    if(!blocks || !srcs || !bufs)
+    {
+        free(blocks);
+        free(srcs);
+        free(bufs);
+        return SFFS_ERR_MEMALLOC;
+    }
+
+    size_t count = __sffs_bm_collect(sffs_ctx, &bms->data, blocks, srcs);
+    count += __sffs_bm_collect(sffs_ctx, &bms->GIT, blocks + count, srcs + count);
+    count += __sffs_bm_collect(sffs_ctx, &bms->desc, blocks + count, srcs + count);
+
+    /**
+     *  Bits keep changing while the blocks are written, so the blocks are 
+     *  copied word by word first. A change the copy misses has flagged 
+     *  its block again. Blocks that failed to be written are flagged dirty 
+     *  again as well
+    */
+    sffs_err_t errc = 0;
+    u8_t *copy = count ? sffs_aligned_alloc(sffs_ctx, count * block_size) : NULL;
+    if(count && !copy)
+        errc = SFFS_ERR_MEMALLOC;
+
+    for(size_t i = 0; i < count && errc == 0; i++)
+    {
+        u64_t *dst = (u64_t *) (copy + i * block_size);
+        const u64_t *src = (const u64_t *) srcs[i];
+        for(size_t w = 0; w < block_size / sizeof(u64_t); w++)
+            dst[w] = __atomic_load_n(&src[w], __ATOMIC_RELAXED);
+        bufs[i] = dst;
+    }
+
+    if(errc == 0)
+        errc = sffs_write_blkv(sffs_ctx, blocks, bufs, count);
+    if(errc < 0)
+        __sffs_bm_redirty(bms, blocks, count);
+
+    free(copy);
+    free(blocks);
+    free(srcs);
+    free(bufs);
+    return errc;
+}
+
+sffs_err_t sffs_bm_unload(sffs_context_t *sffs_ctx)
+{
+    struct sffs_bitmaps *bms = sffs_ctx->bitmaps;
+    if(!bms)
+        return 0;
+
+    sffs_err_t errc = sffs_bm_flush(sffs_ctx);
+
+    sffs_freeidx_destroy(sffs_ctx);
+    __sffs_bm_free(bms);
+    sffs_ctx->bitmaps = NULL;
+    return errc;
+}
@@ -21,11 +21,10 @@ sffs_err_t sffs_read_sb(sffs_context_t *sffs_ctx, struct sffs_superblock *sb)
     if(!sffs_ctx || !sb)
         return SFFS_ERR_INVARG;
 
-    if(lseek64(sffs_ctx->disk_id, 1024, SEEK_SET) < 0)
-        return SFFS_ERR_DEV_SEEK;
-    
-    if(read(sffs_ctx->disk_id, sb, SFFS_SB_SIZE) < 0)
-        return SFFS_ERR_DEV_WRITE;
+    u64_t start = sffs_stats_start(sffs_ctx);
+    if(__sffs_dev_pread(sffs_ctx, sb, SFFS_SB_SIZE, 1024) < 0)
+        return SFFS_ERR_DEV_READ;
+    sffs_stats_account(sffs_ctx, 0, SFFS_STAT_READ, SFFS_SB_SIZE, start);
     
     return 0;
 }
@@ -35,12 +34,11 @@ sffs_err_t sffs_write_sb(sffs_context_t *sffs_ctx, struct sffs_superblock *sb)
     if(!sffs_ctx || !sb)
         return SFFS_ERR_INVARG;
 
-    if(lseek64(sffs_ctx->disk_id, 1024, SEEK_SET) < 0)
-        return SFFS_ERR_DEV_SEEK;
-    
     // Update superblock directly because in-memory version always up-to-date
-    if(write(sffs_ctx->disk_id, sb, 1024) < 0)
+    u64_t start = sffs_stats_start(sffs_ctx);
+    if(__sffs_dev_pwrite(sffs_ctx, sb, SFFS_SB_SIZE, 1024) < 0)
         return SFFS_ERR_DEV_WRITE;
+    sffs_stats_account(sffs_ctx, 0, SFFS_STAT_WRITE, SFFS_SB_SIZE, start);
     
     return 0;
 }
@@ -73,6 +71,8 @@ sffs_err_t sffs_creat_inode(sffs_context_t *sffs_ctx, ino32_t ino_id, mode_t mod
     inode->i_gid_owner = getgid();
     inode->i_list_size = 1;
     inode->i_last_lentry = ino_id;
+    inode->i_extents_count = 0;
+    inode->i_size = 0;
 
     // Time constants
     time_t tm = time(NULL);
@@ -89,6 +89,10 @@ sffs_err_t sffs_write_inode(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino
     if(!ino_mem || !sffs_ctx)
         return SFFS_ERR_INVARG;
 
+    // Entry reaches its GIT block on eviction or on sync
+    if(sffs_ctx->icache)
+        return sffs_icache_write(sffs_ctx, ino_mem);
+
     struct sffs_inode *inode = &ino_mem->ino;
 
     sffs_err_t errc;
@@ -126,6 +130,9 @@ sffs_err_t sffs_read_inode(sffs_context_t *sffs_ctx, ino32_t ino_id, struct sffs
 
     if(sffs_check_GIT_bm(sffs_ctx, ino_id) != 0)
     {
+        if(sffs_ctx->icache)
+            return sffs_icache_read(sffs_ctx, ino_id, ino_mem);
+
         sffs_err_t errc;
         ino32_t ino_entry_size = sffs_ctx->sb.s_inode_block_size + 
             sffs_ctx->sb.s_inode_size;
@@ -137,6 +144,13 @@ sffs_err_t sffs_read_inode(sffs_context_t *sffs_ctx, ino32_t ino_id, struct sffs
 
         blk32_t ino_block = sffs_ctx->sb.s_GIT_start + git_block;
 
+        u8_t *git_ptr = sffs_map_blk(sffs_ctx, ino_block, 1);
+        if(git_ptr)
+        {
+            memcpy(inode, git_ptr + block_offset, ino_entry_size);
+            return 0;
+        }
+
         errc = sffs_read_blk(sffs_ctx, ino_block, sffs_ctx->cache, 1); 
         if(errc < 0)
             return errc;
@@ -158,27 +172,43 @@ sffs_err_t sffs_alloc_inode(sffs_context_t *sffs_ctx, ino32_t *ino_id,
     ino32_t max_inodes = sffs_ctx->sb.s_inodes_count - resv_inodes;
     sffs_err_t errc;
 
-    for(int i = resv_inodes; i < max_inodes; i++)
+    bmap_t id;
+    while(true)
     {
-        errc = sffs_check_GIT_bm(sffs_ctx, i);
+        errc = sffs_ino_find_free(sffs_ctx, resv_inodes, max_inodes, &id);
         if(errc < 0)
             return errc;
-        
-        // Meaning we found free spot
-        if(errc == 0)
-        {
-            errc = sffs_set_GIT_bm(sffs_ctx, i);
-            if(errc < 0)
-                return errc;
-            
-            // Update superblock
-            sffs_ctx->sb.s_free_inodes_count--; 
-            *ino_id = i;
-            return 0;
-        }
+
+        // Slot taken since the search means someone else won it, search on
+        errc = sffs_set_GIT_bm(sffs_ctx, id);
+        if(errc == SFFS_ERR_FS)
+            continue;
+        if(errc < 0)
+            return errc;
+
+        // Block map of the previous owner must not be reused
+        sffs_bmap_truncate(sffs_ctx, id, 0);
+
+        // Update superblock
+        __atomic_fetch_sub(&sffs_ctx->sb.s_free_inodes_count, 1, __ATOMIC_RELAXED);
+        *ino_id = id;
+        return 0;
     }
+}
+
+u32_t sffs_blk_run(const blk32_t *blocks, size_t count)
+{
+    u32_t run = 1;
+    while(run < count && blocks[run] == blocks[0] + run)
+        run++;
+    return run;
+}
 
-    return SFFS_ERR_NOSPC;
+int sffs_blk_cmp(const void *a, const void *b)
+{
+    blk32_t blk_a = *(const blk32_t *) a;
+    blk32_t blk_b = *(const blk32_t *) b;
+    return (blk_a > blk_b) - (blk_a < blk_b);
 }
 
 sffs_err_t sffs_alloc_inode_list(sffs_context_t *sffs_ctx, ino32_t size, 
@@ -193,11 +223,17 @@ sffs_err_t sffs_alloc_inode_list(sffs_context_t *sffs_ctx, ino32_t size,
             return SFFS_ERR_NOSPC;
 
     // No free inodes to allocate
-    if(size > sffs_ctx->sb.s_free_inodes_count)
+    if(size > __atomic_load_n(&sffs_ctx->sb.s_free_inodes_count, __ATOMIC_RELAXED))
         return SFFS_ERR_NOSPC;
     
     struct sffs_inode *inode = &ino_mem->ino;
     ino32_t *list_entries = malloc(sizeof(ino32_t) * size);
+    if(!list_entries)
+        return SFFS_ERR_MEMALLOC;
+
+    struct sffs_inode_mem *current_inode = NULL;
+    struct sffs_inode_mem *buf_inode = NULL;
+    sffs_err_t errc = 0;
     bool seq_list = true;
 
     // Try to allocate inode list entries right next to the base inode
@@ -209,21 +245,20 @@ sffs_err_t sffs_alloc_inode_list(sffs_context_t *sffs_ctx, ino32_t size,
     if(ino_id_within_block + size > ino_per_block)
         goto non_seq_alloc; 
 
-    for(int i = 0; i < size; i++)
+    /**
+     *  Take the last inode list entry to ensure that
+     *  inode list is sequential as much as possible. List entries 
+     *  are regular GIT entries, they are claimed before being written 
+     *  so that nobody else hands them out meanwhile
+    */
     {
-        /**
-         *  Take the last inode list entry to ensure that
-         *  inode list is sequential as much as possible
-        */
-        ino32_t next_entry = inode->i_last_lentry + i + 1;
-        
-        if(sffs_check_GIT_bm(sffs_ctx, next_entry) != 0)
-        {
+        ino32_t first_entry = inode->i_last_lentry + 1;
+        if(first_entry + size > sffs_ctx->sb.s_inodes_count ||
+            sffs_set_GIT_bm_range(sffs_ctx, first_entry, size) < 0)
             seq_list = false;
-            break;
-        }
-        
-        list_entries[i] = next_entry;
+
+        for(u32_t i = 0; i < size && seq_list; i++)
+            list_entries[i] = first_entry + i;
     }
 
     if(seq_list == true)
@@ -234,33 +269,43 @@ sffs_err_t sffs_alloc_inode_list(sffs_context_t *sffs_ctx, ino32_t size,
  *  inode list and will try another (random) allocation technique
 */
 non_seq_alloc:
-    ino32_t free_inodes = sffs_ctx->sb.s_free_inodes_count;
     ino32_t allocated = 0;
+    bmap_t id = 0;
 
-    for(int i = 0; i < free_inodes && allocated < size; i++)
+    while(allocated < size && sffs_bm_find_zero(sffs_ctx, sffs_ctx->sb.s_GIT_bitmap_start, 
+        id, sffs_ctx->sb.s_inodes_count, &id) == 0)
     {
-        if(sffs_check_GIT_bm(sffs_ctx, i) == false)
-        {
-            list_entries[allocated] = i;
-            allocated++; 
-        }
+        // Entry taken since the search means someone else won it, search on
+        sffs_err_t claim = sffs_set_GIT_bm(sffs_ctx, id);
+        if(claim >= 0)
+            list_entries[allocated++] = id;
+        else if(claim != SFFS_ERR_FS)
+            break;
+        id++;
     }
 
     if(allocated < size)
+    {
+        for(u32_t i = 0; i < allocated; i++)
+            sffs_unset_GIT_bm(sffs_ctx, list_entries[i]);
+        free(list_entries);
         return SFFS_ERR_FS;
+    }
 
 /**
  *  This label means that list_entries are full of requested entries and
  *  further must be pushed on-disk
  */ 
 alloc_done:
-    struct sffs_inode_mem *current_inode;
-    sffs_err_t errc = sffs_creat_inode(sffs_ctx, 0, SFFS_IFREG, 0, &current_inode);
+    errc = sffs_creat_inode(sffs_ctx, 0, SFFS_IFREG, 0, &current_inode);
     if(errc < 0)
-        return errc;
+        goto alloc_fail;
 
     if(!current_inode)
-        return SFFS_ERR_MEMALLOC;
+    {
+        errc = SFFS_ERR_MEMALLOC;
+        goto alloc_fail;
+    }
 
     // Create on-disk list of inode entries
     for(int i = 0; i < size; i++)
@@ -268,33 +313,35 @@ alloc_done:
         current_inode->ino.i_inode_num = list_entries[i];
         current_inode->ino.i_next_entry = i + 1 == size ? 0 : list_entries[i + 1];
 
-        sffs_err_t errc = sffs_write_inode(sffs_ctx, current_inode);
+        errc = sffs_write_inode(sffs_ctx, current_inode);
         if(errc < 0)
-            return errc;
+            goto alloc_fail;
     }
 
     /**
      *  Add newly allocated inode entries to inode list
     */
-    struct sffs_inode_mem *buf_inode;
     errc = sffs_creat_inode(sffs_ctx, 0, SFFS_IFREG, 0, &buf_inode);
     if(errc < 0)
-        return errc;
+        goto alloc_fail;
 
     if(inode->i_last_lentry != inode->i_inode_num)
     {
         errc = sffs_read_inode(sffs_ctx, inode->i_last_lentry, buf_inode);
         if(errc < 0)
-            return errc;
+            goto alloc_fail;
         
         struct sffs_inode *buf = &buf_inode->ino;
         buf->i_next_entry = list_entries[0];
 
         errc = sffs_write_inode(sffs_ctx, buf_inode);
         if(errc < 0)
-            return errc;
+            goto alloc_fail;
     }
-    else 
+
+    ino32_t old_next_entry = inode->i_next_entry;
+    ino32_t old_last_lentry = inode->i_last_lentry;
+    if(inode->i_last_lentry == inode->i_inode_num)
         inode->i_next_entry = list_entries[0];
 
     inode->i_list_size += size;
@@ -302,14 +349,38 @@ alloc_done:
 
     errc = sffs_write_inode(sffs_ctx, ino_mem);
     if(errc < 0)
-        return errc;
+    {
+        // Inode keeps its old list, last entry must not link past it either
+        inode->i_next_entry = old_next_entry;
+        inode->i_list_size -= size;
+        inode->i_last_lentry = old_last_lentry;
+        if(old_last_lentry != inode->i_inode_num)
+        {
+            buf_inode->ino.i_next_entry = 0;
+            sffs_write_inode(sffs_ctx, buf_inode);
+        }
+        goto alloc_fail;
+    }
 
-    sffs_ctx->sb.s_free_inodes_count -= size;
+    __atomic_fetch_sub(&sffs_ctx->sb.s_free_inodes_count, size, __ATOMIC_RELAXED);
 
     free(list_entries);
     free(buf_inode);
     free(current_inode);
     return 0;
+
+/**
+ *  This label means that claimed entries never made it into the list, 
+ *  they are handed back to the GIT
+*/
+alloc_fail:
+    for(u32_t i = 0; i < size; i++)
+        sffs_unset_GIT_bm(sffs_ctx, list_entries[i]);
+
+    free(list_entries);
+    free(buf_inode);
+    free(current_inode);
+    return errc;
 }
 
 sffs_err_t sffs_get_data_block_info(sffs_context_t *sffs_ctx, blk32_t block_number, 
@@ -345,18 +416,34 @@ sffs_err_t sffs_get_data_block_info(sffs_context_t *sffs_ctx, blk32_t block_numb
 
     u32_t blk_off;
     u32_t blk_ino;
-    u32_t *blk_ptr;
+    blk32_t phys_id;
+    blk32_t logical_id = block_id;
     struct sffs_inode_mem *buf;
     errc = sffs_creat_inode(sffs_ctx, 0, SFFS_IFREG, 0, &buf);
     if(errc < 0)
         return errc;
 
-    if(block_number < pr_ino_blks)
+    if(sffs_ctx->sb.s_features & SFFS_FEATURE_EXTENTS)
     {
-        blk_ptr = ino_mem->blks;
+        // Inode id and list id describe the extent holding the block
+        errc = sffs_ext_lookup(sffs_ctx, ino_mem, block_id, &phys_id, &blk_ino, &blk_off);
+        if(errc < 0)
+        {
+            free(buf);
+            return errc;
+        }
+    }
+    else if(block_id < pr_ino_blks)
+    {
+        phys_id = ino_mem->blks[block_id];
         blk_off = block_id;
         blk_ino = ino_mem->ino.i_inode_num;
     }
+    else if(sffs_bmap_lookup(sffs_ctx, ino_mem, block_id, 1, &phys_id, &blk_ino) >= 0)
+    {
+        // Cached block map spares the walk of the inode list
+        blk_off = (block_id - pr_ino_blks) % supp_ino_blks;
+    }
     else 
     {
         block_id -= pr_ino_blks;
@@ -365,22 +452,28 @@ sffs_err_t sffs_get_data_block_info(sffs_context_t *sffs_ctx, blk32_t block_numb
 
         // Inode list is smaller than requested block's inode list entry
         if(supp_ino_id > ino_mem->ino.i_list_size)
+        {
+            free(buf);
             return SFFS_ERR_INVARG;
+        }
 
         ino32_t supp_ino = ino_mem->ino.i_next_entry;
         for(u32_t i = 0; i < supp_ino_id && supp_ino != 0; i++)
         {
             errc = sffs_read_inode(sffs_ctx, supp_ino, buf);
             if(errc < 0)
+            {
+                free(buf);
                 return errc;
+            }
             struct sffs_inode_list *list = (struct sffs_inode_list *) buf;
-            blk_ptr = list->blks;
+            phys_id = list->blks[blk_off];
             blk_ino = list->i_inode_num;
             supp_ino = buf->ino.i_next_entry;
         }
     }
 
-    db_info->block_id = *(blk_ptr + blk_off);
+    db_info->block_id = phys_id;
     db_info->inode_id = blk_ino;
     db_info->list_id = blk_off;
     db_info->flags = 0;             // reserved field
@@ -390,9 +483,14 @@ sffs_err_t sffs_get_data_block_info(sffs_context_t *sffs_ctx, blk32_t block_numb
     // Read the block itself if requested
     if(read_blk)
     {
-        db_info->content = malloc(sizeof(blk32_t) * sffs_ctx->sb.s_block_size);
+        sffs_readahead(sffs_ctx, ino_mem, logical_id, 1);
+
         if(!db_info->content)
-            return SFFS_ERR_MEMALLOC;
+        {
+            db_info->content = sffs_buf_get(sffs_ctx);
+            if(!db_info->content)
+                return SFFS_ERR_MEMALLOC;
+        }
 
         errc = sffs_read_data_blk(sffs_ctx, db_info->block_id, db_info->content, 1);
         if(errc < 0)
@@ -403,52 +501,289 @@ sffs_err_t sffs_get_data_block_info(sffs_context_t *sffs_ctx, blk32_t block_numb
     return 0;
 }
 
-/**
- *  Reads group bitmap (typically 32-bit value) from bitmap
-*/
-sffs_err_t __get_group_bitmap(sffs_context_t *sffs_ctx, blk32_t bm_start, 
-    blk32_t group_bm, bmap_t *result)
+sffs_err_t sffs_get_data_blocks(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem, 
+    blk32_t first, u32_t count, blk32_t *blocks)
 {
-    if(!sffs_ctx)
+    if(!sffs_ctx || !ino_mem || !blocks)
         return SFFS_ERR_INVARG;
 
-    if(bm_start != sffs_ctx->sb.s_data_bitmap_start &&
-        bm_start != sffs_ctx->sb.s_GIT_bitmap_start)
+    if((u64_t) first + count > ino_mem->ino.i_blks_count)
         return SFFS_ERR_INVARG;
-    
-    if(!result)
-        return SFFS_ERR_INVARG;
-    
-    if(group_bm == sffs_ctx->sb.s_data_bitmap_start)
-        if(group_bm > sffs_ctx->sb.s_group_count)
-            return SFFS_ERR_INVARG;
-    
-    u32_t temp = sffs_ctx->sb.s_block_size * 8;
-    u32_t grp_size = sffs_ctx->sb.s_blocks_per_group / 8;
 
-    blk32_t blk_id = group_bm / temp;
-    blk32_t grp_id = group_bm % temp; 
+    if(sffs_ctx->sb.s_features & SFFS_FEATURE_EXTENTS)
+    {
+        // Cached block map spares the walk of the extents
+        if(sffs_bmap_lookup(sffs_ctx, ino_mem, first, count, blocks, NULL) >= 0)
+            return 0;
+        return sffs_ext_get_blocks(sffs_ctx, ino_mem, first, count, blocks);
+    }
 
-    sffs_err_t errc;
-    errc = sffs_read_blk(sffs_ctx, bm_start + blk_id, sffs_ctx->cache, 1);
+    u32_t ino_entry_size = sffs_ctx->sb.s_inode_size + sffs_ctx->sb.s_inode_block_size;
+    u32_t pr_ino_blks = sffs_ctx->sb.s_inode_block_size / sizeof(blk32_t);
+    u32_t supp_ino_blks = (ino_entry_size - SFFS_INODE_LIST_SIZE) / sizeof(blk32_t);
+    u32_t done = 0;
+
+    // Primary inode part
+    while(done < count && first + done < pr_ino_blks)
+    {
+        blocks[done] = ino_mem->blks[first + done];
+        done++;
+    }
+
+    if(done == count)
+        return 0;
+
+    // Cached block map spares the walk of the inode list
+    if(sffs_bmap_lookup(sffs_ctx, ino_mem, first + done, count - done, 
+        blocks + done, NULL) >= 0)
+        return 0;
+
+    /**
+     *  Supplementary inodes preceding the requested range are only 
+     *  passed through, each of the following ones is read once
+    */
+    blk32_t rel = first + done - pr_ino_blks;
+    u32_t skip = rel / supp_ino_blks;
+    u32_t off = rel % supp_ino_blks;
+
+    struct sffs_inode_mem *buf;
+    sffs_err_t errc = sffs_creat_inode(sffs_ctx, 0, SFFS_IFREG, 0, &buf);
+    if(errc < 0)
+        return errc;
+
+    ino32_t supp_ino = ino_mem->ino.i_next_entry;
+    for(u32_t i = 0; supp_ino != 0 && done < count; i++)
+    {
+        errc = sffs_read_inode(sffs_ctx, supp_ino, buf);
+        if(errc < 0)
+            break;
+
+        struct sffs_inode_list *list = (struct sffs_inode_list *) buf;
+        supp_ino = list->i_next_entry;
+        if(i < skip)
+            continue;
+
+        while(off < supp_ino_blks && done < count)
+            blocks[done++] = list->blks[off++];
+        off = 0;
+    }
+
+    free(buf);
     if(errc < 0)
         return errc;
+    return done == count ? 0 : SFFS_ERR_FS;
+}
+
+u64_t sffs_inode_size(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem)
+{
+    (void) sffs_ctx;
+    return ino_mem->ino.i_size;
+}
+
+void sffs_inode_set_size(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem, 
+    u64_t size)
+{
+    // Remainder still describes the last block of the file itself
+    ino_mem->ino.i_size = size;
+    ino_mem->ino.i_bytes_rem = size % sffs_ctx->sb.s_block_size;
+}
+
+ssize_t sffs_read_data(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem, 
+    void *buf, size_t size, u64_t offset)
+{
+    if(!sffs_ctx || !ino_mem || !buf)
+        return SFFS_ERR_INVARG;
+
+    u64_t file_size = sffs_inode_size(sffs_ctx, ino_mem);
+    if(offset >= file_size || size == 0)
+        return 0;
+    if(size > file_size - offset)
+        size = file_size - offset;
+
+    blk32_t block_size = sffs_ctx->sb.s_block_size;
+    blk32_t first = offset / block_size;
+    blk32_t last = (offset + size - 1) / block_size;
+    sffs_readahead(sffs_ctx, ino_mem, first, last - first + 1);
+
+    /**
+     *  Blocks are mapped and read in chunks of SFFS_IOV_MAX. Blocks 
+     *  fully covered by the request are read straight into buf, only 
+     *  partially covered head and tail go through scratch buffers
+    */
+    blk32_t blocks[SFFS_IOV_MAX];
+    void *bufs[SFFS_IOV_MAX];
+    void *scratch[2] = { NULL, NULL };
+    sffs_err_t errc = 0;
+
+    for(blk32_t chunk = first; chunk <= last && errc >= 0; chunk += SFFS_IOV_MAX)
+    {
+        u32_t count = last - chunk + 1;
+        if(count > SFFS_IOV_MAX)
+            count = SFFS_IOV_MAX;
+
+        errc = sffs_get_data_blocks(sffs_ctx, ino_mem, chunk, count, blocks);
+        if(errc < 0)
+            break;
+
+        for(u32_t i = 0; i < count && errc >= 0; i++)
+        {
+            u64_t blk_start = (u64_t) (chunk + i) * block_size;
+            if(blk_start >= offset && blk_start + block_size <= offset + size)
+            {
+                bufs[i] = (u8_t *) buf + (blk_start - offset);
+                continue;
+            }
+
+            int s = chunk + i == first ? 0 : 1;
+            if(!scratch[s] && !(scratch[s] = sffs_buf_get(sffs_ctx)))
+                errc = SFFS_ERR_MEMALLOC;
+            bufs[i] = scratch[s];
+        }
+
+        if(errc >= 0)
+            errc = sffs_read_data_blkv(sffs_ctx, blocks, bufs, count);
+        if(errc < 0)
+            break;
+
+        // Copy the requested part of partially covered blocks
+        for(u32_t i = 0; i < count; i++)
+        {
+            if(bufs[i] != scratch[0] && bufs[i] != scratch[1])
+                continue;
+
+            u64_t blk_start = (u64_t) (chunk + i) * block_size;
+            u64_t from = blk_start > offset ? blk_start : offset;
+            u64_t to = blk_start + block_size < offset + size ? 
+                blk_start + block_size : offset + size;
+            memcpy((u8_t *) buf + (from - offset), (u8_t *) bufs[i] + (from - blk_start), 
+                to - from);
+        }
+    }
+
+    sffs_buf_put(sffs_ctx, scratch[0]);
+    sffs_buf_put(sffs_ctx, scratch[1]);
+    return errc < 0 ? errc : (ssize_t) size;
+}
+
+/**
+ *  Marks blocks [start, start + count) in the data bitmap and appends 
+ *  them to blocks. Bits set by other threads meanwhile are skipped, so 
+ *  every block appended belongs to the caller alone
+*/
+static sffs_err_t __claim_run(sffs_context_t *sffs_ctx, bmap_t start, u32_t count, 
+    blk32_t *blocks, u32_t *claimed)
+{
+    sffs_err_t errc = sffs_set_data_bm_range(sffs_ctx, start, count);
+    if(errc >= 0)
+    {
+        for(u32_t k = 0; k < count; k++)
+            blocks[(*claimed)++] = start + k;
+        return 0;
+    }
+    if(errc != SFFS_ERR_FS)
+        return errc;
 
-    u8_t *ca = (u8_t *) sffs_ctx->cache;
-    blk32_t *res = (blk32_t *) (ca + (grp_id * grp_size));
-    *result = *res;
+    // Range is refused as a whole, free blocks of it are claimed one by one
+    for(u32_t k = 0; k < count; k++)
+    {
+        errc = sffs_set_data_bm(sffs_ctx, start + k);
+        if(errc == SFFS_ERR_FS)
+            continue;
+        if(errc < 0)
+            return errc;
+        blocks[(*claimed)++] = start + k;
+    }
     return 0;
 }
 
-static bool __find_block(blk32_t *blks, size_t size, blk32_t block)
+/**
+ *  Claims free blocks of [start, end) until *claimed reaches count. A 
+ *  free run holding all of them is taken if there is one, otherwise 
+ *  free blocks are taken in order
+*/
+static sffs_err_t __claim_free(sffs_context_t *sffs_ctx, bmap_t start, bmap_t end, 
+    blk32_t *blocks, u32_t *claimed, u32_t count)
 {
-    if(!blks)
-        return false;
-    
-    for(u32_t i = 0; i < size; i++)
-        if(blks[i] == block)
-            return true;
-    return false;
+    blk32_t bm = sffs_ctx->sb.s_data_bitmap_start;
+    bmap_t id;
+
+    if(*claimed < count && sffs_bm_find_zero_run(sffs_ctx, bm, start, end, 
+        count - *claimed, &id) == 0)
+    {
+        sffs_err_t errc = __claim_run(sffs_ctx, id, count - *claimed, blocks, claimed);
+        if(errc < 0)
+            return errc;
+    }
+
+    id = start;
+    while(*claimed < count && sffs_bm_find_zero(sffs_ctx, bm, id, end, &id) == 0)
+    {
+        sffs_err_t errc = __claim_run(sffs_ctx, id, 1, blocks, claimed);
+        if(errc < 0)
+            return errc;
+        id++;
+    }
+    return 0;
+}
+
+/**
+ *  Clears data bitmap bits of claimed blocks which have not been 
+ *  committed to an inode
+*/
+static void __unclaim(sffs_context_t *sffs_ctx, const blk32_t *blocks, u32_t count)
+{
+    for(u32_t i = 0; i < count; )
+    {
+        u32_t run = sffs_blk_run(blocks + i, count - i);
+        sffs_unset_data_bm_range(sffs_ctx, blocks[i], run);
+        i += run;
+    }
+}
+
+/**
+ *  Claims blocks taken from the free extent index until count blocks 
+ *  are held in new_blocks. Search starts right after the last block of 
+ *  ino_mem, so the inode keeps growing in place while it can. 
+ *  SFFS_ERR_INIT means the index is not available, SFFS_ERR_NOSPC that 
+ *  it ran out of blocks. Either way blocks claimed so far stay in 
+ *  new_blocks
+*/
+static sffs_err_t __alloc_from_index(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem,
+    blk32_t *new_blocks, u32_t *allocated, u32_t count)
+{
+    if(!sffs_ctx->freeidx)
+        return SFFS_ERR_INIT;
+
+    blk32_t goal = 0;
+    if(ino_mem->ino.i_blks_count != 0)
+    {
+        struct sffs_data_block_info last_info;
+        sffs_err_t errc = sffs_get_data_block_info(sffs_ctx, 0, SFFS_GET_BLK_LT,
+            &last_info, ino_mem);
+        if(errc < 0)
+            return errc;
+        goal = last_info.block_id + 1;
+    }
+
+    while(*allocated < count)
+    {
+        blk32_t start;
+        u32_t taken;
+        sffs_err_t errc = sffs_freeidx_take(sffs_ctx, goal, count - *allocated,
+            &start, &taken);
+        if(errc < 0)
+            return errc;
+
+        errc = __claim_run(sffs_ctx, start, taken, new_blocks, allocated);
+        if(errc < 0)
+        {
+            // Region is rebuilt, so blocks left unclaimed go back
+            sffs_freeidx_stale(sffs_ctx, start, taken);
+            return errc;
+        }
+        goal = start + taken;
+    }
+    return 0;
 }
 
 sffs_err_t sffs_alloc_data_blocks(sffs_context_t *sffs_ctx, size_t blk_count, 
@@ -476,9 +811,20 @@ sffs_err_t sffs_alloc_data_blocks(sffs_context_t *sffs_ctx, size_t blk_count,
     */
     blk32_t alloc_blocks = blk_count + prealloc;
 
-    if(alloc_blocks > sffs_ctx->sb.s_free_blocks_count)
+    /**
+     *  Blocks waiting for their discard are not free yet. Only when they 
+     *  make the difference, the allocation waits for them
+    */
+    u32_t free_count = __atomic_load_n(&sffs_ctx->sb.s_free_blocks_count, __ATOMIC_RELAXED);
+    if(blk_count > free_count)
     {
-        if(blk_count > sffs_ctx->sb.s_free_blocks_count)
+        sffs_discard_drain(sffs_ctx);
+        free_count = __atomic_load_n(&sffs_ctx->sb.s_free_blocks_count, __ATOMIC_RELAXED);
+    }
+
+    if(alloc_blocks > free_count)
+    {
+        if(blk_count > free_count)
             return SFFS_ERR_NOSPC;
         else 
             alloc_blocks = blk_count;
@@ -497,14 +843,9 @@ sffs_err_t sffs_alloc_data_blocks(sffs_context_t *sffs_ctx, size_t blk_count,
     u32_t free_blks = (pr_inode_blks + supp_ino_max_blks) - 
         inode->i_blks_count;
     
-    /**
-     *  Before allocating new inode list, keep current inode
-     *  list last entry. This value will come in handy during
-     *  serialization of a block ids
-    */
-    u32_t last_entry = inode->i_last_lentry;
-
-    if(free_blks < alloc_blocks)
+    // Extents extend the inode list themselves, once the runs are known
+    bool extents = sffs_ctx->sb.s_features & SFFS_FEATURE_EXTENTS;
+    if(!extents && free_blks < alloc_blocks)
     {
         u32_t clear_blks = alloc_blocks - free_blks;
         ino32_t supp_inodes = clear_blks / supp_ino_blks;
@@ -514,14 +855,12 @@ sffs_err_t sffs_alloc_data_blocks(sffs_context_t *sffs_ctx, size_t blk_count,
         errc = sffs_alloc_inode_list(sffs_ctx, supp_inodes, ino_mem);
         if(errc < 0)
             return errc;
-        last_entry = inode->i_next_entry;
     }
 
     blk32_t *new_blocks = malloc(sizeof(blk32_t) * alloc_blocks);
     if(!new_blocks)
         return SFFS_ERR_MEMALLOC;
     u32_t allocated = 0;
-    u32_t allocated_grps = 0;
 
     /*                      Data blocks allocation                              */
     /*                                                                          */
@@ -539,32 +878,46 @@ sffs_err_t sffs_alloc_data_blocks(sffs_context_t *sffs_ctx, size_t blk_count,
     /* And further allocation will proceed in the step three.                   */              
     /*                                                                          */
     /* Step three: random allocation of a data blocks                           */
+    /*                                                                          */
+    /* With the free extent index the steps are replaced by its lookups: the    */
+    /* blocks right after the last block of an inode if they are free, the     */
+    /* best fitting free extent otherwise. Every step marks the blocks it finds */
+    /* in the data bitmap at once, so no other thread can take them while they  */
+    /* are being registered.                                                    */
+
+    errc = __alloc_from_index(sffs_ctx, ino_mem, new_blocks, &allocated, alloc_blocks);
+    if(errc >= 0)
+        goto alloc_done;
+    if(errc != SFFS_ERR_INIT && errc != SFFS_ERR_NOSPC)
+        goto alloc_fail;
 
 
     /* Step one */
     {
+        if(inode->i_blks_count == 0)
+            goto step_two;
+
         struct sffs_data_block_info last_ino_info;
         errc = sffs_get_data_block_info(sffs_ctx, 0, SFFS_GET_BLK_LT, &last_ino_info, ino_mem);
         if(errc < 0)
-            return errc;
+            goto alloc_fail;
         
-        u32_t free_spots;
-        if(last_ino_info.inode_id != ino_mem->ino.i_inode_num)
-            free_spots = supp_ino_blks - last_ino_info.list_id;
-        else 
-            free_spots = pr_inode_blks - last_ino_info.list_id;
-        
-        if(free_spots == 0 || inode->i_blks_count == 0)
-            goto step_two;
+        // Blocks following the last one are merged into its extent, there are no spots to fill
+        if(!extents)
+        {
+            u32_t free_spots;
+            if(last_ino_info.inode_id != ino_mem->ino.i_inode_num)
+                free_spots = supp_ino_blks - last_ino_info.list_id;
+            else 
+                free_spots = pr_inode_blks - last_ino_info.list_id;
+            
+            if(free_spots == 0)
+                goto step_two;
+        }
 
         // Examine bitmap
         blk32_t grp_id = last_ino_info.block_id / sffs_ctx->sb.s_blocks_per_group;
         blk32_t blk_off = last_ino_info.block_id % sffs_ctx->sb.s_blocks_per_group;
-        blk32_t ino_grp_bm;
-        errc = __get_group_bitmap(sffs_ctx, sffs_ctx->sb.s_data_bitmap_start, grp_id, &ino_grp_bm);
-        if(errc < 0)
-            return errc;
-
         bmap_t grp_size = sffs_ctx->sb.s_blocks_per_group;
         
         /**
@@ -576,13 +929,14 @@ sffs_err_t sffs_alloc_data_blocks(sffs_context_t *sffs_ctx, size_t blk_count,
         else 
             blk_off++;
 
-        for(int i = blk_off; i < grp_size && allocated < alloc_blocks; i++)
-        {
-            if(__check_bm(&ino_grp_bm, i) != 0)
-                continue;
-            new_blocks[allocated] = (grp_id * grp_size) + i;
-            allocated++;
-        }
+        bmap_t id = grp_id * grp_size + blk_off;
+        bmap_t grp_end = (grp_id + 1) * grp_size;
+        if(grp_end > sffs_ctx->sb.s_blocks_count)
+            grp_end = sffs_ctx->sb.s_blocks_count;
+
+        errc = __claim_free(sffs_ctx, id, grp_end, new_blocks, &allocated, alloc_blocks);
+        if(errc < 0)
+            goto alloc_fail;
 
         if(allocated == alloc_blocks)
             goto alloc_done;
@@ -598,27 +952,18 @@ step_two:
         if(allocated % blocks_per_grp != 0)
             grps_need++;
 
-        for(int i = 0; i < sffs_ctx->sb.s_group_count && allocated < alloc_blocks; i++)
+        // Group summary hands out free groups without looking at the bitmap
+        u32_t grp = 0;
+        while(allocated < alloc_blocks && sffs_grp_find_empty(sffs_ctx, grp, &grp) == 0)
         {
-            bmap_t curr_grp;
-            errc = __get_group_bitmap(sffs_ctx, sffs_ctx->sb.s_data_bitmap_start, i, &curr_grp);
-            if(errc < 0)
-                return errc;
-            
-            if(curr_grp == 0)
-            {
-                for(u32_t k = 0; k < blocks_per_grp && allocated < alloc_blocks; k++)
-                {
-                    blk32_t block_id = (i * blocks_per_grp) + k;
-                    if(__find_block(new_blocks, allocated, block_id) == false)
-                    {
-                        new_blocks[allocated] = block_id;
-                        allocated++;
-                    }
-                }
+            bmap_t grp_start = grp * blocks_per_grp;
+            grp++;
 
-                allocated_grps++;
-            }
+            u32_t want = alloc_blocks - allocated;
+            errc = __claim_run(sffs_ctx, grp_start, want < blocks_per_grp ? want : 
+                blocks_per_grp, new_blocks, &allocated);
+            if(errc < 0)
+                goto alloc_fail;
         }
 
         if(allocated == alloc_blocks)
@@ -627,29 +972,49 @@ step_two:
 
 step_three:
     /**
-     *  Random blocks allocation goes here. Extremely stupid algorithm.
+     *  Random blocks allocation goes here. Group summary skips full groups, 
+     *  blocks past the last whole group are searched afterwards
     */
-    u32_t total_blocks = sffs_ctx->sb.s_blocks_count;
-    for(u32_t i = 0; i < total_blocks && allocated < alloc_blocks; i++)
     {
-        if(sffs_check_data_bm(sffs_ctx, i) == 0)
+        bmap_t grp_size = sffs_ctx->sb.s_blocks_per_group;
+        u32_t grp = 0;
+        while(allocated < alloc_blocks && sffs_grp_find_avail(sffs_ctx, grp, &grp) == 0)
         {
-            if(__find_block(new_blocks, allocated, i) == false)
-                new_blocks[allocated++] = i;
+            errc = __claim_free(sffs_ctx, grp * grp_size, (grp + 1) * grp_size, 
+                new_blocks, &allocated, alloc_blocks);
+            if(errc < 0)
+                goto alloc_fail;
+            grp++;
         }
+
+        errc = __claim_free(sffs_ctx, sffs_ctx->sb.s_group_count * grp_size, 
+            sffs_ctx->sb.s_blocks_count, new_blocks, &allocated, alloc_blocks);
+        if(errc < 0)
+            goto alloc_fail;
     }
 
     if(allocated != alloc_blocks)
-        return SFFS_ERR_FS;
+    {
+        errc = SFFS_ERR_FS;
+        goto alloc_fail;
+    }
 
 alloc_done:
     // Blocks registration
+    if(extents)
+    {
+        errc = sffs_ext_append(sffs_ctx, ino_mem, new_blocks, allocated);
+        if(errc < 0)
+            goto alloc_fail;
+        goto alloc_commit;
+    }
+
     u32_t written = 0;
 
     struct sffs_data_block_info last_info;
     errc = sffs_get_data_block_info(sffs_ctx, 0, SFFS_GET_BLK_LT, &last_info, ino_mem);
     if(errc < 0)
-        return errc;
+        goto alloc_fail;
 
     // Write block ids to a first, potentially primary inode
     ino32_t last_ino = last_info.inode_id;
@@ -666,77 +1031,224 @@ alloc_done:
         }
     }
     
-    // Write down the remaining block ids
-    ino32_t next_entry = last_entry;
-    ino32_t next_id = last_info.list_id;
-    struct sffs_inode_mem *buf;
-    errc = sffs_creat_inode(sffs_ctx, 0, SFFS_IFREG, 0, &buf);
-    if(errc < 0)
-        return errc;
-    
-    while(next_entry != 0 && written < allocated)
+    /**
+     *  Write down the remaining block ids into supplementary inodes. 
+     *  Registration continues right after the last registered block, 
+     *  either within the supplementary inode that holds it or from the 
+     *  first supplementary inode if it lives in the primary one. GIT 
+     *  blocks holding the touched entries are patched in memory and 
+     *  written back with a single vectored write. With the inode cache 
+     *  attached, entries are patched within the cache instead
+    */
+    ino32_t next_entry = ino_mem->ino.i_next_entry;
+    u32_t next_id = 0;
+    if(last_ino != ino_mem->ino.i_inode_num)
     {
-        errc = sffs_read_inode(sffs_ctx, next_entry, buf);    
-        if(errc < 0)
-            return errc;
-        
-        struct sffs_inode_list *supp_ino = (struct sffs_inode_list *) buf;
-        u32_t to_write;
-        u32_t remaining = allocated - written;
-        u32_t pos = 0;
+        next_entry = last_ino;
+        next_id = last_info.list_id + 1;
+    }
 
-        if(next_id != 0)
+    ino32_t ino_per_block = sffs_ctx->sb.s_block_size / ino_entry_size;
+    size_t max_git = (allocated - written) / supp_ino_blks + 2;
+    blk32_t *git_blocks = malloc(sizeof(blk32_t) * max_git);
+    void **git_bufs = malloc(sizeof(void *) * max_git);
+    size_t nr_git = 0;
+    if(!git_blocks || !git_bufs)
+    {
+        free(git_blocks);
+        free(git_bufs);
+        errc = SFFS_ERR_MEMALLOC;
+        goto alloc_fail;
+    }
+
+    while(next_entry != 0 && written < allocated && errc >= 0)
+    {
+        struct sffs_inode_list *supp_ino;
+        if(sffs_ctx->icache)
         {
-            to_write = supp_ino_blks - next_id;
-            pos = next_id;
+            // Entry is patched in place and reaches the GIT on flush
+            struct sffs_inode_mem *cached;
+            errc = sffs_icache_get(sffs_ctx, next_entry, &cached);
+            if(errc < 0)
+                break;
+            supp_ino = (struct sffs_inode_list *) cached;
         }
-        else if(supp_ino_blks < remaining)
-            to_write = supp_ino_blks;
-        else 
-            to_write = remaining;
-           
-        memcpy(supp_ino->blks + pos, new_blocks + written, sizeof(blk32_t) * to_write);
-        errc = sffs_write_inode(sffs_ctx, buf);
-        if(errc < 0)
-            return errc;
+        else
+        {
+            blk32_t git_block = sffs_ctx->sb.s_GIT_start + next_entry / ino_per_block;
+
+            // Keep GIT blocks sorted, so adjacent ones are merged on write
+            size_t k = 0;
+            while(k < nr_git && git_blocks[k] < git_block)
+                k++;
+
+            if(k == nr_git || git_blocks[k] != git_block)
+            {
+                void *blk_buf = sffs_buf_get(sffs_ctx);
+                if(!blk_buf)
+                {
+                    errc = SFFS_ERR_MEMALLOC;
+                    break;
+                }
 
+                errc = sffs_read_blk(sffs_ctx, git_block, blk_buf, 1);
+                if(errc < 0)
+                {
+                    sffs_buf_put(sffs_ctx, blk_buf);
+                    break;
+                }
+
+                memmove(git_blocks + k + 1, git_blocks + k, sizeof(blk32_t) * (nr_git - k));
+                memmove(git_bufs + k + 1, git_bufs + k, sizeof(void *) * (nr_git - k));
+                git_blocks[k] = git_block;
+                git_bufs[k] = blk_buf;
+                nr_git++;
+            }
+
+            supp_ino = (struct sffs_inode_list *) 
+                ((u8_t *) git_bufs[k] + (next_entry % ino_per_block) * ino_entry_size);
+        }
+
+        u32_t to_write = 0;
+        if(next_id < supp_ino_blks)
+            to_write = supp_ino_blks - next_id;
+        if(to_write > allocated - written)
+            to_write = allocated - written;
+
+        memcpy(supp_ino->blks + next_id, new_blocks + written, sizeof(blk32_t) * to_write);
         written += to_write;
+        next_id = 0;
+
+        ino32_t cur_entry = next_entry;
         next_entry = supp_ino->i_next_entry;
+        if(sffs_ctx->icache)
+            sffs_icache_put(sffs_ctx, cur_entry, true);
     }
 
+    if(errc >= 0)
+        errc = sffs_write_blkv(sffs_ctx, git_blocks, git_bufs, nr_git);
+
+    for(size_t k = 0; k < nr_git; k++)
+        sffs_buf_put(sffs_ctx, git_bufs[k]);
+    free(git_blocks);
+    free(git_bufs);
+
+    if(errc >= 0 && written < allocated)
+        errc = SFFS_ERR_FS;
+    if(errc < 0)
+        goto alloc_fail;
+
+alloc_commit:
     ino_mem->ino.i_blks_count += allocated;
-    sffs_ctx->sb.s_free_blocks_count -= allocated;
-    sffs_ctx->sb.s_free_groups -= allocated_grps;
+    __atomic_fetch_sub(&sffs_ctx->sb.s_free_blocks_count, allocated, __ATOMIC_RELAXED);
 
+    /**
+     *  Blocks were marked in the bitmap when found. From here on they are 
+     *  registered in the inode in memory, so they stay claimed and the 
+     *  block map follows even if the inode does not reach the device
+    */
     errc = sffs_write_inode(sffs_ctx, ino_mem);
+    sffs_bmap_append(sffs_ctx, ino_mem->ino.i_inode_num, 
+        ino_mem->ino.i_blks_count - allocated, new_blocks, allocated);
+
+    free(new_blocks);
+    return errc < 0 ? errc : 0;
+
+// Blocks have not been registered, they are handed back to the bitmap
+alloc_fail:
+    __unclaim(sffs_ctx, new_blocks, allocated);
+    free(new_blocks);
+    return errc;
+}
+
+sffs_err_t sffs_free_data_blocks(sffs_context_t *sffs_ctx, size_t blk_count, 
+    struct sffs_inode_mem *ino_mem)
+{
+    if(!ino_mem || !sffs_ctx)
+        return SFFS_ERR_INVARG;
+
+    struct sffs_inode *inode = &(ino_mem->ino);
+    if(blk_count > inode->i_blks_count)
+        return SFFS_ERR_INVARG;
+    if(blk_count == 0)
+        return 0;
+
+    blk32_t *blocks = malloc(sizeof(blk32_t) * blk_count);
+    if(!blocks)
+        return SFFS_ERR_MEMALLOC;
+
+    sffs_err_t errc = sffs_get_data_blocks(sffs_ctx, ino_mem, 
+        inode->i_blks_count - blk_count, blk_count, blocks);
     if(errc < 0)
+    {
+        free(blocks);
         return errc;
+    }
 
     /**
-     *  At this point, all blocks which are recorded in new_blocks array are 
-     *  not actually allocated but rather commited to an inode
+     *  Inode drops the blocks first. Should anything fail later, blocks 
+     *  are leaked rather than owned by an inode and marked free at once
     */
-    for(u32_t i = 0; i < allocated; i++)
+    inode->i_blks_count -= blk_count;
+    u64_t max_size = (u64_t) inode->i_blks_count * sffs_ctx->sb.s_block_size;
+    if(sffs_inode_size(sffs_ctx, ino_mem) > max_size)
+        sffs_inode_set_size(sffs_ctx, ino_mem, max_size);
+    sffs_bmap_truncate(sffs_ctx, inode->i_inode_num, inode->i_blks_count);
+
+    if(sffs_ctx->sb.s_features & SFFS_FEATURE_EXTENTS)
     {
-        errc = sffs_set_data_bm(sffs_ctx, new_blocks[i]);
-        
-        /**
-         *  If error is occured during bitmap serialization, try to unwind the ongoing
-         *  process back and restore the bitmap validity
-        */ 
+        errc = sffs_ext_truncate(sffs_ctx, ino_mem, inode->i_blks_count);
         if(errc < 0)
         {
-            for(int k = 0; k < i; k++)
-            {
-                sffs_err_t errc2 = sffs_unset_data_bm(sffs_ctx, new_blocks[k]);
-                if(errc2 < 0)
-                    return errc2; 
-            }
-            return errc;  
+            free(blocks);
+            return errc;
         }
     }
 
-    free(buf);
-    free(new_blocks);
-    return 0;
+    errc = sffs_write_inode(sffs_ctx, ino_mem);
+    if(errc < 0)
+    {
+        free(blocks);
+        return errc;
+    }
+
+    // Sorted blocks make up the longest runs
+    qsort(blocks, blk_count, sizeof(blk32_t), sffs_blk_cmp);
+
+    /**
+     *  Stale copy must never be written back over the freed blocks. It is 
+     *  dropped while the blocks are still marked, a cached block of their 
+     *  next owner would be dropped with it otherwise
+    */
+    blk32_t data_start = sffs_data_start(sffs_ctx);
+    if(sffs_ctx->bcache)
+        for(size_t i = 0; i < blk_count; )
+        {
+            u32_t run = sffs_blk_run(blocks + i, blk_count - i);
+            sffs_bcache_forget(sffs_ctx, data_start + blocks[i], run);
+            i += run;
+        }
+
+    // With discard, blocks stay marked until the worker has discarded them
+    if(sffs_ctx->discard)
+    {
+        errc = sffs_discard(sffs_ctx, blocks, blk_count);
+        free(blocks);
+        return errc < 0 ? errc : 0;
+    }
+
+    for(size_t i = 0; i < blk_count; )
+    {
+        u32_t run = sffs_blk_run(blocks + i, blk_count - i);
+        errc = sffs_unset_data_bm_range(sffs_ctx, blocks[i], run);
+        if(errc < 0)
+            break;
+        __atomic_fetch_add(&sffs_ctx->sb.s_free_blocks_count, run, __ATOMIC_RELAXED);
+
+        // Free groups are counted by the bitmap handlers
+        i += run;
+    }
+
+    free(blocks);
+    return errc < 0 ? errc : 0;
 }
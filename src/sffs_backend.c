@@ -0,0 +1,774 @@
+/**
+ *  SPDX-License-Identifier: MIT
+ *  Copyright (c) 2023 Danylo Malapura
+*/
+
+/**
+ *  Device backends. Every backend implements struct sffs_dev_ops and
+ *  is selected at mount time. The core never touches the backend
+ *  directly, all accesses go through sffs_device.c
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // O_DIRECT, FALLOC_FL_PUNCH_HOLE
+#endif
+
+#include <sffs_device.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+
+/*          File backend            */
+
+/**
+ *  Reads up to bytes starting from offset. Stops early only at the 
+ *  end of file, so the number of bytes actually read is returned
+*/
+static ssize_t __fd_pread(int fd, void *data, size_t bytes, uint64_t offset)
+{
+    u8_t *ptr = (u8_t *) data;
+    size_t done = 0;
+
+    /**
+     *  pread(2) may transfer less than requested, so keep issuing it
+     *  until the whole range is done. Positional I/O does not touch the
+     *  shared file offset, thus it is safe to be called concurrently
+    */
+    while(done < bytes)
+    {
+        ssize_t rd = pread64(fd, ptr + done, bytes - done, offset + done);
+        if(rd < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if(rd == 0)
+            break;
+        done += rd;
+    }
+    return done;
+}
+
+static ssize_t __fd_pwrite(int fd, const void *data, size_t bytes, uint64_t offset)
+{
+    const u8_t *ptr = (const u8_t *) data;
+    size_t done = 0;
+
+    while(done < bytes)
+    {
+        ssize_t wr = pwrite64(fd, ptr + done, bytes - done, offset + done);
+        if(wr < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        // Nothing written for a nonzero count would never make progress
+        if(wr == 0)
+        {
+            errno = EIO;
+            return -1;
+        }
+        done += wr;
+    }
+    return done;
+}
+
+static inline bool __file_unaligned(sffs_context_t *sffs_ctx, const void *data, 
+    size_t bytes, uint64_t offset)
+{
+    size_t mask = sffs_ctx->dev_align - 1;
+    return sffs_ctx->dev_align != 0 && 
+        ((((uintptr_t) data) | bytes | offset) & mask) != 0;
+}
+
+/**
+ *  O_DIRECT transfers must be aligned in memory, offset and length. 
+ *  Unaligned requests (superblock, blocks smaller than device sector) 
+ *  go through an aligned bounce buffer covering the enclosing range. 
+ *  Writes become read-modify-write of that range and are serialized 
+ *  so two of them never overwrite each other's part of a sector
+*/
+static pthread_mutex_t __bounce_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ssize_t __file_bounce(sffs_context_t *sffs_ctx, void *data, size_t bytes,
+    uint64_t offset, bool write)
+{
+    size_t align = sffs_ctx->dev_align;
+    uint64_t start = offset & ~((uint64_t) align - 1);
+    uint64_t end = (offset + bytes + align - 1) & ~((uint64_t) align - 1);
+    size_t len = end - start;
+
+    u8_t *bounce = sffs_aligned_alloc(sffs_ctx, len);
+    if(!bounce)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ssize_t ret = bytes;
+    if(!write)
+    {
+        ssize_t rd = __fd_pread(sffs_ctx->disk_id, bounce, len, start);
+        if(rd >= 0 && (uint64_t) rd < offset + bytes - start)
+            errno = EIO;
+        if(rd < 0 || (uint64_t) rd < offset + bytes - start)
+            ret = -1;
+        else
+            memcpy(data, bounce + (offset - start), bytes);
+    }
+    else
+    {
+        pthread_mutex_lock(&__bounce_lock);
+        ssize_t rd = __fd_pread(sffs_ctx->disk_id, bounce, len, start);
+        if(rd < 0)
+            ret = -1;
+        else
+        {
+            // Tail past the end of file reads as zeros
+            memset(bounce + rd, 0, len - rd);
+            memcpy(bounce + (offset - start), data, bytes);
+            if(__fd_pwrite(sffs_ctx->disk_id, bounce, len, start) < 0)
+                ret = -1;
+        }
+        pthread_mutex_unlock(&__bounce_lock);
+    }
+
+    free(bounce);
+    return ret;
+}
+
+static ssize_t __file_pread(sffs_context_t *sffs_ctx, void *data, size_t bytes,
+    uint64_t offset)
+{
+    if(__file_unaligned(sffs_ctx, data, bytes, offset))
+        return __file_bounce(sffs_ctx, data, bytes, offset, false);
+
+    ssize_t rd = __fd_pread(sffs_ctx->disk_id, data, bytes, offset);
+    if(rd < 0)
+        return -1;
+
+    // Range lies beyond the end of the image
+    if((size_t) rd < bytes)
+    {
+        errno = EIO;
+        return -1;
+    }
+    return rd;
+}
+
+static ssize_t __file_pwrite(sffs_context_t *sffs_ctx, const void *data, size_t bytes,
+    uint64_t offset)
+{
+    if(__file_unaligned(sffs_ctx, data, bytes, offset))
+        return __file_bounce(sffs_ctx, (void *) data, bytes, offset, true);
+    return __fd_pwrite(sffs_ctx->disk_id, data, bytes, offset);
+}
+
+/**
+ *  Vectored transfers follow the same rules as the plain ones. After a 
+ *  short transfer the vector is advanced past the transferred bytes 
+ *  and the rest is reissued
+*/
+static ssize_t __file_rwv(sffs_context_t *sffs_ctx, const struct iovec *iov, int iovcnt, 
+    uint64_t offset, bool write)
+{
+    size_t total = 0;
+    bool unaligned = false;
+    for(int i = 0; i < iovcnt; i++)
+    {
+        if(__file_unaligned(sffs_ctx, iov[i].iov_base, iov[i].iov_len, offset + total))
+            unaligned = true;
+        total += iov[i].iov_len;
+    }
+
+    // Unaligned O_DIRECT segments must be bounced one by one
+    if(unaligned)
+    {
+        uint64_t off = offset;
+        for(int i = 0; i < iovcnt; i++)
+        {
+            ssize_t ret = write ? 
+                __file_pwrite(sffs_ctx, iov[i].iov_base, iov[i].iov_len, off) :
+                __file_pread(sffs_ctx, iov[i].iov_base, iov[i].iov_len, off);
+            if(ret < 0)
+                return -1;
+            off += iov[i].iov_len;
+        }
+        return total;
+    }
+
+    struct iovec vec[iovcnt];
+    memcpy(vec, iov, sizeof(struct iovec) * iovcnt);
+
+    int first = 0;
+    size_t done = 0;
+    while(done < total)
+    {
+        ssize_t ret = write ? 
+            pwritev64(sffs_ctx->disk_id, vec + first, iovcnt - first, offset + done) :
+            preadv64(sffs_ctx->disk_id, vec + first, iovcnt - first, offset + done);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        // Range lies beyond the end of the image
+        if(ret == 0)
+        {
+            errno = EIO;
+            return -1;
+        }
+
+        done += ret;
+        while(first < iovcnt && (size_t) ret >= vec[first].iov_len)
+        {
+            ret -= vec[first].iov_len;
+            first++;
+        }
+
+        if(first < iovcnt)
+        {
+            vec[first].iov_base = (u8_t *) vec[first].iov_base + ret;
+            vec[first].iov_len -= ret;
+        }
+    }
+    return total;
+}
+
+static ssize_t __file_preadv(sffs_context_t *sffs_ctx, const struct iovec *iov, int iovcnt, 
+    uint64_t offset)
+{
+    return __file_rwv(sffs_ctx, iov, iovcnt, offset, false);
+}
+
+static ssize_t __file_pwritev(sffs_context_t *sffs_ctx, const struct iovec *iov, int iovcnt, 
+    uint64_t offset)
+{
+    return __file_rwv(sffs_ctx, iov, iovcnt, offset, true);
+}
+
+static int __file_open(sffs_context_t *sffs_ctx, const char *path, int oflags)
+{
+    int fd = open(path, O_RDWR | oflags);
+    if(fd < 0)
+        return SFFS_ERR_INIT;
+
+    if(oflags & O_DIRECT)
+        sffs_ctx->dev_align = SFFS_DIRECT_ALIGN;
+
+    sffs_ctx->disk_id = fd;
+    return 0;
+}
+
+static void __file_close(sffs_context_t *sffs_ctx)
+{
+    close(sffs_ctx->disk_id);
+    sffs_ctx->disk_id = -1;
+}
+
+static int __file_sync(sffs_context_t *sffs_ctx)
+{
+    return fsync(sffs_ctx->disk_id);
+}
+
+static int __file_size(sffs_context_t *sffs_ctx, uint64_t *size)
+{
+    struct stat st;
+    if(fstat(sffs_ctx->disk_id, &st) < 0)
+        return SFFS_ERR_DEV_STAT;
+
+    *size = st.st_size;
+    return 0;
+}
+
+/**
+ *  Punched range reads back as zeros and no longer occupies space 
+ *  in the image, file size stays the same
+*/
+static int __file_discard(sffs_context_t *sffs_ctx, uint64_t offset, uint64_t bytes)
+{
+    return fallocate(sffs_ctx->disk_id, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+        offset, bytes);
+}
+
+const struct sffs_dev_ops sffs_file_ops =
+{
+    .name       = "file",
+    .open       = __file_open,
+    .close      = __file_close,
+    .pread      = __file_pread,
+    .pwrite     = __file_pwrite,
+    .sync       = __file_sync,
+    .size       = __file_size,
+    .map        = NULL,
+    .preadv     = __file_preadv,
+    .pwritev    = __file_pwritev,
+    .discard    = __file_discard,
+};
+
+/*          Block device backend            */
+
+static int __blkdev_open(sffs_context_t *sffs_ctx, const char *path, int oflags)
+{
+    // Exclusive open prevents device from being mounted twice
+    int fd = open(path, O_RDWR | O_EXCL | oflags);
+    if(fd < 0)
+        return SFFS_ERR_INIT;
+
+    struct stat st;
+    if(fstat(fd, &st) < 0 || !S_ISBLK(st.st_mode))
+    {
+        close(fd);
+        return SFFS_ERR_INIT;
+    }
+
+    // Device knows its logical sector size, no need to guess
+    if(oflags & O_DIRECT)
+    {
+        int sector_size;
+        if(ioctl(fd, BLKSSZGET, &sector_size) < 0)
+            sector_size = SFFS_DIRECT_ALIGN;
+        sffs_ctx->dev_align = sector_size;
+    }
+
+    sffs_ctx->disk_id = fd;
+    return 0;
+}
+
+static int __blkdev_sync(sffs_context_t *sffs_ctx)
+{
+    // Block devices have no file metadata to be committed
+    return fdatasync(sffs_ctx->disk_id);
+}
+
+static int __blkdev_size(sffs_context_t *sffs_ctx, uint64_t *size)
+{
+    if(ioctl(sffs_ctx->disk_id, BLKGETSIZE64, size) < 0)
+        return SFFS_ERR_DEV_STAT;
+    return 0;
+}
+
+static int __blkdev_discard(sffs_context_t *sffs_ctx, uint64_t offset, uint64_t bytes)
+{
+    uint64_t range[2] = { offset, bytes };
+    return ioctl(sffs_ctx->disk_id, BLKDISCARD, range);
+}
+
+const struct sffs_dev_ops sffs_blkdev_ops =
+{
+    .name       = "blkdev",
+    .open       = __blkdev_open,
+    .close      = __file_close,
+    .pread      = __file_pread,
+    .pwrite     = __file_pwrite,
+    .sync       = __blkdev_sync,
+    .size       = __blkdev_size,
+    .map        = NULL,
+    .preadv     = __file_preadv,
+    .pwritev    = __file_pwritev,
+    .discard    = __blkdev_discard,
+};
+
+/*          RAM backend             */
+
+/**
+ *  RAM backend keeps the whole file system in anonymous memory. Image
+ *  is only used as a template which is loaded at mount time, nothing
+ *  is ever written back. Suitable for benchmarking the core without
+ *  device noise and for scratch file systems
+*/
+struct sffs_ram_dev
+{
+    u8_t *mem;
+    uint64_t size;
+};
+
+static int __ram_open(sffs_context_t *sffs_ctx, const char *path, int oflags)
+{
+    // Template is only read, sffs_dev_open has already refused O_DIRECT
+    (void) oflags;
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return SFFS_ERR_INIT;
+
+    struct stat st;
+    if(fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return SFFS_ERR_DEV_STAT;
+    }
+
+    struct sffs_ram_dev *ram = malloc(sizeof(struct sffs_ram_dev));
+    if(!ram)
+    {
+        close(fd);
+        return SFFS_ERR_MEMALLOC;
+    }
+
+    ram->size = st.st_size;
+    ram->mem = malloc(ram->size);
+    if(!ram->mem)
+    {
+        free(ram);
+        close(fd);
+        return SFFS_ERR_MEMALLOC;
+    }
+
+    ssize_t rd = __fd_pread(fd, ram->mem, ram->size, 0);
+    close(fd);
+
+    if(rd < 0 || (uint64_t) rd < ram->size)
+    {
+        free(ram->mem);
+        free(ram);
+        return SFFS_ERR_DEV_READ;
+    }
+
+    sffs_ctx->dev_priv = ram;
+    return 0;
+}
+
+static void __ram_close(sffs_context_t *sffs_ctx)
+{
+    struct sffs_ram_dev *ram = (struct sffs_ram_dev *) sffs_ctx->dev_priv;
+    free(ram->mem);
+    free(ram);
+    sffs_ctx->dev_priv = NULL;
+}
+
+static ssize_t __ram_pread(sffs_context_t *sffs_ctx, void *data, size_t bytes,
+    uint64_t offset)
+{
+    struct sffs_ram_dev *ram = (struct sffs_ram_dev *) sffs_ctx->dev_priv;
+    if(offset + bytes > ram->size)
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    memcpy(data, ram->mem + offset, bytes);
+    return bytes;
+}
+
+static ssize_t __ram_pwrite(sffs_context_t *sffs_ctx, const void *data, size_t bytes,
+    uint64_t offset)
+{
+    struct sffs_ram_dev *ram = (struct sffs_ram_dev *) sffs_ctx->dev_priv;
+    if(offset + bytes > ram->size)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    memcpy(ram->mem + offset, data, bytes);
+    return bytes;
+}
+
+static int __ram_sync(sffs_context_t *sffs_ctx)
+{
+    (void) sffs_ctx;
+    return 0;
+}
+
+static int __ram_size(sffs_context_t *sffs_ctx, uint64_t *size)
+{
+    struct sffs_ram_dev *ram = (struct sffs_ram_dev *) sffs_ctx->dev_priv;
+    *size = ram->size;
+    return 0;
+}
+
+static void *__ram_map(sffs_context_t *sffs_ctx, uint64_t offset, size_t bytes)
+{
+    struct sffs_ram_dev *ram = (struct sffs_ram_dev *) sffs_ctx->dev_priv;
+    if(offset + bytes > ram->size)
+        return NULL;
+    return ram->mem + offset;
+}
+
+const struct sffs_dev_ops sffs_ram_ops =
+{
+    .name       = "ram",
+    .open       = __ram_open,
+    .close      = __ram_close,
+    .pread      = __ram_pread,
+    .pwrite     = __ram_pwrite,
+    .sync       = __ram_sync,
+    .size       = __ram_size,
+    .map        = __ram_map,
+};
+
+/*          Memory-mapped file backend          */
+
+/**
+ *  Whole image is mapped shared, so reads are plain memory loads and 
+ *  writes land in the page cache directly. Pages touched by writes 
+ *  are remembered in a dirty bitmap and only those ranges are passed 
+ *  to msync(2) at sync time instead of the whole mapping
+*/
+struct sffs_mmap_dev
+{
+    u8_t *mem;
+    uint64_t size;
+    size_t page_size;
+    size_t nr_pages;
+    unsigned long *dirty;       // One bit per page of the mapping
+};
+
+#define SFFS_LONG_BITS      (sizeof(unsigned long) * 8)
+
+static int __mmap_open(sffs_context_t *sffs_ctx, const char *path, int oflags)
+{
+    // Mapping is served from the page cache, direct I/O cannot apply to it
+    if(oflags & O_DIRECT)
+        return SFFS_ERR_INVARG;
+
+    int fd = open(path, O_RDWR | oflags);
+    if(fd < 0)
+        return SFFS_ERR_INIT;
+
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        return SFFS_ERR_DEV_STAT;
+    }
+
+    struct sffs_mmap_dev *mdev = malloc(sizeof(struct sffs_mmap_dev));
+    if(!mdev)
+    {
+        close(fd);
+        return SFFS_ERR_MEMALLOC;
+    }
+
+    mdev->size = st.st_size;
+    mdev->page_size = sysconf(_SC_PAGESIZE);
+    mdev->nr_pages = (mdev->size + mdev->page_size - 1) / mdev->page_size;
+    mdev->dirty = calloc((mdev->nr_pages + SFFS_LONG_BITS - 1) / SFFS_LONG_BITS, 
+        sizeof(unsigned long));
+    if(!mdev->dirty)
+    {
+        free(mdev);
+        close(fd);
+        return SFFS_ERR_MEMALLOC;
+    }
+
+    mdev->mem = mmap(NULL, mdev->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(mdev->mem == MAP_FAILED)
+    {
+        free(mdev->dirty);
+        free(mdev);
+        close(fd);
+        return SFFS_ERR_INIT;
+    }
+
+    // Image is expected to fit in memory, fault it in ahead of time
+    madvise(mdev->mem, mdev->size, MADV_WILLNEED);
+
+    sffs_ctx->disk_id = fd;
+    sffs_ctx->dev_priv = mdev;
+    return 0;
+}
+
+static int __mmap_sync(sffs_context_t *sffs_ctx)
+{
+    struct sffs_mmap_dev *mdev = (struct sffs_mmap_dev *) sffs_ctx->dev_priv;
+    size_t words = (mdev->nr_pages + SFFS_LONG_BITS - 1) / SFFS_LONG_BITS;
+    size_t run_start = 0, run_len = 0;
+    int errc = 0;
+
+    /**
+     *  Dirty bits are taken atomically word by word, pages dirtied 
+     *  while sync is in progress are simply left for the next one. 
+     *  Adjacent dirty pages are merged into a single msync call
+    */
+    for(size_t w = 0; w <= words; w++)
+    {
+        unsigned long bits = 0;
+        if(w < words)
+            bits = __atomic_exchange_n(&mdev->dirty[w], 0, __ATOMIC_ACQ_REL);
+        if(bits == 0 && run_len == 0)
+            continue;
+
+        for(size_t b = 0; b < SFFS_LONG_BITS; b++)
+        {
+            size_t page = w * SFFS_LONG_BITS + b;
+            if(bits & (1UL << b))
+            {
+                if(run_len == 0)
+                    run_start = page;
+                run_len++;
+                continue;
+            }
+
+            if(run_len == 0)
+                continue;
+
+            u8_t *addr = mdev->mem + run_start * mdev->page_size;
+            uint64_t len = run_len * mdev->page_size;
+            if(run_start * mdev->page_size + len > mdev->size)
+                len = mdev->size - run_start * mdev->page_size;
+
+            if(msync(addr, len, MS_SYNC) < 0)
+                errc = -1;
+            run_len = 0;
+
+            // Rest of the word is clean, do not walk it bit by bit
+            if((bits >> b) == 0)
+                break;
+        }
+    }
+    return errc;
+}
+
+static void __mmap_close(sffs_context_t *sffs_ctx)
+{
+    struct sffs_mmap_dev *mdev = (struct sffs_mmap_dev *) sffs_ctx->dev_priv;
+    __mmap_sync(sffs_ctx);
+    munmap(mdev->mem, mdev->size);
+    free(mdev->dirty);
+    free(mdev);
+    sffs_ctx->dev_priv = NULL;
+    __file_close(sffs_ctx);
+}
+
+static ssize_t __mmap_pread(sffs_context_t *sffs_ctx, void *data, size_t bytes,
+    uint64_t offset)
+{
+    struct sffs_mmap_dev *mdev = (struct sffs_mmap_dev *) sffs_ctx->dev_priv;
+    if(offset + bytes > mdev->size)
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    memcpy(data, mdev->mem + offset, bytes);
+    return bytes;
+}
+
+static ssize_t __mmap_pwrite(sffs_context_t *sffs_ctx, const void *data, size_t bytes,
+    uint64_t offset)
+{
+    struct sffs_mmap_dev *mdev = (struct sffs_mmap_dev *) sffs_ctx->dev_priv;
+    if(offset + bytes > mdev->size)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if(bytes == 0)
+        return 0;
+
+    memcpy(mdev->mem + offset, data, bytes);
+
+    size_t first = offset / mdev->page_size;
+    size_t last = (offset + bytes - 1) / mdev->page_size;
+    for(size_t page = first; page <= last; page++)
+        __atomic_fetch_or(&mdev->dirty[page / SFFS_LONG_BITS], 
+            1UL << (page % SFFS_LONG_BITS), __ATOMIC_RELEASE);
+    return bytes;
+}
+
+static int __mmap_size(sffs_context_t *sffs_ctx, uint64_t *size)
+{
+    struct sffs_mmap_dev *mdev = (struct sffs_mmap_dev *) sffs_ctx->dev_priv;
+    *size = mdev->size;
+    return 0;
+}
+
+static void *__mmap_map(sffs_context_t *sffs_ctx, uint64_t offset, size_t bytes)
+{
+    struct sffs_mmap_dev *mdev = (struct sffs_mmap_dev *) sffs_ctx->dev_priv;
+    if(offset + bytes > mdev->size)
+        return NULL;
+    return mdev->mem + offset;
+}
+
+const struct sffs_dev_ops sffs_mmap_ops =
+{
+    .name       = "mmap",
+    .open       = __mmap_open,
+    .close      = __mmap_close,
+    .pread      = __mmap_pread,
+    .pwrite     = __mmap_pwrite,
+    .sync       = __mmap_sync,
+    .size       = __mmap_size,
+    .map        = __mmap_map,
+
+    // Punching the file drops the pages from the shared mapping as well
+    .discard    = __file_discard,
+};
+
+static const struct sffs_dev_ops *sffs_backends[] =
+{
+    &sffs_file_ops,
+    &sffs_blkdev_ops,
+    &sffs_ram_ops,
+    &sffs_mmap_ops,
+    &sffs_stripe_ops,
+    NULL
+};
+
+int sffs_dev_open(sffs_context_t *sffs_ctx, const char *path, const char *backend, 
+    int oflags)
+{
+    if(!sffs_ctx || !path)
+        return SFFS_ERR_INVARG;
+
+    const struct sffs_dev_ops *ops = NULL;
+    if(backend)
+    {
+        for(int i = 0; sffs_backends[i] != NULL; i++)
+            if(strcmp(sffs_backends[i]->name, backend) == 0)
+                ops = sffs_backends[i];
+
+        if(!ops)
+            return SFFS_ERR_INVARG;
+    }
+    else if(strchr(path, ','))
+        ops = &sffs_stripe_ops;
+    else
+    {
+        // Choose backend depending on what image actually is
+        struct stat st;
+        if(stat(path, &st) < 0)
+            return SFFS_ERR_DEV_STAT;
+        ops = S_ISBLK(st.st_mode) ? &sffs_blkdev_ops : &sffs_file_ops;
+    }
+
+    // Memory backed devices bypass the page cache anyway
+    if((oflags & O_DIRECT) && ops->map)
+        return SFFS_ERR_INVARG;
+
+    sffs_ctx->disk_id = -1;
+    sffs_ctx->dev_priv = NULL;
+    sffs_ctx->dev_align = 0;
+    int errc = ops->open(sffs_ctx, path, oflags);
+    if(errc < 0)
+        return errc;
+
+    sffs_ctx->dev_ops = ops;
+    return 0;
+}
+
+void sffs_dev_close(sffs_context_t *sffs_ctx)
+{
+    if(sffs_ctx->dev_ops)
+        sffs_ctx->dev_ops->close(sffs_ctx);
+    else if(sffs_ctx->disk_id >= 0)
+        close(sffs_ctx->disk_id);
+    sffs_ctx->dev_ops = NULL;
+    sffs_ctx->dev_align = 0;
+}
@@ -0,0 +1,245 @@
+/**
+ *  SPDX-License-Identifier: MIT
+ *  Copyright (c) 2023 Danylo Malapura
+*/
+
+/**
+ *  Logical to physical block maps. Resolving a block beyond the
+ *  primary inode means walking the supplementary inode chain, so
+ *  every inode that is being accessed gets a slot holding the flat
+ *  array of its data block ids and the ids of its supplementary
+ *  inodes. The map is built by a single walk of the chain on the
+ *  first access past the cached part, afterwards every lookup is an
+ *  array access. Allocation appends to the map, release truncates it
+*/
+
+#include <sffs_device.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct sffs_bmap_slot
+{
+    ino32_t ino;            // Inode the slot belongs to
+    bool valid;
+    u32_t nr_blks;          // Logical blocks [0, nr_blks) are mapped
+    u32_t blks_size;
+    blk32_t *blks;          // Data block ids in logical order
+    u32_t nr_entries;
+    u32_t entries_size;
+    ino32_t *entries;       // Supplementary inodes in list order
+};
+
+struct sffs_bmap
+{
+    pthread_mutex_t lock;
+    struct sffs_bmap_slot slots[SFFS_BMAP_SLOTS];
+};
+
+static int __bmap_reserve(void **arr, u32_t *size, u32_t need, size_t item)
+{
+    if(*size >= need)
+        return 0;
+
+    u32_t new_size = *size ? *size : 16;
+    while(new_size < need)
+        new_size <<= 1;
+
+    void *res = realloc(*arr, new_size * item);
+    if(!res)
+        return SFFS_ERR_MEMALLOC;
+
+    *arr = res;
+    *size = new_size;
+    return 0;
+}
+
+/**
+ *  Maps all blocks and supplementary inodes of ino_mem with a single
+ *  walk of its inode list. Must be called with block map lock held
+*/
+static int __bmap_build(sffs_context_t *sffs_ctx, struct sffs_bmap_slot *slot,
+    struct sffs_inode_mem *ino_mem)
+{
+    struct sffs_inode *inode = &ino_mem->ino;
+    u32_t ino_entry_size = sffs_ctx->sb.s_inode_size + sffs_ctx->sb.s_inode_block_size;
+    u32_t pr_ino_blks = sffs_ctx->sb.s_inode_block_size / sizeof(blk32_t);
+    u32_t supp_ino_blks = (ino_entry_size - SFFS_INODE_LIST_SIZE) / sizeof(blk32_t);
+    u32_t nr_supp = inode->i_list_size ? inode->i_list_size - 1 : 0;
+
+    slot->valid = false;
+    if(__bmap_reserve((void **) &slot->blks, &slot->blks_size, inode->i_blks_count,
+        sizeof(blk32_t)) < 0)
+        return SFFS_ERR_MEMALLOC;
+    if(__bmap_reserve((void **) &slot->entries, &slot->entries_size, nr_supp,
+        sizeof(ino32_t)) < 0)
+        return SFFS_ERR_MEMALLOC;
+
+    // Extents are expanded, list entries do not map to block ranges with them
+    if(sffs_ctx->sb.s_features & SFFS_FEATURE_EXTENTS)
+    {
+        sffs_err_t errc = sffs_ext_get_blocks(sffs_ctx, ino_mem, 0, inode->i_blks_count, 
+            slot->blks);
+        if(errc < 0)
+            return errc;
+
+        slot->ino = inode->i_inode_num;
+        slot->nr_blks = inode->i_blks_count;
+        slot->nr_entries = 0;
+        slot->valid = true;
+        return 0;
+    }
+
+    u32_t nr_blks = inode->i_blks_count < pr_ino_blks ? inode->i_blks_count : pr_ino_blks;
+    memcpy(slot->blks, ino_mem->blks, sizeof(blk32_t) * nr_blks);
+
+    struct sffs_inode_list *list = malloc(ino_entry_size);
+    if(!list)
+        return SFFS_ERR_MEMALLOC;
+
+    // Entries are walked even past the last block, allocation fills them later
+    u32_t nr_entries = 0;
+    ino32_t supp_ino = inode->i_next_entry;
+    while(supp_ino != 0 && nr_entries < nr_supp)
+    {
+        sffs_err_t errc = sffs_read_inode(sffs_ctx, supp_ino, (struct sffs_inode_mem *) list);
+        if(errc < 0)
+        {
+            free(list);
+            return errc;
+        }
+
+        u32_t count = inode->i_blks_count - nr_blks;
+        if(count > supp_ino_blks)
+            count = supp_ino_blks;
+        memcpy(slot->blks + nr_blks, list->blks, sizeof(blk32_t) * count);
+        nr_blks += count;
+
+        slot->entries[nr_entries++] = supp_ino;
+        supp_ino = list->i_next_entry;
+    }
+    free(list);
+
+    if(nr_blks != inode->i_blks_count)
+        return SFFS_ERR_FS;
+
+    slot->ino = inode->i_inode_num;
+    slot->nr_blks = nr_blks;
+    slot->nr_entries = nr_entries;
+    slot->valid = true;
+    return 0;
+}
+
+sffs_err_t sffs_bmap_init(sffs_context_t *sffs_ctx)
+{
+    struct sffs_bmap *bm = calloc(1, sizeof(struct sffs_bmap));
+    if(!bm)
+        return SFFS_ERR_MEMALLOC;
+
+    pthread_mutex_init(&bm->lock, NULL);
+    sffs_ctx->bmap = bm;
+    return 0;
+}
+
+void sffs_bmap_destroy(sffs_context_t *sffs_ctx)
+{
+    struct sffs_bmap *bm = sffs_ctx->bmap;
+    if(!bm)
+        return;
+
+    for(int i = 0; i < SFFS_BMAP_SLOTS; i++)
+    {
+        free(bm->slots[i].blks);
+        free(bm->slots[i].entries);
+    }
+
+    pthread_mutex_destroy(&bm->lock);
+    free(bm);
+    sffs_ctx->bmap = NULL;
+}
+
+sffs_err_t sffs_bmap_lookup(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem,
+    blk32_t first, u32_t count, blk32_t *blocks, ino32_t *entry)
+{
+    struct sffs_bmap *bm = sffs_ctx->bmap;
+    if(!bm)
+        return SFFS_ERR_INIT;
+
+    ino32_t ino = ino_mem->ino.i_inode_num;
+    u32_t pr_ino_blks = sffs_ctx->sb.s_inode_block_size / sizeof(blk32_t);
+    u32_t supp_ino_blks = (sffs_ctx->sb.s_inode_size + sffs_ctx->sb.s_inode_block_size -
+        SFFS_INODE_LIST_SIZE) / sizeof(blk32_t);
+
+    // Index of the supplementary inode holding first, if it is asked for
+    u32_t entry_id = 0;
+    if(entry && first >= pr_ino_blks)
+        entry_id = (first - pr_ino_blks) / supp_ino_blks + 1;
+
+    sffs_err_t errc = 0;
+    pthread_mutex_lock(&bm->lock);
+
+    struct sffs_bmap_slot *slot = &bm->slots[ino % SFFS_BMAP_SLOTS];
+    if(!slot->valid || slot->ino != ino || (u64_t) first + count > slot->nr_blks ||
+        entry_id > slot->nr_entries)
+        errc = __bmap_build(sffs_ctx, slot, ino_mem);
+
+    if(errc >= 0 && ((u64_t) first + count > slot->nr_blks || entry_id > slot->nr_entries))
+        errc = SFFS_ERR_INVARG;
+
+    if(errc >= 0)
+    {
+        memcpy(blocks, slot->blks + first, sizeof(blk32_t) * count);
+        if(entry)
+            *entry = entry_id ? slot->entries[entry_id - 1] : ino;
+    }
+    pthread_mutex_unlock(&bm->lock);
+    return errc;
+}
+
+void sffs_bmap_append(sffs_context_t *sffs_ctx, ino32_t ino, blk32_t first,
+    const blk32_t *blocks, u32_t count)
+{
+    struct sffs_bmap *bm = sffs_ctx->bmap;
+    if(!bm)
+        return;
+
+    pthread_mutex_lock(&bm->lock);
+    struct sffs_bmap_slot *slot = &bm->slots[ino % SFFS_BMAP_SLOTS];
+    if(slot->valid && slot->ino == ino)
+    {
+        if(slot->nr_blks > first)
+            slot->nr_blks = first;
+
+        // Map with a hole in it is rebuilt on the next lookup instead
+        if(slot->nr_blks == first)
+        {
+            if(__bmap_reserve((void **) &slot->blks, &slot->blks_size, first + count,
+                sizeof(blk32_t)) < 0)
+                slot->valid = false;
+            else
+            {
+                memcpy(slot->blks + first, blocks, sizeof(blk32_t) * count);
+                slot->nr_blks = first + count;
+            }
+        }
+    }
+    pthread_mutex_unlock(&bm->lock);
+}
+
+void sffs_bmap_truncate(sffs_context_t *sffs_ctx, ino32_t ino, blk32_t count)
+{
+    struct sffs_bmap *bm = sffs_ctx->bmap;
+    if(!bm)
+        return;
+
+    pthread_mutex_lock(&bm->lock);
+    struct sffs_bmap_slot *slot = &bm->slots[ino % SFFS_BMAP_SLOTS];
+    if(slot->valid && slot->ino == ino)
+    {
+        if(count == 0)
+            slot->valid = false;
+        else if(slot->nr_blks > count)
+            slot->nr_blks = count;
+    }
+    pthread_mutex_unlock(&bm->lock);
+}
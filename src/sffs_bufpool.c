@@ -0,0 +1,122 @@
+/**
+ *  SPDX-License-Identifier: MIT
+ *  Copyright (c) 2023 Danylo Malapura
+*/
+
+/**
+ *  Pool of block-sized scratch buffers. Buffers are carved from a
+ *  single aligned slab at mount time, so the hot paths neither call
+ *  malloc nor hand unaligned memory to a device opened with O_DIRECT.
+ *  When the pool runs dry, buffers are allocated on demand and freed
+ *  on return
+*/
+
+#include <sffs_device.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+struct sffs_bufpool
+{
+    pthread_mutex_t lock;
+    u8_t *slab;             // Memory backing every pooled buffer
+    size_t buf_size;        // Size of a single buffer (block size)
+    size_t nr_bufs;
+    void **free_bufs;       // Stack of free buffers
+    size_t nr_free;
+};
+
+static size_t __sffs_buf_align(sffs_context_t *sffs_ctx)
+{
+    size_t align = sffs_ctx->dev_align;
+    if(align == 0)
+        align = sysconf(_SC_PAGESIZE);
+    return align;
+}
+
+void *sffs_aligned_alloc(sffs_context_t *sffs_ctx, size_t bytes)
+{
+    void *ptr;
+    if(posix_memalign(&ptr, __sffs_buf_align(sffs_ctx), bytes) != 0)
+        return NULL;
+    return ptr;
+}
+
+int sffs_bufpool_init(sffs_context_t *sffs_ctx, size_t nr_bufs)
+{
+    if(!sffs_ctx || nr_bufs == 0)
+        return SFFS_ERR_INVARG;
+
+    struct sffs_bufpool *pool = malloc(sizeof(struct sffs_bufpool));
+    if(!pool)
+        return SFFS_ERR_MEMALLOC;
+
+    pool->buf_size = sffs_ctx->sb.s_block_size;
+    pool->nr_bufs = nr_bufs;
+    pool->slab = sffs_aligned_alloc(sffs_ctx, pool->buf_size * nr_bufs);
+    pool->free_bufs = malloc(sizeof(void *) * nr_bufs);
+    if(!pool->slab || !pool->free_bufs)
+    {
+        free(pool->slab);
+        free(pool->free_bufs);
+        free(pool);
+        return SFFS_ERR_MEMALLOC;
+    }
+
+    for(size_t i = 0; i < nr_bufs; i++)
+        pool->free_bufs[i] = pool->slab + i * pool->buf_size;
+    pool->nr_free = nr_bufs;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    sffs_ctx->bufpool = pool;
+    return 0;
+}
+
+void sffs_bufpool_destroy(sffs_context_t *sffs_ctx)
+{
+    struct sffs_bufpool *pool = sffs_ctx->bufpool;
+    if(!pool)
+        return;
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->free_bufs);
+    free(pool->slab);
+    free(pool);
+    sffs_ctx->bufpool = NULL;
+}
+
+void *sffs_buf_get(sffs_context_t *sffs_ctx)
+{
+    struct sffs_bufpool *pool = sffs_ctx->bufpool;
+    void *buf = NULL;
+
+    if(pool)
+    {
+        pthread_mutex_lock(&pool->lock);
+        if(pool->nr_free != 0)
+            buf = pool->free_bufs[--pool->nr_free];
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if(!buf)
+        buf = sffs_aligned_alloc(sffs_ctx, sffs_ctx->sb.s_block_size);
+    return buf;
+}
+
+void sffs_buf_put(sffs_context_t *sffs_ctx, void *buf)
+{
+    struct sffs_bufpool *pool = sffs_ctx->bufpool;
+    if(!buf)
+        return;
+
+    // Buffers allocated on demand do not belong to the slab
+    u8_t *ptr = (u8_t *) buf;
+    if(!pool || ptr < pool->slab || ptr >= pool->slab + pool->buf_size * pool->nr_bufs)
+    {
+        free(buf);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->free_bufs[pool->nr_free++] = buf;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,481 @@
+/**
+ *  SPDX-License-Identifier: MIT
+ *  Copyright (c) 2023 Danylo Malapura
+*/
+
+/**
+ *  Write-back block cache. Sits between the core and the device and
+ *  keeps recently used blocks in memory. Blocks are looked up by
+ *  absolute block number through a hash table and evicted in LRU
+ *  order. Modified blocks are only marked dirty and reach the device
+ *  on sffs_bcache_flush, which is issued either by sffs_sync or by
+ *  the background flusher thread. Flush writes dirty blocks in the
+ *  order of their block numbers, so adjacent ones are merged into
+ *  vectored writes
+*/
+
+#include <sffs_device.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+struct sffs_buf_head
+{
+    blk32_t b_blocknr;                  // Absolute block number
+    bool b_dirty;                       // Block differs from on-disk copy
+    struct sffs_buf_head *b_hnext;      // Next entry within hash chain
+    struct sffs_buf_head *b_prev;       // LRU list links
+    struct sffs_buf_head *b_next;
+    u8_t *b_data;                       // Block content
+};
+
+struct sffs_bcache
+{
+    pthread_mutex_t lock;
+    size_t nr_bufs;                     // Number of allocated buffers
+    size_t max_bufs;                    // Cache capacity in blocks
+    size_t hash_size;
+    struct sffs_buf_head **hash;
+
+    /**
+     *  LRU list sentinel. lru.b_next is the most recently used buffer,
+     *  lru.b_prev is the least recently used one and eviction victim
+    */
+    struct sffs_buf_head lru;
+
+    /**
+     *  Incremented by every write. Allows to detect whether a block read
+     *  outside of the cache lock might have become stale
+    */
+    u64_t write_seq;
+
+    struct sffs_buf_head **flush_list;  // Dirty buffers sorted by flush
+
+    // Background flusher
+    pthread_t flusher;
+    pthread_cond_t flush_cond;
+    unsigned int flush_interval;
+    bool flusher_running;
+    bool stop;
+};
+
+static inline size_t __bcache_hash(struct sffs_bcache *bc, blk32_t block)
+{
+    return (block * 2654435761U) & (bc->hash_size - 1);
+}
+
+static struct sffs_buf_head *__bcache_lookup(struct sffs_bcache *bc, blk32_t block)
+{
+    struct sffs_buf_head *bh = bc->hash[__bcache_hash(bc, block)];
+    while(bh && bh->b_blocknr != block)
+        bh = bh->b_hnext;
+    return bh;
+}
+
+static void __bcache_hash_remove(struct sffs_bcache *bc, struct sffs_buf_head *bh)
+{
+    struct sffs_buf_head **pp = &bc->hash[__bcache_hash(bc, bh->b_blocknr)];
+    while(*pp != bh)
+        pp = &(*pp)->b_hnext;
+    *pp = bh->b_hnext;
+    bh->b_hnext = NULL;
+}
+
+static void __bcache_hash_insert(struct sffs_bcache *bc, struct sffs_buf_head *bh)
+{
+    size_t id = __bcache_hash(bc, bh->b_blocknr);
+    bh->b_hnext = bc->hash[id];
+    bc->hash[id] = bh;
+}
+
+static void __bcache_lru_unlink(struct sffs_buf_head *bh)
+{
+    bh->b_prev->b_next = bh->b_next;
+    bh->b_next->b_prev = bh->b_prev;
+}
+
+static void __bcache_lru_push(struct sffs_bcache *bc, struct sffs_buf_head *bh)
+{
+    bh->b_next = bc->lru.b_next;
+    bh->b_prev = &bc->lru;
+    bc->lru.b_next->b_prev = bh;
+    bc->lru.b_next = bh;
+}
+
+/**
+ *  Returns buffer that is not bound to any block. Either allocates a
+ *  new one or evicts the least recently used buffer, writing it back
+ *  if it is dirty. Must be called with cache lock held
+*/
+static int __bcache_get_free(sffs_context_t *sffs_ctx, struct sffs_buf_head **res)
+{
+    struct sffs_bcache *bc = sffs_ctx->bcache;
+    struct sffs_buf_head *bh;
+
+    if(bc->nr_bufs < bc->max_bufs)
+    {
+        bh = malloc(sizeof(struct sffs_buf_head));
+        if(!bh)
+            return SFFS_ERR_MEMALLOC;
+
+        bh->b_data = sffs_aligned_alloc(sffs_ctx, sffs_ctx->sb.s_block_size);
+        if(!bh->b_data)
+        {
+            free(bh);
+            return SFFS_ERR_MEMALLOC;
+        }
+
+        bc->nr_bufs++;
+        *res = bh;
+        return 0;
+    }
+
+    bh = bc->lru.b_prev;
+    if(bh->b_dirty)
+    {
+        int errc = __sffs_dev_write(sffs_ctx, bh->b_blocknr, bh->b_data, 1);
+        if(errc < 0)
+            return SFFS_ERR_DEV_WRITE;
+        bh->b_dirty = false;
+    }
+
+    __bcache_lru_unlink(bh);
+    __bcache_hash_remove(bc, bh);
+    *res = bh;
+    return 0;
+}
+
+/**
+ *  Finds buffer for block, allocating and optionally reading it
+ *  from the device on a miss. Buffer becomes the most recently used.
+ *  Must be called with cache lock held
+*/
+static int __bcache_getblk(sffs_context_t *sffs_ctx, blk32_t block, bool read_blk,
+    struct sffs_buf_head **res)
+{
+    struct sffs_bcache *bc = sffs_ctx->bcache;
+    struct sffs_buf_head *bh = __bcache_lookup(bc, block);
+
+    if(bh)
+    {
+        __bcache_lru_unlink(bh);
+        __bcache_lru_push(bc, bh);
+        *res = bh;
+        return 0;
+    }
+
+    int errc = __bcache_get_free(sffs_ctx, &bh);
+    if(errc < 0)
+        return errc;
+
+    if(read_blk)
+    {
+        errc = __sffs_dev_read(sffs_ctx, block, bh->b_data, 1);
+        if(errc < 0)
+        {
+            free(bh->b_data);
+            free(bh);
+            bc->nr_bufs--;
+            return SFFS_ERR_DEV_READ;
+        }
+    }
+
+    bh->b_blocknr = block;
+    bh->b_dirty = false;
+    __bcache_hash_insert(bc, bh);
+    __bcache_lru_push(bc, bh);
+    *res = bh;
+    return 0;
+}
+
+int sffs_bcache_read(sffs_context_t *sffs_ctx, blk32_t block,
+    void *data, size_t blks)
+{
+    struct sffs_bcache *bc = sffs_ctx->bcache;
+    blk32_t block_size = sffs_ctx->sb.s_block_size;
+    u8_t *dest = (u8_t *) data;
+
+    pthread_mutex_lock(&bc->lock);
+    for(size_t i = 0; i < blks; i++)
+    {
+        struct sffs_buf_head *bh;
+        int errc = __bcache_getblk(sffs_ctx, block + i, true, &bh);
+        if(errc < 0)
+        {
+            pthread_mutex_unlock(&bc->lock);
+            return errc;
+        }
+        memcpy(dest + i * block_size, bh->b_data, block_size);
+    }
+    pthread_mutex_unlock(&bc->lock);
+
+    return blks * block_size;
+}
+
+int sffs_bcache_write(sffs_context_t *sffs_ctx, blk32_t block,
+    void *data, size_t blks)
+{
+    struct sffs_bcache *bc = sffs_ctx->bcache;
+    blk32_t block_size = sffs_ctx->sb.s_block_size;
+    u8_t *src = (u8_t *) data;
+
+    pthread_mutex_lock(&bc->lock);
+    for(size_t i = 0; i < blks; i++)
+    {
+        // Whole block is overwritten, so there is no need to read it
+        struct sffs_buf_head *bh;
+        int errc = __bcache_getblk(sffs_ctx, block + i, false, &bh);
+        if(errc < 0)
+        {
+            pthread_mutex_unlock(&bc->lock);
+            return errc;
+        }
+        memcpy(bh->b_data, src + i * block_size, block_size);
+        bh->b_dirty = true;
+    }
+    bc->write_seq++;
+    pthread_mutex_unlock(&bc->lock);
+
+    return blks * block_size;
+}
+
+int sffs_bcache_lookup(sffs_context_t *sffs_ctx, blk32_t block, void *data, 
+    u64_t *seq)
+{
+    struct sffs_bcache *bc = sffs_ctx->bcache;
+    int found = 0;
+
+    pthread_mutex_lock(&bc->lock);
+    struct sffs_buf_head *bh = __bcache_lookup(bc, block);
+    if(bh)
+    {
+        __bcache_lru_unlink(bh);
+        __bcache_lru_push(bc, bh);
+        memcpy(data, bh->b_data, sffs_ctx->sb.s_block_size);
+        found = 1;
+    }
+    if(seq)
+        *seq = bc->write_seq;
+    pthread_mutex_unlock(&bc->lock);
+    return found;
+}
+
+int sffs_bcache_insert(sffs_context_t *sffs_ctx, blk32_t block, void *data, 
+    u64_t seq)
+{
+    struct sffs_bcache *bc = sffs_ctx->bcache;
+    int errc = 0;
+
+    pthread_mutex_lock(&bc->lock);
+
+    /**
+     *  Block has been read without cache lock held. If anything was written 
+     *  since the lookup, our copy might be older than the device content
+    */
+    if(bc->write_seq == seq && !__bcache_lookup(bc, block))
+    {
+        struct sffs_buf_head *bh;
+        errc = __bcache_getblk(sffs_ctx, block, false, &bh);
+        if(errc == 0)
+            memcpy(bh->b_data, data, sffs_ctx->sb.s_block_size);
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return errc;
+}
+
+int sffs_bcache_dirty(sffs_context_t *sffs_ctx, blk32_t block)
+{
+    struct sffs_bcache *bc = sffs_ctx->bcache;
+
+    pthread_mutex_lock(&bc->lock);
+    struct sffs_buf_head *bh = __bcache_lookup(bc, block);
+    int dirty = bh && bh->b_dirty;
+    pthread_mutex_unlock(&bc->lock);
+    return dirty;
+}
+
+int sffs_bcache_forget(sffs_context_t *sffs_ctx, blk32_t block, size_t blks)
+{
+    struct sffs_bcache *bc = sffs_ctx->bcache;
+
+    pthread_mutex_lock(&bc->lock);
+    for(size_t i = 0; i < blks; i++)
+    {
+        struct sffs_buf_head *bh = __bcache_lookup(bc, block + i);
+        if(!bh)
+            continue;
+
+        // Dirty content is dropped as well, block has no owner anymore
+        __bcache_lru_unlink(bh);
+        __bcache_hash_remove(bc, bh);
+        free(bh->b_data);
+        free(bh);
+        bc->nr_bufs--;
+    }
+
+    // Reads that raced with us must not bring the blocks back
+    bc->write_seq++;
+    pthread_mutex_unlock(&bc->lock);
+    return 0;
+}
+
+static int __bcache_cmp_blocknr(const void *a, const void *b)
+{
+    blk32_t blk_a = (*(struct sffs_buf_head * const *) a)->b_blocknr;
+    blk32_t blk_b = (*(struct sffs_buf_head * const *) b)->b_blocknr;
+    return (blk_a > blk_b) - (blk_a < blk_b);
+}
+
+int sffs_bcache_flush(sffs_context_t *sffs_ctx)
+{
+    struct sffs_bcache *bc = sffs_ctx->bcache;
+    if(!bc)
+        return 0;
+
+    int errc = 0;
+    pthread_mutex_lock(&bc->lock);
+
+    size_t nr_dirty = 0;
+    for(struct sffs_buf_head *bh = bc->lru.b_next; bh != &bc->lru; bh = bh->b_next)
+        if(bh->b_dirty)
+            bc->flush_list[nr_dirty++] = bh;
+
+    /**
+     *  Elevator order. Runs of adjacent blocks become single vectored 
+     *  writes and the device sees one ascending sweep
+    */
+    qsort(bc->flush_list, nr_dirty, sizeof(struct sffs_buf_head *), 
+        __bcache_cmp_blocknr);
+
+    blk32_t blocks[SFFS_IOV_MAX];
+    void *bufs[SFFS_IOV_MAX];
+    for(size_t done = 0; done < nr_dirty; )
+    {
+        size_t count = nr_dirty - done;
+        if(count > SFFS_IOV_MAX)
+            count = SFFS_IOV_MAX;
+
+        for(size_t i = 0; i < count; i++)
+        {
+            blocks[i] = bc->flush_list[done + i]->b_blocknr;
+            bufs[i] = bc->flush_list[done + i]->b_data;
+        }
+
+        if(__sffs_dev_writev(sffs_ctx, blocks, bufs, count) < 0)
+        {
+            errc = SFFS_ERR_DEV_WRITE;
+            break;
+        }
+
+        for(size_t i = 0; i < count; i++)
+            bc->flush_list[done + i]->b_dirty = false;
+        done += count;
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return errc;
+}
+
+static void *__bcache_flusher(void *arg)
+{
+    sffs_context_t *sffs_ctx = (sffs_context_t *) arg;
+    struct sffs_bcache *bc = sffs_ctx->bcache;
+
+    pthread_mutex_lock(&bc->lock);
+    while(!bc->stop)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += bc->flush_interval;
+
+        int rc = pthread_cond_timedwait(&bc->flush_cond, &bc->lock, &ts);
+        if(bc->stop)
+            break;
+        if(rc != ETIMEDOUT)
+            continue;
+
+        pthread_mutex_unlock(&bc->lock);
+        sffs_sync(sffs_ctx);
+        pthread_mutex_lock(&bc->lock);
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return NULL;
+}
+
+int sffs_bcache_init(sffs_context_t *sffs_ctx, size_t nr_blocks,
+    unsigned int flush_interval)
+{
+    if(!sffs_ctx || nr_blocks == 0)
+        return SFFS_ERR_INVARG;
+
+    struct sffs_bcache *bc = malloc(sizeof(struct sffs_bcache));
+    if(!bc)
+        return SFFS_ERR_MEMALLOC;
+    memset(bc, 0, sizeof(struct sffs_bcache));
+
+    // Hash table size is a power of two not less than cache capacity
+    bc->hash_size = 1;
+    while(bc->hash_size < nr_blocks)
+        bc->hash_size <<= 1;
+
+    bc->hash = calloc(bc->hash_size, sizeof(struct sffs_buf_head *));
+    bc->flush_list = malloc(sizeof(struct sffs_buf_head *) * nr_blocks);
+    if(!bc->hash || !bc->flush_list)
+    {
+        free(bc->hash);
+        free(bc->flush_list);
+        free(bc);
+        return SFFS_ERR_MEMALLOC;
+    }
+
+    bc->max_bufs = nr_blocks;
+    bc->lru.b_next = &bc->lru;
+    bc->lru.b_prev = &bc->lru;
+    bc->flush_interval = flush_interval;
+    pthread_mutex_init(&bc->lock, NULL);
+    pthread_cond_init(&bc->flush_cond, NULL);
+    sffs_ctx->bcache = bc;
+
+    if(flush_interval != 0)
+    {
+        if(pthread_create(&bc->flusher, NULL, __bcache_flusher, sffs_ctx) == 0)
+            bc->flusher_running = true;
+    }
+    return 0;
+}
+
+int sffs_bcache_destroy(sffs_context_t *sffs_ctx)
+{
+    struct sffs_bcache *bc = sffs_ctx->bcache;
+    if(!bc)
+        return 0;
+
+    if(bc->flusher_running)
+    {
+        pthread_mutex_lock(&bc->lock);
+        bc->stop = true;
+        pthread_cond_signal(&bc->flush_cond);
+        pthread_mutex_unlock(&bc->lock);
+        pthread_join(bc->flusher, NULL);
+    }
+
+    int errc = sffs_bcache_flush(sffs_ctx);
+
+    struct sffs_buf_head *bh = bc->lru.b_next;
+    while(bh != &bc->lru)
+    {
+        struct sffs_buf_head *next = bh->b_next;
+        free(bh->b_data);
+        free(bh);
+        bh = next;
+    }
+
+    pthread_cond_destroy(&bc->flush_cond);
+    pthread_mutex_destroy(&bc->lock);
+    free(bc->hash);
+    free(bc->flush_list);
+    free(bc);
+    sffs_ctx->bcache = NULL;
+    return errc;
+}
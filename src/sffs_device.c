@@ -4,112 +4,427 @@
 */
 
 #include <sffs_device.h>
+#include <pthread.h>
+#include <stdlib.h>
 
-int sffs_write_blk(sffs_context_t *sffs_ctx, blk32_t block, 
+blk32_t sffs_data_start(sffs_context_t *sffs_ctx)
+{
+    blk32_t data_start = sffs_ctx->sb.s_GIT_bitmap_size + sffs_ctx->sb.s_GIT_size
+        + sffs_ctx->sb.s_data_bitmap_size + sffs_ctx->sb.s_group_desc_size;
+
+    // Include boot region as well
+    if(sffs_ctx->sb.s_block_size <= 1024)
+        data_start += 1024 / sffs_ctx->sb.s_block_size;
+    return data_start;
+}
+
+/**
+ *  Contexts set up by hand (as mkfs.sffs does) have no backend 
+ *  attached and are treated as plain image files
+*/
+static inline const struct sffs_dev_ops *__sffs_dev_ops(sffs_context_t *sffs_ctx)
+{
+    return sffs_ctx->dev_ops ? sffs_ctx->dev_ops : &sffs_file_ops;
+}
+
+int __sffs_dev_pread(sffs_context_t *sffs_ctx, void *data, size_t bytes, 
+    uint64_t offset)
+{
+    return __sffs_dev_ops(sffs_ctx)->pread(sffs_ctx, data, bytes, offset);
+}
+
+int __sffs_dev_pwrite(sffs_context_t *sffs_ctx, const void *data, size_t bytes, 
+    uint64_t offset)
+{
+    return __sffs_dev_ops(sffs_ctx)->pwrite(sffs_ctx, data, bytes, offset);
+}
+
+int __sffs_dev_write(sffs_context_t *sffs_ctx, blk32_t block, 
     void *data, size_t blks)
 {
-    /**
-     *  We cannot write to a 0 block, its allocated 
-     *  for a boot region
-    */
-    if(block == 0)
-        return -1;
-    
-    if(!data)
-        return -1;
-    
     uint64_t blk = block;
     uint64_t offset = blk * sffs_ctx->sb.s_block_size;
     uint64_t ssize = blks;
     uint64_t bytes = ssize * sffs_ctx->sb.s_block_size;
 
-    int seek;
-    if((seek = lseek64(sffs_ctx->disk_id, offset, SEEK_SET)) < 0)
-        return seek;
-
-    int wr = write(sffs_ctx->disk_id, data, bytes);
-    if(wr < 0)
-        return wr;
-
-    // fsync() should be removed as soon as cache will be added
-    int temp = fsync(sffs_ctx->disk_id); 
-    if(temp < 0)
-        return temp;
-    return wr;
+    return __sffs_dev_ops(sffs_ctx)->pwrite(sffs_ctx, data, bytes, offset);
 }
 
-int sffs_read_blk(sffs_context_t *sffs_ctx, blk32_t block, 
+int __sffs_dev_read(sffs_context_t *sffs_ctx, blk32_t block, 
     void *data, size_t blks)
 {
-    if(!data)
-        return -1;
-    
     uint64_t blk = block;
     uint64_t offset = blk * sffs_ctx->sb.s_block_size;
     uint64_t ssize = blks;
     uint64_t bytes = ssize * sffs_ctx->sb.s_block_size;
 
-    int seek;
-    if((seek = lseek64(sffs_ctx->disk_id, offset, SEEK_SET)) < 0)
-        return seek;
+    return __sffs_dev_ops(sffs_ctx)->pread(sffs_ctx, data, bytes, offset);
+}
+
+/**
+ *  Splits blocks into runs of adjacent blocks and issues every run 
+ *  as a single vectored transfer. Backends without vectored operations 
+ *  get one plain transfer per block
+*/
+static int __sffs_dev_rwv(sffs_context_t *sffs_ctx, const blk32_t *blocks, 
+    void **bufs, size_t count, bool write)
+{
+    const struct sffs_dev_ops *ops = __sffs_dev_ops(sffs_ctx);
+    blk32_t block_size = sffs_ctx->sb.s_block_size;
+    bool vectored = write ? ops->pwritev != NULL : ops->preadv != NULL;
+    struct iovec iov[SFFS_IOV_MAX];
+
+    for(size_t i = 0; i < count; )
+    {
+        size_t run = 1;
+        if(vectored)
+            while(i + run < count && run < SFFS_IOV_MAX && 
+                blocks[i + run] == blocks[i] + run)
+                run++;
+
+        uint64_t offset = (uint64_t) blocks[i] * block_size;
+        ssize_t ret;
+        if(run == 1)
+            ret = write ? ops->pwrite(sffs_ctx, bufs[i], block_size, offset) :
+                ops->pread(sffs_ctx, bufs[i], block_size, offset);
+        else
+        {
+            for(size_t k = 0; k < run; k++)
+            {
+                iov[k].iov_base = bufs[i + k];
+                iov[k].iov_len = block_size;
+            }
+            ret = write ? ops->pwritev(sffs_ctx, iov, run, offset) :
+                ops->preadv(sffs_ctx, iov, run, offset);
+        }
+
+        if(ret < 0)
+            return write ? SFFS_ERR_DEV_WRITE : SFFS_ERR_DEV_READ;
+        i += run;
+    }
+    return 0;
+}
 
-    return read(sffs_ctx->disk_id, data, bytes);
+int __sffs_dev_readv(sffs_context_t *sffs_ctx, const blk32_t *blocks, 
+    void **bufs, size_t count)
+{
+    return __sffs_dev_rwv(sffs_ctx, blocks, bufs, count, false);
+}
+
+int __sffs_dev_writev(sffs_context_t *sffs_ctx, const blk32_t *blocks, 
+    void **bufs, size_t count)
+{
+    return __sffs_dev_rwv(sffs_ctx, blocks, bufs, count, true);
 }
 
-int sffs_write_data_blk(sffs_context_t *sffs_ctx, blk32_t block, 
+int sffs_write_blk(sffs_context_t *sffs_ctx, blk32_t block,
     void *data, size_t blks)
-{    
+{
+    /**
+     *  We cannot write to a 0 block, its allocated
+     *  for a boot region
+    */
+    if(block == 0)
+        return -1;
+
     if(!data)
         return -1;
-    
-    blk32_t data_start = sffs_ctx->sb.s_GIT_bitmap_size + sffs_ctx->sb.s_GIT_size
-        + sffs_ctx->sb.s_data_bitmap_size;
-    
-    // Include boot region as well
-    if(sffs_ctx->sb.s_block_size <= 1024)
-        data_start += 1024 / sffs_ctx->sb.s_block_size;
 
-    uint64_t blk = data_start + block;
-    uint64_t offset = blk * sffs_ctx->sb.s_block_size;
-    uint64_t ssize = blks;
-    uint64_t bytes = ssize * sffs_ctx->sb.s_block_size;
+    u64_t start = sffs_stats_start(sffs_ctx);
+    int res = sffs_ctx->bcache ? sffs_bcache_write(sffs_ctx, block, data, blks) :
+        __sffs_dev_write(sffs_ctx, block, data, blks);
+    sffs_stats_account(sffs_ctx, block, SFFS_STAT_WRITE, 
+        blks * sffs_ctx->sb.s_block_size, start);
+    return res;
+}
+
+int sffs_read_blk(sffs_context_t *sffs_ctx, blk32_t block,
+    void *data, size_t blks)
+{
+    if(!data)
+        return -1;
+
+    u64_t start = sffs_stats_start(sffs_ctx);
+    int res = sffs_ctx->bcache ? sffs_bcache_read(sffs_ctx, block, data, blks) :
+        __sffs_dev_read(sffs_ctx, block, data, blks);
+    sffs_stats_account(sffs_ctx, block, SFFS_STAT_READ, 
+        blks * sffs_ctx->sb.s_block_size, start);
+    return res;
+}
+
+void *sffs_map_blk(sffs_context_t *sffs_ctx, blk32_t block, size_t blks)
+{
+    // Cache might hold newer version of the block than the mapping
+    if(sffs_ctx->bcache || !sffs_ctx->dev_ops || !sffs_ctx->dev_ops->map)
+        return NULL;
+
+    uint64_t offset = (uint64_t) block * sffs_ctx->sb.s_block_size;
+    uint64_t bytes = (uint64_t) blks * sffs_ctx->sb.s_block_size;
+    return sffs_ctx->dev_ops->map(sffs_ctx, offset, bytes);
+}
+
+static int __sffs_read_blkv(sffs_context_t *sffs_ctx, const blk32_t *blocks, 
+    void **bufs, size_t count)
+{
+    if(!sffs_ctx->bcache)
+        return __sffs_dev_readv(sffs_ctx, blocks, bufs, count);
+
+    /**
+     *  Only blocks missing from the cache go to the device. Misses are 
+     *  collected in chunks, so adjacent misses still form runs
+    */
+    blk32_t miss_blocks[SFFS_IOV_MAX];
+    void *miss_bufs[SFFS_IOV_MAX];
+    size_t nr_miss = 0;
+    u64_t seq = 0;
+
+    for(size_t i = 0; i <= count; i++)
+    {
+        if(i < count)
+        {
+            u64_t cur_seq;
+            if(sffs_bcache_lookup(sffs_ctx, blocks[i], bufs[i], &cur_seq) == 1)
+                continue;
+
+            // The oldest sequence of the chunk guards the whole chunk
+            if(nr_miss == 0)
+                seq = cur_seq;
+            miss_blocks[nr_miss] = blocks[i];
+            miss_bufs[nr_miss] = bufs[i];
+            nr_miss++;
+        }
 
-    int seek;
-    if((seek = lseek64(sffs_ctx->disk_id, offset, SEEK_SET)) < 0)
-        return seek;
+        if(nr_miss == 0 || (i < count && nr_miss < SFFS_IOV_MAX))
+            continue;
 
-    int wr = write(sffs_ctx->disk_id, data, bytes);
-    if(wr < 0)
-        return wr;
+        int errc = __sffs_dev_readv(sffs_ctx, miss_blocks, miss_bufs, nr_miss);
+        if(errc < 0)
+            return errc;
 
-    // fsync() should be removed as soon as cache will be added
-    int temp = fsync(sffs_ctx->disk_id); 
-    if(temp < 0)
-        return temp;
-    return wr;
+        for(size_t k = 0; k < nr_miss; k++)
+            sffs_bcache_insert(sffs_ctx, miss_blocks[k], miss_bufs[k], seq);
+        nr_miss = 0;
+    }
+    return 0;
 }
 
-int sffs_read_data_blk(sffs_context_t *sffs_ctx, blk32_t block, 
+static int __sffs_write_blkv(sffs_context_t *sffs_ctx, const blk32_t *blocks, 
+    void **bufs, size_t count)
+{
+    if(!sffs_ctx->bcache)
+        return __sffs_dev_writev(sffs_ctx, blocks, bufs, count);
+
+    for(size_t i = 0; i < count; i++)
+    {
+        int errc = sffs_bcache_write(sffs_ctx, blocks[i], bufs[i], 1);
+        if(errc < 0)
+            return errc;
+    }
+    return 0;
+}
+
+/**
+ *  Vectored transfers are accounted as a single operation, to the 
+ *  region of the first block
+*/
+int sffs_read_blkv(sffs_context_t *sffs_ctx, const blk32_t *blocks, 
+    void **bufs, size_t count)
+{
+    if(!blocks || !bufs)
+        return -1;
+
+    if(count == 0)
+        return 0;
+
+    u64_t start = sffs_stats_start(sffs_ctx);
+    int res = __sffs_read_blkv(sffs_ctx, blocks, bufs, count);
+    sffs_stats_account(sffs_ctx, blocks[0], SFFS_STAT_READ, 
+        count * sffs_ctx->sb.s_block_size, start);
+    return res;
+}
+
+int sffs_write_blkv(sffs_context_t *sffs_ctx, const blk32_t *blocks, 
+    void **bufs, size_t count)
+{
+    if(!blocks || !bufs)
+        return -1;
+
+    // Boot region is never written, see sffs_write_blk
+    for(size_t i = 0; i < count; i++)
+        if(blocks[i] == 0 || !bufs[i])
+            return -1;
+
+    if(count == 0)
+        return 0;
+
+    u64_t start = sffs_stats_start(sffs_ctx);
+    int res = __sffs_write_blkv(sffs_ctx, blocks, bufs, count);
+    sffs_stats_account(sffs_ctx, blocks[0], SFFS_STAT_WRITE, 
+        count * sffs_ctx->sb.s_block_size, start);
+    return res;
+}
+
+/**
+ *  Translates relative block numbers chunk by chunk, so no allocation 
+ *  is needed regardless of count
+*/
+static int __sffs_data_blkv(sffs_context_t *sffs_ctx, const blk32_t *blocks, 
+    void **bufs, size_t count, bool write)
+{
+    if(!blocks || !bufs)
+        return -1;
+
+    blk32_t data_start = sffs_data_start(sffs_ctx);
+    blk32_t abs_blocks[SFFS_IOV_MAX];
+
+    for(size_t done = 0; done < count; )
+    {
+        size_t chunk = count - done;
+        if(chunk > SFFS_IOV_MAX)
+            chunk = SFFS_IOV_MAX;
+
+        for(size_t i = 0; i < chunk; i++)
+            abs_blocks[i] = data_start + blocks[done + i];
+
+        int errc = write ? 
+            sffs_write_blkv(sffs_ctx, abs_blocks, bufs + done, chunk) :
+            sffs_read_blkv(sffs_ctx, abs_blocks, bufs + done, chunk);
+        if(errc < 0)
+            return errc;
+        done += chunk;
+    }
+    return 0;
+}
+
+int sffs_read_data_blkv(sffs_context_t *sffs_ctx, const blk32_t *blocks, 
+    void **bufs, size_t count)
+{
+    return __sffs_data_blkv(sffs_ctx, blocks, bufs, count, false);
+}
+
+int sffs_write_data_blkv(sffs_context_t *sffs_ctx, const blk32_t *blocks, 
+    void **bufs, size_t count)
+{
+    return __sffs_data_blkv(sffs_ctx, blocks, bufs, count, true);
+}
+
+int sffs_write_data_blk(sffs_context_t *sffs_ctx, blk32_t block,
     void *data, size_t blks)
 {
     if(!data)
         return -1;
-    
-    blk32_t data_start = sffs_ctx->sb.s_GIT_bitmap_size + sffs_ctx->sb.s_GIT_size
-        + sffs_ctx->sb.s_data_bitmap_size;
-    
-    // Include boot region as well
-    if(sffs_ctx->sb.s_block_size <= 1024)
-        data_start += 1024 / sffs_ctx->sb.s_block_size;
 
-    uint64_t blk = data_start + block;
-    uint64_t offset = blk * sffs_ctx->sb.s_block_size;
-    uint64_t ssize = blks;
-    uint64_t bytes = ssize * sffs_ctx->sb.s_block_size;
+    blk32_t data_start = sffs_data_start(sffs_ctx);
+    return sffs_write_blk(sffs_ctx, data_start + block, data, blks);
+}
+
+int sffs_read_data_blk(sffs_context_t *sffs_ctx, blk32_t block,
+    void *data, size_t blks)
+{
+    if(!data)
+        return -1;
+
+    blk32_t data_start = sffs_data_start(sffs_ctx);
+    return sffs_read_blk(sffs_ctx, data_start + block, data, blks);
+}
+
+/**
+ *  Group commit. Every sync request takes a ticket. The first thread 
+ *  that finds no flush running becomes the leader: it flushes all the 
+ *  state accumulated up to the latest ticket and syncs the device once. 
+ *  Requests that arrive meanwhile wait, and the whole group is then 
+ *  covered by the next leader's single flush
+*/
+struct sffs_commit
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    u64_t ticket;           // Last ticket handed out
+    u64_t done;             // Every ticket up to done is on stable storage
+    int errc;               // Result of the last completed flush
+    bool running;           // Leader is flushing
+};
+
+static int __sffs_sync(sffs_context_t *sffs_ctx)
+{
+    // Inode entries and bitmap mirrors are written back lazily, sync is where they land
+    int errc = sffs_icache_flush(sffs_ctx);
+    if(errc < 0)
+        return errc;
+
+    errc = sffs_bm_flush(sffs_ctx);
+    if(errc < 0)
+        return errc;
+
+    if(sffs_ctx->bcache)
+    {
+        errc = sffs_bcache_flush(sffs_ctx);
+        if(errc < 0)
+            return errc;
+    }
+
+    return __sffs_dev_ops(sffs_ctx)->sync(sffs_ctx);
+}
+
+int sffs_commit_init(sffs_context_t *sffs_ctx)
+{
+    struct sffs_commit *gc = malloc(sizeof(struct sffs_commit));
+    if(!gc)
+        return SFFS_ERR_MEMALLOC;
+
+    pthread_mutex_init(&gc->lock, NULL);
+    pthread_cond_init(&gc->cond, NULL);
+    gc->ticket = 0;
+    gc->done = 0;
+    gc->errc = 0;
+    gc->running = false;
+    sffs_ctx->commit = gc;
+    return 0;
+}
+
+void sffs_commit_destroy(sffs_context_t *sffs_ctx)
+{
+    struct sffs_commit *gc = sffs_ctx->commit;
+    if(!gc)
+        return;
+
+    pthread_cond_destroy(&gc->cond);
+    pthread_mutex_destroy(&gc->lock);
+    free(gc);
+    sffs_ctx->commit = NULL;
+}
+
+int sffs_sync(sffs_context_t *sffs_ctx)
+{
+    struct sffs_commit *gc = sffs_ctx->commit;
+    if(!gc)
+        return __sffs_sync(sffs_ctx);
+
+    pthread_mutex_lock(&gc->lock);
+    u64_t my_ticket = ++gc->ticket;
+
+    // Either a flush that started after our arrival covers us, or we lead one
+    while(gc->done < my_ticket && gc->running)
+        pthread_cond_wait(&gc->cond, &gc->lock);
+
+    if(gc->done >= my_ticket)
+    {
+        int errc = gc->errc;
+        pthread_mutex_unlock(&gc->lock);
+        return errc;
+    }
+
+    gc->running = true;
+    u64_t target = gc->ticket;
+    pthread_mutex_unlock(&gc->lock);
+
+    int errc = __sffs_sync(sffs_ctx);
 
-    int seek;
-    if((seek = lseek64(sffs_ctx->disk_id, offset, SEEK_SET)) < 0)
-        return seek;
-    
-    return read(sffs_ctx->disk_id, data, bytes);
+    pthread_mutex_lock(&gc->lock);
+    gc->done = target;
+    gc->errc = errc;
+    gc->running = false;
+    pthread_cond_broadcast(&gc->cond);
+    pthread_mutex_unlock(&gc->lock);
+    return errc;
 }
@@ -114,9 +114,20 @@ sffs_err_t  sffs_lookup_direntry(sffs_context_t *sffs_ctx, struct sffs_inode_mem
     
     sffs_err_t errc;
     struct sffs_data_block_info db_info;
-    db_info.content = malloc(sffs_ctx->sb.s_block_size);
-    if(!db_info.content)
-        return SFFS_ERR_MEMALLOC;
+    blk32_t block_size = sffs_ctx->sb.s_block_size;
+
+    /**
+     *  Directory blocks are read in windows of SFFS_DIR_BATCH blocks. All
+     *  blocks of a window are queued at once and waited for once. Window 
+     *  buffers are taken from the buffer pool only as far as needed
+    */
+    u8_t *window[SFFS_DIR_BATCH] = { NULL };
+    blk32_t window_ids[SFFS_DIR_BATCH];
+
+    struct sffs_io_batch batch;
+    errc = sffs_io_batch_init(&batch, SFFS_DIR_BATCH);
+    if(errc < 0)
+        return errc;
 
     u32_t ino_blocks = parent->ino.i_blks_count;
     u16_t accum_rec = 0;
@@ -125,40 +136,87 @@ sffs_err_t  sffs_lookup_direntry(sffs_context_t *sffs_ctx, struct sffs_inode_mem
         malloc(SFFS_MAX_DIR_ENTRY + 1);
     
     if(!buf)
+    {
+        sffs_io_batch_release(&batch);
         return SFFS_ERR_MEMALLOC;
+    }
 
     bool exist = 0;
-    for(u32_t i = 0; i < ino_blocks; i++)
+    for(u32_t first = 0; first < ino_blocks && !exist; first += SFFS_DIR_BATCH)
     {
-        int flags = SFFS_GET_BLK_RD;
-        errc = sffs_get_data_block_info(sffs_ctx, i, flags, &db_info, parent);
-        if(errc < 0)
-            return errc;
-        
-        u8_t *dptr = (u8_t *) db_info.content;
-        accum_rec = 0;
+        u32_t count = ino_blocks - first;
+        if(count > SFFS_DIR_BATCH)
+            count = SFFS_DIR_BATCH;
 
-        do 
-        {
-            struct sffs_direntry *temp = (struct sffs_direntry *) dptr;
-            rec_len = temp->rec_len;
+        sffs_readahead(sffs_ctx, parent, first, count);
 
-            memcpy(buf, temp, rec_len);
-            size_t name_len = rec_len - SFFS_DIRENTRY_LENGTH;
-            buf->name[name_len] = 0;
-            
-            if(strcmp(buf->name, path) == 0)
+        // Whole window is mapped with a single walk over the inode list
+        errc = sffs_get_data_blocks(sffs_ctx, parent, first, count, window_ids);
+
+        for(u32_t i = 0; i < count && errc == 0; i++)
+        {
+            if(!window[i] && !(window[i] = sffs_buf_get(sffs_ctx)))
             {
-                exist = true;
-                break;    
+                errc = SFFS_ERR_MEMALLOC;
+                break;
             }
 
-            accum_rec += rec_len;
-            dptr += rec_len;
-        } while(accum_rec < sffs_ctx->sb.s_block_size);
+            errc = sffs_io_queue_read_data(sffs_ctx, &batch, window_ids[i], 
+                window[i]);
+        }
 
-        if(exist == true)
+        if(errc == 0)
+            errc = sffs_io_submit(sffs_ctx, &batch);
+        if(errc == 0)
+            errc = sffs_io_wait(sffs_ctx, &batch);
+        if(errc < 0)
             break;
+
+        for(u32_t i = 0; i < count && !exist; i++)
+        {
+            u8_t *dptr = window[i];
+            db_info.block_id = window_ids[i];
+            db_info.flags = 0;
+            accum_rec = 0;
+
+            do 
+            {
+                struct sffs_direntry *temp = (struct sffs_direntry *) dptr;
+                rec_len = temp->rec_len;
+                if(rec_len < SFFS_DIRENTRY_LENGTH)
+                    break;
+
+                // Empty records carry no name
+                if(temp->file_type != 0)
+                {
+                    size_t name_len = rec_len - SFFS_DIRENTRY_LENGTH;
+                    if(name_len > SFFS_MAX_DIR_ENTRY - SFFS_DIRENTRY_LENGTH)
+                        name_len = SFFS_MAX_DIR_ENTRY - SFFS_DIRENTRY_LENGTH;
+
+                    memcpy(buf, temp, SFFS_DIRENTRY_LENGTH + name_len);
+                    buf->name[name_len] = 0;
+                    
+                    if(strcmp(buf->name, path) == 0)
+                    {
+                        exist = true;
+                        break;    
+                    }
+                }
+
+                accum_rec += rec_len;
+                dptr += rec_len;
+            } while(accum_rec < block_size);
+        }
+    }
+
+    sffs_io_batch_release(&batch);
+    for(u32_t i = 0; i < SFFS_DIR_BATCH; i++)
+        sffs_buf_put(sffs_ctx, window[i]);
+
+    if(errc < 0)
+    {
+        free(buf);
+        return errc;
     }
 
     /**
@@ -184,7 +242,6 @@ sffs_err_t  sffs_lookup_direntry(sffs_context_t *sffs_ctx, struct sffs_inode_mem
     else 
         free(buf);
 
-    free(db_info.content);
     return exist;
 }
 
@@ -199,9 +256,6 @@ sffs_err_t sffs_add_direntry(sffs_context_t *sffs_ctx, struct sffs_inode_mem *pa
 
     sffs_err_t errc;
     struct sffs_data_block_info db_info;
-    db_info.content = malloc(sffs_ctx->sb.s_block_size);
-    if(!db_info.content)
-        return SFFS_ERR_MEMALLOC;
 
     /**
      *  Typical directory entry would occupy from 1 to couple of blocks,
@@ -222,12 +276,20 @@ sffs_err_t sffs_add_direntry(sffs_context_t *sffs_ctx, struct sffs_inode_mem *pa
     else if(errc < 0)
         return errc;
 
-    for(u32_t i = 0; i < ino_blocks; i++)
+    db_info.content = sffs_buf_get(sffs_ctx);
+    if(!db_info.content)
+        return SFFS_ERR_MEMALLOC;
+
+    bool found = false;
+    for(u32_t i = 0; i < ino_blocks && !found; i++)
     {
         int flags = SFFS_GET_BLK_RD;
         errc = sffs_get_data_block_info(sffs_ctx, i, flags, &db_info, parent);
         if(errc < 0)
+        {
+            sffs_buf_put(sffs_ctx, db_info.content);
             return errc;
+        }
         
         u8_t *dptr = (u8_t *) db_info.content;
         accum_rec = 0;
@@ -237,9 +299,14 @@ sffs_err_t sffs_add_direntry(sffs_context_t *sffs_ctx, struct sffs_inode_mem *pa
             d = (struct sffs_direntry *) dptr;
             rec_len = d->rec_len;
             dptr += rec_len;
+            if(rec_len < SFFS_DIRENTRY_LENGTH)
+                break;
 
             if(rec_len >= direntry->rec_len && d->ino_id == 0)
+            {
+                found = true;
                 break;
+            }
             
             accum_rec += rec_len;
         } while(accum_rec < sffs_ctx->sb.s_block_size);
@@ -252,19 +319,27 @@ sffs_err_t sffs_add_direntry(sffs_context_t *sffs_ctx, struct sffs_inode_mem *pa
     */
     struct sffs_direntry *buf = (struct sffs_direntry *) malloc(SFFS_DIRENTRY_LENGTH);
     if(!buf)
+    {
+        sffs_buf_put(sffs_ctx, db_info.content);
         return SFFS_ERR_MEMALLOC;
+    }
 
-    if(d->rec_len < direntry->rec_len || d->rec_len == sffs_ctx->sb.s_block_size)
+    if(!found || d->rec_len == sffs_ctx->sb.s_block_size)
     {
         errc = sffs_alloc_data_blocks(sffs_ctx, 1, parent);
+        if(errc >= 0)
+        {
+            // Get the last allocated block
+            int flags = SFFS_GET_BLK_LT | SFFS_GET_BLK_RD;
+            errc = sffs_get_data_block_info(sffs_ctx, 0, flags, &db_info, parent);
+        }
+
         if(errc < 0)
+        {
+            free(buf);
+            sffs_buf_put(sffs_ctx, db_info.content);
             return errc;
-        
-        // Get the last allocated block
-        int flags = SFFS_GET_BLK_LT | SFFS_GET_BLK_RD;
-        errc = sffs_get_data_block_info(sffs_ctx, 0, flags, &db_info, parent);
-        if(errc < 0)
-            return errc;
+        }
         
         buf->file_type = 0;
         buf->ino_id = 0;
@@ -276,6 +351,7 @@ sffs_err_t sffs_add_direntry(sffs_context_t *sffs_ctx, struct sffs_inode_mem *pa
         if(errc < 0)
         {
             free(buf);
+            sffs_buf_put(sffs_ctx, db_info.content);
             return errc;
         }
     }
@@ -284,19 +360,31 @@ sffs_err_t sffs_add_direntry(sffs_context_t *sffs_ctx, struct sffs_inode_mem *pa
      *  Add new direntry
     */
     u8_t *data = (u8_t *) db_info.content; 
-    memcpy(data + accum_rec, direntry, direntry->rec_len);
+    struct sffs_direntry *new_d = (struct sffs_direntry *) (data + accum_rec);
+    memcpy(new_d, direntry, direntry->rec_len);
     accum_rec += direntry->rec_len;
 
-    buf->file_type = 0;
-    buf->ino_id = 0;
-    buf->rec_len = sffs_ctx->sb.s_block_size - accum_rec;
-    memcpy(data + accum_rec, buf, SFFS_DIRENTRY_LENGTH);
+    /**
+     *  Tail too short to hold an empty record is padded with zeros 
+     *  and given to the new entry
+    */
+    u32_t tail = sffs_ctx->sb.s_block_size - accum_rec;
+    if(tail < SFFS_DIRENTRY_LENGTH)
+    {
+        memset(data + accum_rec, 0, tail);
+        new_d->rec_len += tail;
+    }
+    else
+    {
+        buf->file_type = 0;
+        buf->ino_id = 0;
+        buf->rec_len = tail;
+        memcpy(data + accum_rec, buf, SFFS_DIRENTRY_LENGTH);
+    }
 
     errc = sffs_write_data_blk(sffs_ctx, db_info.block_id, db_info.content, 1);
-    if(errc < 0)
-        return errc;
 
     free(buf);
-    free(db_info.content);
-    return 0;
+    sffs_buf_put(sffs_ctx, db_info.content);
+    return errc < 0 ? errc : 0;
 }
\ No newline at end of file
@@ -0,0 +1,254 @@
+/**
+ *  SPDX-License-Identifier: MIT
+ *  Copyright (c) 2023 Danylo Malapura
+*/
+
+/**
+ *  Asynchronous discard of freed data blocks. Freed blocks are turned
+ *  into extents and queued, the worker thread takes everything queued
+ *  so far, merges adjacent extents and passes them to the backend
+ *  discard operation. Discard of a block must complete before the
+ *  block is handed out again, so queued blocks stay marked in the data
+ *  bitmap. The worker clears them and credits the superblock once
+ *  their discard has been issued
+*/
+
+#include <sffs_device.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct sffs_extent
+{
+    blk32_t start;          // First block, relative to the data region
+    blk32_t count;
+};
+
+struct sffs_discard
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // Signaled when extents are queued
+    pthread_cond_t idle_cond;   // Signaled when the queue is drained
+    struct sffs_extent *pending;
+    size_t nr_pending;
+    size_t max_pending;         // Capacity of pending
+    bool busy;                  // Worker is issuing a batch
+    bool stop;
+    pthread_t worker;
+};
+
+static int __discard_cmp(const void *a, const void *b)
+{
+    blk32_t start_a = ((const struct sffs_extent *) a)->start;
+    blk32_t start_b = ((const struct sffs_extent *) b)->start;
+    return (start_a > start_b) - (start_a < start_b);
+}
+
+/**
+ *  Sorts extents and merges the adjacent and overlapping ones in
+ *  place. Returns the new number of extents
+*/
+static size_t __discard_merge(struct sffs_extent *ext, size_t count)
+{
+    if(count == 0)
+        return 0;
+
+    qsort(ext, count, sizeof(struct sffs_extent), __discard_cmp);
+
+    size_t res = 0;
+    for(size_t i = 1; i < count; i++)
+    {
+        u64_t end = (u64_t) ext[res].start + ext[res].count;
+        if(ext[i].start <= end)
+        {
+            u64_t new_end = (u64_t) ext[i].start + ext[i].count;
+            if(new_end > end)
+                ext[res].count = new_end - ext[res].start;
+            continue;
+        }
+        ext[++res] = ext[i];
+    }
+    return res + 1;
+}
+
+/**
+ *  Hands blocks whose discard has been issued over to the allocator
+*/
+static void __discard_release(sffs_context_t *sffs_ctx, blk32_t start, u32_t count)
+{
+    u32_t released = count;
+
+    // Range is refused as a whole if a bit is clear already, the rest is cleared anyway
+    if(sffs_unset_data_bm_range(sffs_ctx, start, count) < 0)
+    {
+        released = 0;
+        for(u32_t k = 0; k < count; k++)
+            if(sffs_unset_data_bm(sffs_ctx, start + k) >= 0)
+                released++;
+    }
+    __atomic_fetch_add(&sffs_ctx->sb.s_free_blocks_count, released, __ATOMIC_RELAXED);
+}
+
+static void *__discard_worker(void *arg)
+{
+    sffs_context_t *sffs_ctx = (sffs_context_t *) arg;
+    struct sffs_discard *dc = sffs_ctx->discard;
+    const struct sffs_dev_ops *ops = sffs_ctx->dev_ops;
+    u64_t block_size = sffs_ctx->sb.s_block_size;
+    u64_t data_start = sffs_data_start(sffs_ctx);
+
+    pthread_mutex_lock(&dc->lock);
+    while(!dc->stop || dc->nr_pending != 0)
+    {
+        if(dc->nr_pending == 0)
+        {
+            pthread_cond_wait(&dc->cond, &dc->lock);
+            continue;
+        }
+
+        // Take the whole queue, so extents of different frees get merged
+        struct sffs_extent *batch = dc->pending;
+        size_t count = dc->nr_pending;
+        dc->pending = NULL;
+        dc->nr_pending = 0;
+        dc->max_pending = 0;
+        dc->busy = true;
+        pthread_mutex_unlock(&dc->lock);
+
+        count = __discard_merge(batch, count);
+        for(size_t i = 0; i < count; i++)
+        {
+            // Discard is advisory, failed ranges just keep their content
+            ops->discard(sffs_ctx, (data_start + batch[i].start) * block_size,
+                batch[i].count * block_size);
+            __discard_release(sffs_ctx, batch[i].start, batch[i].count);
+        }
+        free(batch);
+
+        pthread_mutex_lock(&dc->lock);
+        dc->busy = false;
+        if(dc->nr_pending == 0)
+            pthread_cond_broadcast(&dc->idle_cond);
+    }
+    pthread_mutex_unlock(&dc->lock);
+    return NULL;
+}
+
+int sffs_discard_init(sffs_context_t *sffs_ctx)
+{
+    if(!sffs_ctx)
+        return SFFS_ERR_INVARG;
+
+    // Nothing to do for storage that cannot deallocate ranges
+    if(!sffs_ctx->dev_ops || !sffs_ctx->dev_ops->discard)
+        return 0;
+
+    struct sffs_discard *dc = malloc(sizeof(struct sffs_discard));
+    if(!dc)
+        return SFFS_ERR_MEMALLOC;
+    memset(dc, 0, sizeof(struct sffs_discard));
+
+    pthread_mutex_init(&dc->lock, NULL);
+    pthread_cond_init(&dc->cond, NULL);
+    pthread_cond_init(&dc->idle_cond, NULL);
+    sffs_ctx->discard = dc;
+
+    if(pthread_create(&dc->worker, NULL, __discard_worker, sffs_ctx) != 0)
+    {
+        sffs_ctx->discard = NULL;
+        pthread_cond_destroy(&dc->idle_cond);
+        pthread_cond_destroy(&dc->cond);
+        pthread_mutex_destroy(&dc->lock);
+        free(dc);
+        return SFFS_ERR_INIT;
+    }
+    return 0;
+}
+
+void sffs_discard_destroy(sffs_context_t *sffs_ctx)
+{
+    struct sffs_discard *dc = sffs_ctx->discard;
+    if(!dc)
+        return;
+
+    // Worker exits only once the queue is empty
+    pthread_mutex_lock(&dc->lock);
+    dc->stop = true;
+    pthread_cond_signal(&dc->cond);
+    pthread_mutex_unlock(&dc->lock);
+    pthread_join(dc->worker, NULL);
+
+    pthread_cond_destroy(&dc->idle_cond);
+    pthread_cond_destroy(&dc->cond);
+    pthread_mutex_destroy(&dc->lock);
+    free(dc->pending);
+    free(dc);
+    sffs_ctx->discard = NULL;
+}
+
+int sffs_discard(sffs_context_t *sffs_ctx, const blk32_t *blocks, size_t count)
+{
+    struct sffs_discard *dc = sffs_ctx->discard;
+    if(!dc)
+        return SFFS_ERR_INIT;
+    if(count == 0)
+        return 0;
+
+    if(!blocks)
+        return SFFS_ERR_INVARG;
+
+    blk32_t *sorted = malloc(sizeof(blk32_t) * count);
+    if(!sorted)
+        return SFFS_ERR_MEMALLOC;
+    memcpy(sorted, blocks, sizeof(blk32_t) * count);
+    qsort(sorted, count, sizeof(blk32_t), sffs_blk_cmp);
+
+    size_t i = 0;
+    pthread_mutex_lock(&dc->lock);
+    while(i < count)
+    {
+        size_t run = sffs_blk_run(sorted + i, count - i);
+
+        if(dc->nr_pending == dc->max_pending)
+        {
+            size_t new_max = dc->max_pending ? dc->max_pending * 2 : 16;
+            struct sffs_extent *ext = realloc(dc->pending,
+                sizeof(struct sffs_extent) * new_max);
+            if(!ext)
+                break;
+            dc->pending = ext;
+            dc->max_pending = new_max;
+        }
+
+        dc->pending[dc->nr_pending].start = sorted[i];
+        dc->pending[dc->nr_pending].count = run;
+        dc->nr_pending++;
+        i += run;
+    }
+    pthread_cond_signal(&dc->cond);
+    pthread_mutex_unlock(&dc->lock);
+
+    // Blocks the queue has no room for are released without discard
+    while(i < count)
+    {
+        size_t run = sffs_blk_run(sorted + i, count - i);
+
+        __discard_release(sffs_ctx, sorted[i], run);
+        i += run;
+    }
+
+    free(sorted);
+    return 0;
+}
+
+void sffs_discard_drain(sffs_context_t *sffs_ctx)
+{
+    struct sffs_discard *dc = sffs_ctx->discard;
+    if(!dc)
+        return;
+
+    pthread_mutex_lock(&dc->lock);
+    while(dc->nr_pending != 0 || dc->busy)
+        pthread_cond_wait(&dc->idle_cond, &dc->lock);
+    pthread_mutex_unlock(&dc->lock);
+}
@@ -0,0 +1,345 @@
+/**
+ *  SPDX-License-Identifier: MIT
+ *  Copyright (c) 2023 Danylo Malapura
+*/
+
+/**
+ *  Extent based block mapping. With SFFS_FEATURE_EXTENTS, the block
+ *  id slots of primary and supplementary inodes hold struct
+ *  sffs_inode_extent records instead, each mapping a run of consecutive
+ *  data blocks. Extents are kept in logical order, i_extents_count
+ *  of them are in use. Extent k lives in the primary inode while k
+ *  is below its capacity and in the supplementary inodes following
+ *  it otherwise, the same way block ids are laid out. Blocks that
+ *  continue the last extent are merged into it, so a contiguous
+ *  file takes a single extent regardless of its size
+*/
+
+#include <sffs_device.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ *  Walks extent slots of an inode in list order. Supplementary inode
+ *  currently walked is kept in buf and written back, if it has been
+ *  modified, once the walk leaves it
+*/
+struct __ext_iter
+{
+    sffs_context_t *sffs_ctx;
+    struct sffs_inode_mem *ino_mem;
+    struct sffs_inode_list *buf;        // Supplementary inode being walked
+    ino32_t entry;                      // Inode holding the current slots
+    struct sffs_inode_extent *exts;     // Slots of entry
+    u32_t nr_slots;
+    u32_t slot;                         // Next slot within entry
+    bool dirty;                         // Slots of buf have been modified
+};
+
+static inline u32_t __ext_pr_slots(sffs_context_t *sffs_ctx)
+{
+    return sffs_ctx->sb.s_inode_block_size / sizeof(struct sffs_inode_extent);
+}
+
+static inline u32_t __ext_supp_slots(sffs_context_t *sffs_ctx)
+{
+    return (sffs_ctx->sb.s_inode_size + sffs_ctx->sb.s_inode_block_size -
+        SFFS_INODE_LIST_SIZE) / sizeof(struct sffs_inode_extent);
+}
+
+static int __ext_iter_init(struct __ext_iter *it, sffs_context_t *sffs_ctx,
+    struct sffs_inode_mem *ino_mem)
+{
+    it->sffs_ctx = sffs_ctx;
+    it->ino_mem = ino_mem;
+    it->buf = malloc(sffs_ctx->sb.s_inode_size + sffs_ctx->sb.s_inode_block_size);
+    if(!it->buf)
+        return SFFS_ERR_MEMALLOC;
+
+    it->entry = ino_mem->ino.i_inode_num;
+    it->exts = (struct sffs_inode_extent *) ino_mem->blks;
+    it->nr_slots = __ext_pr_slots(sffs_ctx);
+    it->slot = 0;
+    it->dirty = false;
+    return 0;
+}
+
+static int __ext_iter_sync(struct __ext_iter *it)
+{
+    if(!it->dirty || it->entry == it->ino_mem->ino.i_inode_num)
+        return 0;
+
+    it->dirty = false;
+    return sffs_write_inode(it->sffs_ctx, (struct sffs_inode_mem *) it->buf);
+}
+
+static int __ext_iter_done(struct __ext_iter *it)
+{
+    int errc = __ext_iter_sync(it);
+    free(it->buf);
+    return errc;
+}
+
+/**
+ *  Returns the next extent slot. If grow is not zero, caller is about
+ *  to fill grow slots from here on and inode list is extended when
+ *  it runs out of entries. Otherwise running out of entries means the
+ *  inode is inconsistent
+*/
+static int __ext_iter_next(struct __ext_iter *it, u32_t grow, 
+    struct sffs_inode_extent **ext)
+{
+    sffs_context_t *sffs_ctx = it->sffs_ctx;
+    struct sffs_inode *inode = &it->ino_mem->ino;
+
+    if(it->slot == it->nr_slots)
+    {
+        bool primary = it->entry == inode->i_inode_num;
+        ino32_t next = primary ? inode->i_next_entry : it->buf->i_next_entry;
+
+        int errc = __ext_iter_sync(it);
+        if(errc < 0)
+            return errc;
+
+        if(next == 0)
+        {
+            if(grow == 0)
+                return SFFS_ERR_FS;
+
+            u32_t supp_slots = __ext_supp_slots(sffs_ctx);
+            errc = sffs_alloc_inode_list(sffs_ctx, (grow + supp_slots - 1) / supp_slots,
+                it->ino_mem);
+            if(errc < 0)
+                return errc;
+
+            // Link to the new entries has been stored in the current entry
+            if(primary)
+                next = inode->i_next_entry;
+            else
+            {
+                errc = sffs_read_inode(sffs_ctx, it->entry, (struct sffs_inode_mem *) it->buf);
+                if(errc < 0)
+                    return errc;
+                next = it->buf->i_next_entry;
+            }
+        }
+
+        errc = sffs_read_inode(sffs_ctx, next, (struct sffs_inode_mem *) it->buf);
+        if(errc < 0)
+            return errc;
+
+        it->entry = next;
+        it->exts = (struct sffs_inode_extent *) it->buf->blks;
+        it->nr_slots = __ext_supp_slots(sffs_ctx);
+        it->slot = 0;
+    }
+
+    *ext = &it->exts[it->slot++];
+    return 0;
+}
+
+sffs_err_t sffs_ext_lookup(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem,
+    blk32_t block, blk32_t *block_id, ino32_t *entry, u32_t *ext_id)
+{
+    if(!sffs_ctx || !ino_mem || !block_id)
+        return SFFS_ERR_INVARG;
+
+    struct __ext_iter it;
+    sffs_err_t errc = __ext_iter_init(&it, sffs_ctx, ino_mem);
+    if(errc < 0)
+        return errc;
+
+    blk32_t logical = 0;
+    bool found = false;
+    for(u32_t k = 0; k < ino_mem->ino.i_extents_count && !found; k++)
+    {
+        struct sffs_inode_extent *ext;
+        errc = __ext_iter_next(&it, 0, &ext);
+        if(errc < 0)
+            break;
+
+        if(block - logical < ext->e_len)
+        {
+            *block_id = ext->e_start + (block - logical);
+            if(entry)
+                *entry = it.entry;
+            if(ext_id)
+                *ext_id = it.slot - 1;
+            found = true;
+        }
+        logical += ext->e_len;
+    }
+
+    __ext_iter_done(&it);
+    if(errc < 0)
+        return errc;
+    return found ? 0 : SFFS_ERR_INVARG;
+}
+
+sffs_err_t sffs_ext_get_blocks(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem,
+    blk32_t first, u32_t count, blk32_t *blocks)
+{
+    if(!sffs_ctx || !ino_mem || !blocks)
+        return SFFS_ERR_INVARG;
+
+    struct __ext_iter it;
+    sffs_err_t errc = __ext_iter_init(&it, sffs_ctx, ino_mem);
+    if(errc < 0)
+        return errc;
+
+    blk32_t logical = 0;
+    u32_t done = 0;
+    for(u32_t k = 0; k < ino_mem->ino.i_extents_count && done < count; k++)
+    {
+        struct sffs_inode_extent *ext;
+        errc = __ext_iter_next(&it, 0, &ext);
+        if(errc < 0)
+            break;
+
+        // Part of the extent that falls into [first + done, first + count)
+        blk32_t pos = first + done;
+        if(pos - logical < ext->e_len)
+        {
+            for(u32_t off = pos - logical; off < ext->e_len && done < count; off++)
+                blocks[done++] = ext->e_start + off;
+        }
+        logical += ext->e_len;
+    }
+
+    __ext_iter_done(&it);
+    if(errc < 0)
+        return errc;
+    return done == count ? 0 : SFFS_ERR_FS;
+}
+
+sffs_err_t sffs_ext_append(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem,
+    const blk32_t *blocks, u32_t count)
+{
+    if(!sffs_ctx || !ino_mem || !blocks)
+        return SFFS_ERR_INVARG;
+    if(count == 0)
+        return 0;
+
+    u32_t nr_runs = 0;
+    for(u32_t i = 0; i < count; i += sffs_blk_run(blocks + i, count - i))
+        nr_runs++;
+
+    struct __ext_iter it;
+    sffs_err_t errc = __ext_iter_init(&it, sffs_ctx, ino_mem);
+    if(errc < 0)
+        return errc;
+
+    // Find the last extent, the first run might continue it
+    struct sffs_inode_extent *last = NULL;
+    u32_t nr_exts = ino_mem->ino.i_extents_count;
+    for(u32_t k = 0; k < nr_exts && errc >= 0; k++)
+        errc = __ext_iter_next(&it, 0, &last);
+
+    u32_t merge = 0;
+    if(errc >= 0 && last && last->e_start + last->e_len == blocks[0])
+    {
+        u32_t run = sffs_blk_run(blocks, count);
+        if(last->e_len <= UINT32_MAX - run)
+            merge = run;
+    }
+
+    /**
+     *  Inode list entries missing for the new extents are allocated 
+     *  before any slot is touched, so that running out of inodes leaves 
+     *  the extents as they were
+    */
+    u64_t needed = (u64_t) nr_exts + nr_runs - (merge ? 1 : 0);
+    u64_t capacity = __ext_pr_slots(sffs_ctx) + 
+        (u64_t) (ino_mem->ino.i_list_size - 1) * __ext_supp_slots(sffs_ctx);
+    if(errc >= 0 && needed > capacity)
+    {
+        u32_t supp_slots = __ext_supp_slots(sffs_ctx);
+        errc = sffs_alloc_inode_list(sffs_ctx, (needed - capacity + supp_slots - 1) / 
+            supp_slots, ino_mem);
+
+        // Walked entry now links to the new ones
+        if(errc >= 0 && it.entry != ino_mem->ino.i_inode_num)
+            errc = sffs_read_inode(sffs_ctx, it.entry, (struct sffs_inode_mem *) it.buf);
+    }
+
+    u32_t i = 0;
+    if(errc >= 0 && merge)
+    {
+        last->e_len += merge;
+        it.dirty = true;
+        nr_runs--;
+        i = merge;
+    }
+
+    while(i < count && errc >= 0)
+    {
+        struct sffs_inode_extent *ext;
+        errc = __ext_iter_next(&it, nr_runs, &ext);
+        if(errc < 0)
+            break;
+
+        u32_t run = sffs_blk_run(blocks + i, count - i);
+        ext->e_start = blocks[i];
+        ext->e_len = run;
+        it.dirty = true;
+        nr_exts++;
+        nr_runs--;
+        i += run;
+    }
+
+    sffs_err_t errc2 = __ext_iter_done(&it);
+    if(errc >= 0)
+        errc = errc2;
+    if(errc < 0)
+        return errc;
+
+    ino_mem->ino.i_extents_count = nr_exts;
+    return 0;
+}
+
+sffs_err_t sffs_ext_truncate(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem,
+    blk32_t count)
+{
+    if(!sffs_ctx || !ino_mem)
+        return SFFS_ERR_INVARG;
+
+    if(count == 0)
+    {
+        ino_mem->ino.i_extents_count = 0;
+        return 0;
+    }
+
+    struct __ext_iter it;
+    sffs_err_t errc = __ext_iter_init(&it, sffs_ctx, ino_mem);
+    if(errc < 0)
+        return errc;
+
+    // Extent holding the new last block is cut, the following ones are dropped
+    blk32_t logical = 0;
+    u32_t nr_exts = ino_mem->ino.i_extents_count;
+    for(u32_t k = 0; k < nr_exts; k++)
+    {
+        struct sffs_inode_extent *ext;
+        errc = __ext_iter_next(&it, 0, &ext);
+        if(errc < 0)
+            break;
+
+        if(count - logical <= ext->e_len)
+        {
+            ext->e_len = count - logical;
+            it.dirty = true;
+            nr_exts = k + 1;
+            break;
+        }
+        logical += ext->e_len;
+    }
+
+    sffs_err_t errc2 = __ext_iter_done(&it);
+    if(errc >= 0)
+        errc = errc2;
+    if(errc < 0)
+        return errc;
+
+    ino_mem->ino.i_extents_count = nr_exts;
+    return 0;
+}
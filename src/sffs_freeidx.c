@@ -0,0 +1,645 @@
+/**
+ *  SPDX-License-Identifier: MIT
+ *  Copyright (c) 2023 Danylo Malapura
+*/
+
+/**
+ *  Free extent index. Free data blocks are kept as extents in two
+ *  B-trees, one ordered by start and one by length (ties broken by
+ *  start). The first finds the extent around a goal block, the second
+ *  the smallest extent that fits a request, both in logarithmic time.
+ *  The index is built from the data bitmap mirror. Changes of the data
+ *  bitmap take no lock, they only flag the regions they touch stale.
+ *  Stale regions are rebuilt from the mirror under the index lock right
+ *  before the index is searched, so the lock is held by allocations
+ *  only and never by bitmap updates.
+ *
+ *  Blocks handed out by sffs_freeidx_take leave the index at once and
+ *  are marked in the bitmap by the caller. A rebuild of their region in
+ *  between may put them back and hand them to another thread, the bit
+ *  is then set by exactly one of the two and the other one skips it
+*/
+
+#include <sffs.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BT_ORDER    SFFS_FREEIDX_ORDER     // Minimum degree
+#define REGION      SFFS_FREEIDX_REGION    // Blocks rebuilt at once
+
+struct sffs_fext
+{
+    blk32_t start;
+    blk32_t len;
+};
+
+typedef int (*__fext_cmp_t)(const struct sffs_fext *, const struct sffs_fext *);
+
+struct __bt_node
+{
+    u32_t n;                    // Number of keys
+    bool leaf;
+    struct sffs_fext keys[2 * BT_ORDER - 1];
+    struct __bt_node *child[2 * BT_ORDER];
+};
+
+struct __btree
+{
+    struct __bt_node *root;
+    __fext_cmp_t cmp;
+};
+
+struct sffs_freeidx
+{
+    pthread_mutex_t lock;
+    struct __btree by_start;
+    struct __btree by_len;
+    const void *bits;           // Data bitmap mirror the index follows
+    u64_t *stale;               // One bit per region changed since its rebuild, accessed atomically
+    u32_t stale_words;
+    bool broken;                // Rebuild failed, index no longer follows the bitmap
+};
+
+static int __cmp_start(const struct sffs_fext *a, const struct sffs_fext *b)
+{
+    return (a->start > b->start) - (a->start < b->start);
+}
+
+static int __cmp_len(const struct sffs_fext *a, const struct sffs_fext *b)
+{
+    if(a->len != b->len)
+        return (a->len > b->len) - (a->len < b->len);
+    return __cmp_start(a, b);
+}
+
+/*          B-tree          */
+
+static struct __bt_node *__bt_node_alloc(bool leaf)
+{
+    struct __bt_node *node = calloc(1, sizeof(struct __bt_node));
+    if(node)
+        node->leaf = leaf;
+    return node;
+}
+
+static void __bt_node_free(struct __bt_node *node)
+{
+    if(!node)
+        return;
+    if(!node->leaf)
+    {
+        for(u32_t i = 0; i <= node->n; i++)
+            __bt_node_free(node->child[i]);
+    }
+    free(node);
+}
+
+/**
+ *  Returns index of the first key of node not less than key
+*/
+static u32_t __bt_pos(struct __btree *bt, struct __bt_node *node, const struct sffs_fext *key)
+{
+    u32_t lo = 0, hi = node->n;
+    while(lo < hi)
+    {
+        u32_t mid = (lo + hi) / 2;
+        if(bt->cmp(&node->keys[mid], key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ *  Smallest key not less than key
+*/
+static bool __bt_lower_bound(struct __btree *bt, const struct sffs_fext *key,
+    struct sffs_fext *res)
+{
+    bool found = false;
+    for(struct __bt_node *node = bt->root; node; )
+    {
+        u32_t i = __bt_pos(bt, node, key);
+        if(i < node->n)
+        {
+            *res = node->keys[i];
+            found = true;
+        }
+        node = node->leaf ? NULL : node->child[i];
+    }
+    return found;
+}
+
+/**
+ *  Largest key not greater than key
+*/
+static bool __bt_floor(struct __btree *bt, const struct sffs_fext *key, struct sffs_fext *res)
+{
+    bool found = false;
+    for(struct __bt_node *node = bt->root; node; )
+    {
+        u32_t i = __bt_pos(bt, node, key);
+        if(i < node->n && bt->cmp(&node->keys[i], key) == 0)
+        {
+            *res = node->keys[i];
+            return true;
+        }
+        if(i > 0)
+        {
+            *res = node->keys[i - 1];
+            found = true;
+        }
+        node = node->leaf ? NULL : node->child[i];
+    }
+    return found;
+}
+
+static bool __bt_last(struct __btree *bt, struct sffs_fext *res)
+{
+    struct __bt_node *node = bt->root;
+    if(node->n == 0)
+        return false;
+    while(!node->leaf)
+        node = node->child[node->n];
+    *res = node->keys[node->n - 1];
+    return true;
+}
+
+/**
+ *  Splits full child i of node, new sibling is passed in
+*/
+static void __bt_split(struct __bt_node *node, u32_t i, struct __bt_node *right)
+{
+    struct __bt_node *left = node->child[i];
+
+    right->leaf = left->leaf;
+    right->n = BT_ORDER - 1;
+    memcpy(right->keys, left->keys + BT_ORDER, sizeof(struct sffs_fext) * (BT_ORDER - 1));
+    if(!left->leaf)
+        memcpy(right->child, left->child + BT_ORDER, sizeof(struct __bt_node *) * BT_ORDER);
+    left->n = BT_ORDER - 1;
+
+    memmove(node->child + i + 2, node->child + i + 1,
+        sizeof(struct __bt_node *) * (node->n - i));
+    memmove(node->keys + i + 1, node->keys + i, sizeof(struct sffs_fext) * (node->n - i));
+    node->child[i + 1] = right;
+    node->keys[i] = left->keys[BT_ORDER - 1];
+    node->n++;
+}
+
+static sffs_err_t __bt_insert(struct __btree *bt, const struct sffs_fext *key)
+{
+    struct __bt_node *node = bt->root;
+
+    // Splits on the way down, so the leaf always has room
+    if(node->n == 2 * BT_ORDER - 1)
+    {
+        struct __bt_node *root = __bt_node_alloc(false);
+        struct __bt_node *right = __bt_node_alloc(true);
+        if(!root || !right)
+        {
+            free(root);
+            free(right);
+            return SFFS_ERR_MEMALLOC;
+        }
+        root->child[0] = node;
+        __bt_split(root, 0, right);
+        bt->root = node = root;
+    }
+
+    while(!node->leaf)
+    {
+        u32_t i = __bt_pos(bt, node, key);
+        if(node->child[i]->n == 2 * BT_ORDER - 1)
+        {
+            struct __bt_node *right = __bt_node_alloc(true);
+            if(!right)
+                return SFFS_ERR_MEMALLOC;
+            __bt_split(node, i, right);
+            if(bt->cmp(key, &node->keys[i]) > 0)
+                i++;
+        }
+        node = node->child[i];
+    }
+
+    u32_t i = __bt_pos(bt, node, key);
+    memmove(node->keys + i + 1, node->keys + i, sizeof(struct sffs_fext) * (node->n - i));
+    node->keys[i] = *key;
+    node->n++;
+    return 0;
+}
+
+/**
+ *  Merges child i + 1 of node and the key between them into child i
+*/
+static void __bt_merge(struct __bt_node *node, u32_t i)
+{
+    struct __bt_node *left = node->child[i];
+    struct __bt_node *right = node->child[i + 1];
+
+    left->keys[left->n] = node->keys[i];
+    memcpy(left->keys + left->n + 1, right->keys, sizeof(struct sffs_fext) * right->n);
+    if(!left->leaf)
+        memcpy(left->child + left->n + 1, right->child,
+            sizeof(struct __bt_node *) * (right->n + 1));
+    left->n += right->n + 1;
+
+    memmove(node->keys + i, node->keys + i + 1, sizeof(struct sffs_fext) * (node->n - i - 1));
+    memmove(node->child + i + 1, node->child + i + 2,
+        sizeof(struct __bt_node *) * (node->n - i - 1));
+    node->n--;
+    free(right);
+}
+
+/**
+ *  Makes sure child i of node has at least BT_ORDER keys, borrowing from
+ *  a sibling or merging with it. Returns index of the child that
+ *  holds the keys of former child i
+*/
+static u32_t __bt_fill(struct __bt_node *node, u32_t i)
+{
+    struct __bt_node *child = node->child[i];
+
+    if(i > 0 && node->child[i - 1]->n >= BT_ORDER)
+    {
+        struct __bt_node *sib = node->child[i - 1];
+        memmove(child->keys + 1, child->keys, sizeof(struct sffs_fext) * child->n);
+        if(!child->leaf)
+            memmove(child->child + 1, child->child,
+                sizeof(struct __bt_node *) * (child->n + 1));
+        child->keys[0] = node->keys[i - 1];
+        if(!child->leaf)
+            child->child[0] = sib->child[sib->n];
+        node->keys[i - 1] = sib->keys[sib->n - 1];
+        child->n++;
+        sib->n--;
+        return i;
+    }
+
+    if(i < node->n && node->child[i + 1]->n >= BT_ORDER)
+    {
+        struct __bt_node *sib = node->child[i + 1];
+        child->keys[child->n] = node->keys[i];
+        if(!child->leaf)
+            child->child[child->n + 1] = sib->child[0];
+        node->keys[i] = sib->keys[0];
+        memmove(sib->keys, sib->keys + 1, sizeof(struct sffs_fext) * (sib->n - 1));
+        if(!sib->leaf)
+            memmove(sib->child, sib->child + 1, sizeof(struct __bt_node *) * sib->n);
+        child->n++;
+        sib->n--;
+        return i;
+    }
+
+    if(i < node->n)
+    {
+        __bt_merge(node, i);
+        return i;
+    }
+    __bt_merge(node, i - 1);
+    return i - 1;
+}
+
+/**
+ *  Removes key from the subtree of node. Every node entered on the
+ *  way down has at least BT_ORDER keys, so removal never underflows
+*/
+static void __bt_delete_node(struct __btree *bt, struct __bt_node *node,
+    const struct sffs_fext *key)
+{
+    while(true)
+    {
+        u32_t i = __bt_pos(bt, node, key);
+        bool here = i < node->n && bt->cmp(&node->keys[i], key) == 0;
+
+        if(here && node->leaf)
+        {
+            memmove(node->keys + i, node->keys + i + 1,
+                sizeof(struct sffs_fext) * (node->n - i - 1));
+            node->n--;
+            return;
+        }
+        if(node->leaf)
+            return;
+
+        if(here)
+        {
+            struct __bt_node *left = node->child[i];
+            struct __bt_node *right = node->child[i + 1];
+            struct sffs_fext repl;
+
+            // Key is replaced by its predecessor or successor, which is removed instead
+            if(left->n >= BT_ORDER)
+            {
+                struct __bt_node *pred = left;
+                while(!pred->leaf)
+                    pred = pred->child[pred->n];
+                repl = pred->keys[pred->n - 1];
+                node->keys[i] = repl;
+                __bt_delete_node(bt, left, &repl);
+                return;
+            }
+            if(right->n >= BT_ORDER)
+            {
+                struct __bt_node *succ = right;
+                while(!succ->leaf)
+                    succ = succ->child[0];
+                repl = succ->keys[0];
+                node->keys[i] = repl;
+                __bt_delete_node(bt, right, &repl);
+                return;
+            }
+
+            __bt_merge(node, i);
+            node = left;
+            continue;
+        }
+
+        if(node->child[i]->n < BT_ORDER)
+            i = __bt_fill(node, i);
+        node = node->child[i];
+    }
+}
+
+static void __bt_delete(struct __btree *bt, const struct sffs_fext *key)
+{
+    __bt_delete_node(bt, bt->root, key);
+
+    // Root emptied by a merge hands over to its only child
+    struct __bt_node *root = bt->root;
+    if(root->n == 0 && !root->leaf)
+    {
+        bt->root = root->child[0];
+        free(root);
+    }
+}
+
+/*          Extents         */
+
+static sffs_err_t __fext_insert(struct sffs_freeidx *fi, const struct sffs_fext *ext)
+{
+    sffs_err_t errc = __bt_insert(&fi->by_start, ext);
+    if(errc < 0)
+        return errc;
+
+    errc = __bt_insert(&fi->by_len, ext);
+    if(errc < 0)
+        __bt_delete(&fi->by_start, ext);
+    return errc;
+}
+
+static void __fext_remove(struct sffs_freeidx *fi, const struct sffs_fext *ext)
+{
+    __bt_delete(&fi->by_start, ext);
+    __bt_delete(&fi->by_len, ext);
+}
+
+/**
+ *  Returns the first extent which ends after block, if any
+*/
+static bool __fext_next(struct sffs_freeidx *fi, blk32_t block, struct sffs_fext *res)
+{
+    struct sffs_fext key = { .start = block, .len = 0 };
+    if(__bt_floor(&fi->by_start, &key, res) && (u64_t) res->start + res->len > block)
+        return true;
+    return __bt_lower_bound(&fi->by_start, &key, res);
+}
+
+/**
+ *  Removes [start, end) from the index, parts of it which are not in
+ *  the index are skipped
+*/
+static sffs_err_t __fext_use(struct sffs_freeidx *fi, u64_t start, u64_t end)
+{
+    struct sffs_fext ext;
+    while(start < end && __fext_next(fi, start, &ext) && ext.start < end)
+    {
+        u64_t ext_end = (u64_t) ext.start + ext.len;
+        __fext_remove(fi, &ext);
+
+        if(ext.start < start)
+        {
+            struct sffs_fext left = { .start = ext.start, .len = start - ext.start };
+            if(__fext_insert(fi, &left) < 0)
+                return SFFS_ERR_MEMALLOC;
+        }
+        if(ext_end > end)
+        {
+            struct sffs_fext right = { .start = end, .len = ext_end - end };
+            if(__fext_insert(fi, &right) < 0)
+                return SFFS_ERR_MEMALLOC;
+        }
+        start = ext_end;
+    }
+    return 0;
+}
+
+/**
+ *  Adds [start, end) to the index, merging it with the extents it
+ *  touches or overlaps
+*/
+static sffs_err_t __fext_free(struct sffs_freeidx *fi, u64_t start, u64_t end)
+{
+    struct sffs_fext ext;
+
+    if(start > 0 && __fext_next(fi, start - 1, &ext) && ext.start <= start)
+    {
+        __fext_remove(fi, &ext);
+        start = ext.start;
+        if((u64_t) ext.start + ext.len > end)
+            end = (u64_t) ext.start + ext.len;
+    }
+
+    while(__fext_next(fi, start, &ext) && ext.start <= end)
+    {
+        __fext_remove(fi, &ext);
+        if(ext.start < start)
+            start = ext.start;
+        if((u64_t) ext.start + ext.len > end)
+            end = (u64_t) ext.start + ext.len;
+    }
+
+    struct sffs_fext merged = { .start = start, .len = end - start };
+    return __fext_insert(fi, &merged);
+}
+
+/**
+ *  Replaces the part of the index within [start, end) with the free 
+ *  blocks the bitmap has there now
+*/
+static sffs_err_t __fext_sync(struct sffs_freeidx *fi, u64_t start, u64_t end)
+{
+    sffs_err_t errc = __fext_use(fi, start, end);
+    for(u64_t pos = start; pos < end && errc == 0; )
+    {
+        u64_t from = __find_zero_bm(fi->bits, pos, end);
+        if(from >= end)
+            break;
+
+        u64_t to = __find_one_bm(fi->bits, from, end);
+        errc = __fext_free(fi, from, to);
+        pos = to;
+    }
+    return errc;
+}
+
+/**
+ *  Rebuilds stale regions, called with the lock held. A flag is taken 
+ *  down before its region is read, so a change made meanwhile flags the 
+ *  region again
+*/
+static sffs_err_t __fext_sync_stale(struct sffs_freeidx *fi, u64_t total)
+{
+    for(u32_t w = 0; w < fi->stale_words; w++)
+    {
+        if(__atomic_load_n(&fi->stale[w], __ATOMIC_RELAXED) == 0)
+            continue;
+
+        u64_t word = __atomic_exchange_n(&fi->stale[w], 0, __ATOMIC_ACQUIRE);
+        while(word)
+        {
+            u64_t start = ((u64_t) w * 64 + __builtin_ctzll(word)) * REGION;
+            u64_t end = start + REGION < total ? start + REGION : total;
+            word &= word - 1;
+
+            sffs_err_t errc = __fext_sync(fi, start, end);
+            if(errc < 0)
+                return errc;
+        }
+    }
+    return 0;
+}
+
+/*          Interface           */
+
+sffs_err_t sffs_freeidx_init(sffs_context_t *sffs_ctx, const void *bits)
+{
+    if(!sffs_ctx || !bits)
+        return SFFS_ERR_INVARG;
+
+    struct sffs_freeidx *fi = calloc(1, sizeof(struct sffs_freeidx));
+    if(!fi)
+        return SFFS_ERR_MEMALLOC;
+
+    u64_t total = sffs_ctx->sb.s_blocks_count;
+    fi->stale_words = (total + REGION * 64 - 1) / (REGION * 64);
+    fi->stale = calloc(fi->stale_words + 1, sizeof(u64_t));
+
+    fi->by_start.cmp = __cmp_start;
+    fi->by_len.cmp = __cmp_len;
+    fi->by_start.root = __bt_node_alloc(true);
+    fi->by_len.root = __bt_node_alloc(true);
+
+    sffs_err_t errc = fi->stale && fi->by_start.root && fi->by_len.root ? 
+        0 : SFFS_ERR_MEMALLOC;
+
+    // Runs of zero bits are appended in order, no merging is needed
+    for(u64_t pos = 0; pos < total && errc == 0; )
+    {
+        u64_t start = __find_zero_bm(bits, pos, total);
+        if(start >= total)
+            break;
+
+        u64_t end = __find_one_bm(bits, start, total);
+        struct sffs_fext ext = { .start = start, .len = end - start };
+        errc = __fext_insert(fi, &ext);
+        pos = end;
+    }
+
+    if(errc < 0)
+    {
+        __bt_node_free(fi->by_start.root);
+        __bt_node_free(fi->by_len.root);
+        free(fi->stale);
+        free(fi);
+        return errc;
+    }
+
+    fi->bits = bits;
+    pthread_mutex_init(&fi->lock, NULL);
+    sffs_ctx->freeidx = fi;
+    return 0;
+}
+
+void sffs_freeidx_destroy(sffs_context_t *sffs_ctx)
+{
+    struct sffs_freeidx *fi = sffs_ctx->freeidx;
+    if(!fi)
+        return;
+
+    pthread_mutex_destroy(&fi->lock);
+    __bt_node_free(fi->by_start.root);
+    __bt_node_free(fi->by_len.root);
+    free(fi->stale);
+    free(fi);
+    sffs_ctx->freeidx = NULL;
+}
+
+void sffs_freeidx_stale(sffs_context_t *sffs_ctx, bmap_t start, u32_t count)
+{
+    struct sffs_freeidx *fi = sffs_ctx->freeidx;
+    if(!fi || count == 0)
+        return;
+
+    u64_t last = ((u64_t) start + count - 1) / REGION;
+    for(u64_t r = start / REGION; r <= last; r++)
+        __atomic_fetch_or(&fi->stale[r / 64], 1ULL << (r % 64), __ATOMIC_RELEASE);
+}
+
+sffs_err_t sffs_freeidx_take(sffs_context_t *sffs_ctx, blk32_t goal, u32_t len,
+    blk32_t *start, u32_t *count)
+{
+    struct sffs_freeidx *fi = sffs_ctx->freeidx;
+    if(!fi)
+        return SFFS_ERR_INIT;
+    if(!start || !count || len == 0)
+        return SFFS_ERR_INVARG;
+
+    pthread_mutex_lock(&fi->lock);
+    if(!fi->broken && __fext_sync_stale(fi, sffs_ctx->sb.s_blocks_count) < 0)
+        fi->broken = true;
+    if(fi->broken)
+    {
+        pthread_mutex_unlock(&fi->lock);
+        return SFFS_ERR_INIT;
+    }
+
+    /**
+     *  Extent holding goal comes first, it continues the file. Otherwise
+     *  the smallest extent that fits, the one at or after goal among
+     *  equally long ones. If nothing fits, the longest extent is taken
+    */
+    struct sffs_fext ext;
+    struct sffs_fext key = { .start = goal, .len = 0 };
+    u64_t from;
+
+    if(__bt_floor(&fi->by_start, &key, &ext) && (u64_t) ext.start + ext.len > goal)
+        from = goal;
+    else
+    {
+        key.len = len;
+        if(!__bt_lower_bound(&fi->by_len, &key, &ext) && !__bt_last(&fi->by_len, &ext))
+        {
+            pthread_mutex_unlock(&fi->lock);
+            return SFFS_ERR_NOSPC;
+        }
+        from = ext.start;
+    }
+
+    u64_t avail = (u64_t) ext.start + ext.len - from;
+    u32_t taken = avail < len ? avail : len;
+
+    sffs_err_t errc = __fext_use(fi, from, from + taken);
+    if(errc < 0)
+        fi->broken = true;
+    pthread_mutex_unlock(&fi->lock);
+
+    if(errc < 0)
+        return SFFS_ERR_INIT;
+
+    *start = from;
+    *count = taken;
+    return 0;
+}
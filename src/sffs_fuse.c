@@ -21,27 +21,84 @@ void *sffs_init(struct fuse_conn_info *conn)
             malloc(sizeof(struct sffs_context));
     if(!sffs_context)
         abort();
+    memset(sffs_context, 0, sizeof(struct sffs_context));
+    sffs_context->log_id = -1;
     
     struct sffs_options *opts = (struct sffs_options *) __sffs_pd;
     if(!opts)
         abort();
 
     // Obtain pre-init parameter via global variable
-    int fd = open(opts->fs_image, O_RDWR);
-    if(fd < 0)
+    int oflags = opts->direct_io ? O_DIRECT : 0;
+    sffs_err_t errc = sffs_dev_open(sffs_context, opts->fs_image, opts->backend, oflags);
+    if(errc < 0)
         abort();
-    sffs_context->disk_id = fd;
 
-    sffs_err_t errc = sffs_read_sb(sffs_context, &sffs_context->sb);
+    errc = sffs_read_sb(sffs_context, &sffs_context->sb);
     if(errc < 0)
         abort();
 
+    // Member of a striped volume holds only part of the data region
+    if(sffs_context->sb.s_stripe_count > 1 && sffs_context->dev_ops != &sffs_stripe_ops)
+        abort();
+
     // Allocate at least block_size cache for local use
-    void *cache = malloc(sffs_context->sb.s_block_size);
+    void *cache = sffs_aligned_alloc(sffs_context, sffs_context->sb.s_block_size);
     if(!cache)
         abort();
     
     sffs_context->cache = cache;
+
+    errc = sffs_bufpool_init(sffs_context, SFFS_BUFPOOL_SIZE);
+    if(errc < 0)
+        abort();
+
+    // Bitmaps are read once here, before the block cache could keep them
+    errc = sffs_bm_load(sffs_context);
+    if(errc < 0)
+        abort();
+
+    // Concurrent fsync calls share a single device flush
+    errc = sffs_commit_init(sffs_context);
+    if(errc < 0)
+        abort();
+
+    // Mapped backends already are the memory, caching them would only double copies
+    if(!sffs_context->dev_ops->map)
+    {
+        // Attach block cache, from now on writes reach the device only on sync
+        size_t cache_size = opts->cache_size ? opts->cache_size : SFFS_BCACHE_SIZE;
+        errc = sffs_bcache_init(sffs_context, cache_size, SFFS_BCACHE_FLUSH_INTERVAL);
+        if(errc < 0)
+            abort();
+    }
+
+    // GIT entries are written back into the block cache, so it is attached after it
+    size_t icache_size = opts->icache_size ? opts->icache_size : SFFS_ICACHE_SIZE;
+    errc = sffs_icache_init(sffs_context, icache_size);
+    if(errc < 0)
+        abort();
+
+    // io_uring is optional, batches fall back to synchronous reads without it
+    if(opts->io_depth > 0 && sffs_context->disk_id >= 0 && !sffs_context->dev_ops->map)
+        sffs_uring_init(sffs_context, opts->io_depth);
+
+    // Readahead is a hint as well, mount proceeds without it
+    sffs_ra_init(sffs_context, opts->readahead);
+
+    // Block maps only spare inode list walks, mount proceeds without them
+    sffs_bmap_init(sffs_context);
+
+    if(opts->discard)
+        sffs_discard_init(sffs_context);
+
+    // Statistics are reported into the log file at unmount
+    if(opts->log_file)
+        sffs_context->log_id = open(opts->log_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+    errc = sffs_stats_init(sffs_context);
+    if(errc < 0)
+        abort();
     return sffs_context;
 }
 
@@ -50,11 +107,55 @@ void sffs_destroy(void *data)
     struct fuse_context *fctx = fuse_get_context();
     sffs_context_t *ctx = (sffs_context_t *) fctx->private_data;
 
+    // Discarded blocks are released into the bitmap and the superblock counters
+    sffs_discard_destroy(ctx);
+
     if(sffs_write_sb(ctx, &ctx->sb) < 0)
         ; // do high level error handling
 
-    close(ctx->disk_id);
-    close(ctx->log_id);
+    // Worker fills the cache, so it must be gone before the cache
+    sffs_ra_destroy(ctx);
+    sffs_bmap_destroy(ctx);
+
+    // Dirty inodes and bitmap blocks go through the cache, so they are flushed first
+    if(sffs_icache_destroy(ctx) < 0)
+        ; // do high level error handling
+
+    if(sffs_bm_unload(ctx) < 0)
+        ; // do high level error handling
+
+    if(sffs_bcache_destroy(ctx) < 0)
+        ; // do high level error handling
+
+    sffs_uring_destroy(ctx);
+
+    sffs_sync(ctx);
+    sffs_commit_destroy(ctx);
+    sffs_dev_close(ctx);
+    sffs_bufpool_destroy(ctx);
+
+    sffs_stats_dump(ctx);
+    sffs_stats_destroy(ctx);
+    if(ctx->log_id >= 0)
+        close(ctx->log_id);
+}
+
+int sffs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    struct fuse_context *fctx = fuse_get_context();
+    sffs_context_t *ctx = (sffs_context_t *) fctx->private_data;
+
+    if(sffs_write_sb(ctx, &ctx->sb) < 0)
+        return -EIO;
+
+    if(sffs_sync(ctx) < 0)
+        return -EIO;
+    return 0;
+}
+
+int sffs_flush(const char *path, struct fuse_file_info *fi)
+{
+    return sffs_fsync(path, 0, fi);
 }
 
 int sffs_statfs(const char *path, struct statvfs *statfs)
@@ -310,7 +411,7 @@ int sffs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offs
         return -1;
 
     struct sffs_data_block_info db_info;
-    db_info.content = malloc(ctx->sb.s_block_size);
+    db_info.content = sffs_buf_get(ctx);
     if(!db_info.content)
         return SFFS_ERR_MEMALLOC;
 
@@ -320,15 +421,22 @@ int sffs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offs
     struct sffs_direntry *dir_buf = (struct sffs_direntry *) 
         malloc(SFFS_MAX_DIR_ENTRY + 1);
     
-    if(!buf)
+    if(!dir_buf)
+    {
+        sffs_buf_put(ctx, db_info.content);
         return SFFS_ERR_MEMALLOC;
+    }
 
     for(u32_t i = 0; i < ino_blocks; i++)
     {
         int flags = SFFS_GET_BLK_RD;
         errc = sffs_get_data_block_info(ctx, i, flags, &db_info, ino_mem);
         if(errc < 0)
+        {
+            sffs_buf_put(ctx, db_info.content);
+            free(dir_buf);
             return errc;
+        }
         
         u8_t *dptr = (u8_t *) db_info.content;
         accum_rec = 0;
@@ -352,14 +460,23 @@ int sffs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offs
                 size_t f_name_len = dir_buf->rec_len - SFFS_DIRENTRY_LENGTH;
                 char *f_name = malloc(f_name_len + 1);
                 if(!f_name)
+                {
+                    sffs_buf_put(ctx, db_info.content);
+                    free(dir_buf);
                     return -1;
+                }
                 
                 memcpy(f_name, dir_buf->name, f_name_len);
                 f_name[f_name_len] = 0;
 
-                if(filler(buf, f_name, NULL, accum_rec) != 0)
-                    return -1;
+                int full = filler(buf, f_name, NULL, accum_rec);
                 free(f_name);
+                if(full != 0)
+                {
+                    sffs_buf_put(ctx, db_info.content);
+                    free(dir_buf);
+                    return -1;
+                }
             }
 
             accum_rec += rec_len;
@@ -367,20 +484,536 @@ int sffs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offs
         } while(accum_rec < ctx->sb.s_block_size);
     }
 
+    sffs_buf_put(ctx, db_info.content);
+    free(dir_buf);
+    return 0;
+}
+
+/**
+ *  Walks path starting from the root directory and reads inode it 
+ *  points to into ino_mem. Returns 0 or negated errno
+*/
+static int __sffs_lookup_path(sffs_context_t *ctx, const char *path, 
+    struct sffs_inode_mem *ino_mem)
+{
+    if(sffs_read_inode(ctx, 0, ino_mem) < 0)
+        return -EIO;
+
+    char name[SFFS_MAX_DIR_ENTRY + 1];
+    const char *p = path;
+    while(*p != 0)
+    {
+        while(*p == '/')
+            p++;
+        if(*p == 0)
+            break;
+
+        size_t len = strcspn(p, "/");
+        if(len > SFFS_MAX_DIR_ENTRY - SFFS_DIRENTRY_LENGTH)
+            return -ENAMETOOLONG;
+
+        memcpy(name, p, len);
+        name[len] = 0;
+        p += len;
+
+        if(!SFFS_ISDIR(ino_mem->ino.i_mode))
+            return -ENOTDIR;
+
+        struct sffs_direntry *direntry = NULL;
+        sffs_err_t errc = sffs_lookup_direntry(ctx, ino_mem, name, &direntry, NULL);
+        ino32_t ino = direntry ? direntry->ino_id : 0;
+        free(direntry);
+
+        if(errc < 0)
+            return -EIO;
+        if(errc == 0)
+            return -ENOENT;
+
+        if(sffs_read_inode(ctx, ino, ino_mem) < 0)
+            return -EIO;
+    }
+    return 0;
+}
+
+int sffs_read(const char *path, char *buf, size_t size, off_t off, 
+    struct fuse_file_info *fi)
+{
+    struct fuse_context *fctx = fuse_get_context();
+    sffs_context_t *ctx = (sffs_context_t *) fctx->private_data;
+
+    struct sffs_inode_mem *ino_mem;
+    if(sffs_creat_inode(ctx, 0, SFFS_IFREG, 0, &ino_mem) < 0)
+        return -ENOMEM;
+
+    int res = __sffs_lookup_path(ctx, path, ino_mem);
+    if(res == 0 && SFFS_ISDIR(ino_mem->ino.i_mode))
+        res = -EISDIR;
+    else if(res == 0)
+    {
+        ssize_t rd = sffs_read_data(ctx, ino_mem, buf, size, off);
+        res = rd < 0 ? -EIO : (int) rd;
+    }
+
+    free(ino_mem);
+    return res;
+}
+
+/**
+ *  Appends size bytes to the vector built by sffs_read_buf. Bytes 
+ *  continuing the last segment extend it, memory segments are copied
+*/
+static int __sffs_bufvec_add(struct fuse_bufvec **bufp, size_t *max_segs, 
+    const void *mem, int fd, off_t pos, size_t size)
+{
+    struct fuse_bufvec *bufv = *bufp;
+    struct fuse_buf *last = bufv->count ? &bufv->buf[bufv->count - 1] : NULL;
+
+    if(last && !mem && (last->flags & FUSE_BUF_IS_FD) && last->pos + last->size == pos)
+    {
+        last->size += size;
+        return 0;
+    }
+
+    if(last && mem && !(last->flags & FUSE_BUF_IS_FD))
+    {
+        void *grown = realloc(last->mem, last->size + size);
+        if(!grown)
+            return -ENOMEM;
+        memcpy((u8_t *) grown + last->size, mem, size);
+        last->mem = grown;
+        last->size += size;
+        return 0;
+    }
+
+    if(bufv->count == *max_segs)
+    {
+        size_t new_max = *max_segs * 2;
+        bufv = realloc(bufv, sizeof(struct fuse_bufvec) + 
+            (new_max - 1) * sizeof(struct fuse_buf));
+        if(!bufv)
+            return -ENOMEM;
+        *bufp = bufv;
+        *max_segs = new_max;
+    }
+
+    struct fuse_buf *seg = &bufv->buf[bufv->count];
+    memset(seg, 0, sizeof(struct fuse_buf));
+    seg->size = size;
+    seg->fd = -1;
+    if(mem)
+    {
+        seg->mem = malloc(size);
+        if(!seg->mem)
+            return -ENOMEM;
+        memcpy(seg->mem, mem, size);
+    }
+    else
+    {
+        seg->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        seg->fd = fd;
+        seg->pos = pos;
+    }
+    bufv->count++;
+    return 0;
+}
+
+static void __sffs_bufvec_free(struct fuse_bufvec *bufv)
+{
+    for(size_t i = 0; i < bufv->count; i++)
+        free(bufv->buf[i].mem);
+    free(bufv);
+}
+
+int sffs_read_buf(const char *path, struct fuse_bufvec **bufp,
+    size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct fuse_context *fctx = fuse_get_context();
+    sffs_context_t *ctx = (sffs_context_t *) fctx->private_data;
+
+    struct sffs_inode_mem *ino_mem;
+    if(sffs_creat_inode(ctx, 0, SFFS_IFREG, 0, &ino_mem) < 0)
+        return -ENOMEM;
+
+    int res = __sffs_lookup_path(ctx, path, ino_mem);
+    if(res == 0 && SFFS_ISDIR(ino_mem->ino.i_mode))
+        res = -EISDIR;
+    if(res < 0)
+    {
+        free(ino_mem);
+        return res;
+    }
+
+    u64_t file_size = sffs_inode_size(ctx, ino_mem);
+    if((u64_t) off >= file_size)
+        size = 0;
+    else if(size > file_size - off)
+        size = file_size - off;
+
+    size_t max_segs = 8;
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) + 
+        (max_segs - 1) * sizeof(struct fuse_buf));
+    if(!bufv)
+    {
+        free(ino_mem);
+        return -ENOMEM;
+    }
+    bufv->count = 0;
+    bufv->idx = 0;
+    bufv->off = 0;
+
+    /**
+     *  Blocks are handed to FUSE as ranges of the image file, so it can 
+     *  splice them without a copy. Blocks whose newest version is still 
+     *  dirty in the block cache, as well as devices with no descriptor 
+     *  or with O_DIRECT alignment demands, are copied into memory
+    */
+    bool use_fd = ctx->disk_id >= 0 && ctx->dev_align == 0;
+    blk32_t block_size = ctx->sb.s_block_size;
+    blk32_t data_start = sffs_data_start(ctx);
+    blk32_t blocks[SFFS_IOV_MAX];
+    void *scratch = NULL;
+
+    u64_t end = off + size;
+    for(u64_t pos = off; pos < end && res == 0; )
+    {
+        blk32_t first = pos / block_size;
+        u32_t count = (end - 1) / block_size - first + 1;
+        if(count > SFFS_IOV_MAX)
+            count = SFFS_IOV_MAX;
+
+        if(sffs_get_data_blocks(ctx, ino_mem, first, count, blocks) < 0)
+        {
+            res = -EIO;
+            break;
+        }
+
+        for(u32_t i = 0; i < count && res == 0; i++)
+        {
+            blk32_t block = data_start + blocks[i];
+            u32_t blk_off = pos % block_size;
+            size_t len = block_size - blk_off;
+            if(len > end - pos)
+                len = end - pos;
+
+            if(use_fd && !(ctx->bcache && sffs_bcache_dirty(ctx, block)))
+            {
+                off_t dev_pos = (off_t) block * block_size + blk_off;
+                res = __sffs_bufvec_add(&bufv, &max_segs, NULL, ctx->disk_id, dev_pos, len);
+            }
+            else
+            {
+                if(!scratch && !(scratch = sffs_buf_get(ctx)))
+                    res = -ENOMEM;
+                else if(sffs_read_blk(ctx, block, scratch, 1) < 0)
+                    res = -EIO;
+                else
+                    res = __sffs_bufvec_add(&bufv, &max_segs, (u8_t *) scratch + blk_off, 
+                        -1, 0, len);
+            }
+            pos += len;
+        }
+    }
+
+    // Empty read is still a valid, zero-sized vector
+    if(res == 0 && bufv->count == 0)
+    {
+        memset(&bufv->buf[0], 0, sizeof(struct fuse_buf));
+        bufv->buf[0].fd = -1;
+        bufv->count = 1;
+    }
+
+    sffs_buf_put(ctx, scratch);
+    free(ino_mem);
+    if(res < 0)
+    {
+        __sffs_bufvec_free(bufv);
+        return res;
+    }
+
+    *bufp = bufv;
     return 0;
 }
 
-int sffs_read(const char *, char *, size_t, off_t, struct fuse_file_info *)
+/**
+ *  Zeroes byte range [from, to) of already allocated file blocks, 
+ *  so that growing a file never exposes stale block content
+*/
+static int __sffs_zero_range(sffs_context_t *ctx, struct sffs_inode_mem *ino_mem, 
+    u64_t from, u64_t to, void *scratch)
 {
+    blk32_t block_size = ctx->sb.s_block_size;
+    struct sffs_data_block_info db_info;
+
+    for(u64_t pos = from; pos < to; )
+    {
+        u32_t blk_off = pos % block_size;
+        size_t len = block_size - blk_off;
+        if(len > to - pos)
+            len = to - pos;
+
+        db_info.content = scratch;
+        int flags = len < block_size ? SFFS_GET_BLK_RD : 0;
+        if(sffs_get_data_block_info(ctx, pos / block_size, flags, &db_info, ino_mem) < 0)
+            return -EIO;
+
+        memset((u8_t *) scratch + blk_off, 0, len);
+        if(sffs_write_data_blk(ctx, db_info.block_id, scratch, 1) < 0)
+            return -EIO;
+        pos += len;
+    }
     return 0;
 }
 
+/**
+ *  Splices next len bytes of src into the image at absolute block 
+ *  first. Cached copies are dropped both before the copy, so a dirty 
+ *  one is never flushed over the new data, and after it, so a racing 
+ *  read cannot leave the old content cached
+*/
+static int __sffs_splice_blocks(sffs_context_t *ctx, struct fuse_bufvec *src, 
+    blk32_t first, size_t len)
+{
+    blk32_t block_size = ctx->sb.s_block_size;
+    size_t blks = len / block_size;
+
+    if(ctx->bcache)
+        sffs_bcache_forget(ctx, first, blks);
+
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd = ctx->disk_id;
+    dst.buf[0].pos = (off_t) first * block_size;
+
+    ssize_t copied = fuse_buf_copy(&dst, src, 0);
+
+    if(ctx->bcache)
+        sffs_bcache_forget(ctx, first, blks);
+    return copied == (ssize_t) len ? 0 : -EIO;
+}
+
+int sffs_write_buf(const char *path, struct fuse_bufvec *buf, off_t off,
+    struct fuse_file_info *fi)
+{
+    struct fuse_context *fctx = fuse_get_context();
+    sffs_context_t *ctx = (sffs_context_t *) fctx->private_data;
+
+    size_t size = fuse_buf_size(buf);
+    if(size == 0)
+        return 0;
+
+    struct sffs_inode_mem *ino_mem;
+    if(sffs_creat_inode(ctx, 0, SFFS_IFREG, 0, &ino_mem) < 0)
+        return -ENOMEM;
+
+    void *scratch = sffs_buf_get(ctx);
+    int res = scratch ? __sffs_lookup_path(ctx, path, ino_mem) : -ENOMEM;
+    if(res == 0 && SFFS_ISDIR(ino_mem->ino.i_mode))
+        res = -EISDIR;
+
+    blk32_t block_size = ctx->sb.s_block_size;
+    u64_t end = (u64_t) off + size;
+    u64_t old_size = 0;
+
+    // Preallocated blocks past the end of file are written in place
+    if(res == 0)
+    {
+        old_size = sffs_inode_size(ctx, ino_mem);
+        u64_t need_blks = (end + block_size - 1) / block_size;
+        if(need_blks > ino_mem->ino.i_blks_count)
+        {
+            sffs_err_t errc = sffs_alloc_data_blocks(ctx, 
+                need_blks - ino_mem->ino.i_blks_count, ino_mem);
+            if(errc < 0)
+                res = errc == SFFS_ERR_NOSPC ? -ENOSPC : -EIO;
+        }
+    }
+
+    // Gap between the old end of file and the write reads back as zeros
+    if(res == 0 && (u64_t) off > old_size)
+        res = __sffs_zero_range(ctx, ino_mem, old_size, off, scratch);
+
+    /**
+     *  Whole blocks are spliced from the request straight into the image, 
+     *  physically adjacent ones with a single copy. Partially covered 
+     *  blocks go through read-modify-write in the block cache, so do all 
+     *  blocks of backends that cannot take a plain descriptor write
+    */
+    bool use_fd = ctx->disk_id >= 0 && ctx->dev_align == 0 && !ctx->dev_ops->map;
+    blk32_t data_start = sffs_data_start(ctx);
+    blk32_t blocks[SFFS_IOV_MAX];
+    blk32_t run_first = 0;
+    size_t run_len = 0;
+
+    for(u64_t pos = off; pos < end && res == 0; )
+    {
+        blk32_t first = pos / block_size;
+        u32_t count = (end - 1) / block_size - first + 1;
+        if(count > SFFS_IOV_MAX)
+            count = SFFS_IOV_MAX;
+
+        if(sffs_get_data_blocks(ctx, ino_mem, first, count, blocks) < 0)
+        {
+            res = -EIO;
+            break;
+        }
+
+        for(u32_t i = 0; i < count && res == 0; i++)
+        {
+            blk32_t block = data_start + blocks[i];
+            u32_t blk_off = pos % block_size;
+            size_t len = block_size - blk_off;
+            if(len > end - pos)
+                len = end - pos;
+            pos += len;
+
+            if(use_fd && len == block_size)
+            {
+                if(run_len != 0 && run_first + run_len / block_size == block)
+                {
+                    run_len += len;
+                    continue;
+                }
+
+                if(run_len != 0)
+                    res = __sffs_splice_blocks(ctx, buf, run_first, run_len);
+                run_first = block;
+                run_len = len;
+                continue;
+            }
+
+            // Source is consumed in order, so the pending run goes first
+            if(run_len != 0)
+            {
+                res = __sffs_splice_blocks(ctx, buf, run_first, run_len);
+                run_len = 0;
+                if(res < 0)
+                    break;
+            }
+
+            // Block is read only if the request leaves a part of it intact
+            if(len < block_size && sffs_read_blk(ctx, block, scratch, 1) < 0)
+            {
+                res = -EIO;
+                break;
+            }
+
+            struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+            dst.buf[0].mem = (u8_t *) scratch + blk_off;
+            if(fuse_buf_copy(&dst, buf, 0) != (ssize_t) len)
+                res = -EIO;
+            else if(sffs_write_blk(ctx, block, scratch, 1) < 0)
+                res = -EIO;
+        }
+    }
+
+    if(res == 0 && run_len != 0)
+        res = __sffs_splice_blocks(ctx, buf, run_first, run_len);
+
+    if(res == 0 && end > old_size)
+    {
+        sffs_inode_set_size(ctx, ino_mem, end);
+        if(sffs_write_inode(ctx, ino_mem) < 0)
+            res = -EIO;
+    }
+
+    sffs_buf_put(ctx, scratch);
+    free(ino_mem);
+    return res < 0 ? res : (int) size;
+}
+
+/**
+ *  Shrinking releases the blocks past the new end of file, preallocated 
+ *  ones included. Growing allocates blocks and zeroes the new range
+*/
+int sffs_truncate(const char *path, off_t size)
+{
+    struct fuse_context *fctx = fuse_get_context();
+    sffs_context_t *ctx = (sffs_context_t *) fctx->private_data;
+
+    if(size < 0)
+        return -EINVAL;
+
+    struct sffs_inode_mem *ino_mem;
+    if(sffs_creat_inode(ctx, 0, SFFS_IFREG, 0, &ino_mem) < 0)
+        return -ENOMEM;
+
+    int res = __sffs_lookup_path(ctx, path, ino_mem);
+    if(res == 0 && SFFS_ISDIR(ino_mem->ino.i_mode))
+        res = -EISDIR;
+    if(res < 0)
+    {
+        free(ino_mem);
+        return res;
+    }
+
+    blk32_t block_size = ctx->sb.s_block_size;
+    u64_t old_size = sffs_inode_size(ctx, ino_mem);
+    u64_t need_blks = ((u64_t) size + block_size - 1) / block_size;
+    sffs_err_t errc = 0;
+
+    if(need_blks < ino_mem->ino.i_blks_count && (u64_t) size < old_size)
+        errc = sffs_free_data_blocks(ctx, ino_mem->ino.i_blks_count - need_blks, ino_mem);
+    else if(need_blks > ino_mem->ino.i_blks_count)
+        errc = sffs_alloc_data_blocks(ctx, need_blks - ino_mem->ino.i_blks_count, ino_mem);
+    if(errc < 0)
+        res = errc == SFFS_ERR_NOSPC ? -ENOSPC : -EIO;
+
+    if(res == 0 && (u64_t) size > old_size)
+    {
+        void *scratch = sffs_buf_get(ctx);
+        res = scratch ? __sffs_zero_range(ctx, ino_mem, old_size, size, scratch) : -ENOMEM;
+        sffs_buf_put(ctx, scratch);
+    }
+
+    if(res == 0)
+    {
+        sffs_inode_set_size(ctx, ino_mem, size);
+        if(sffs_write_inode(ctx, ino_mem) < 0)
+            res = -EIO;
+    }
+
+    free(ino_mem);
+    return res;
+}
+
 int sffs_opendir(const char *, struct fuse_file_info *) 
 {
     printf("sffs_opendir\n");
     return 0;
 }
 
+/**
+ *  I/O statistics are exposed as a read-only extended attribute of 
+ *  any path, e.g. getfattr -n user.sffs.stats <mountpoint>
+*/
+int sffs_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    struct fuse_context *fctx = fuse_get_context();
+    sffs_context_t *ctx = (sffs_context_t *) fctx->private_data;
+
+    if(strcmp(name, SFFS_XATTR_STATS) != 0 || !ctx->stats)
+        return -ENODATA;
+
+    size_t len = sffs_stats_format(ctx, NULL, 0);
+    if(size == 0)
+        return len + SFFS_XATTR_STATS_SLACK;
+
+    char *buf = malloc(len + SFFS_XATTR_STATS_SLACK + 1);
+    if(!buf)
+        return -ENOMEM;
+
+    len = sffs_stats_format(ctx, buf, len + SFFS_XATTR_STATS_SLACK + 1);
+    if(len > size)
+    {
+        free(buf);
+        return -ERANGE;
+    }
+
+    memcpy(value, buf, len);
+    free(buf);
+    return len;
+}
+
 #ifdef SFFS_THUMB
 
 int sffs_readlink(const char *, char *, size_t) { THUMB_FUNC; }
@@ -401,30 +1034,19 @@ int sffs_chmod(const char *, mode_t) { THUMB_FUNC; }
 
 int sffs_chown(const char *, uid_t, gid_t) { THUMB_FUNC; }
 
-int sffs_truncate(const char *, off_t) { THUMB_FUNC; }
-
 int sffs_open(const char *, struct fuse_file_info *) { THUMB_FUNC; }
 
-int sffs_read(const char *, char *, size_t, off_t,
-		     struct fuse_file_info *) { THUMB_FUNC; }
-
 int sffs_write(const char *, const char *, size_t, off_t,
 		      struct fuse_file_info *) { THUMB_FUNC; }
 
 int sffs_statfs(const char *, struct statvfs *) { THUMB_FUNC; }
 
-int sffs_flush(const char *, struct fuse_file_info *) { THUMB_FUNC; }
-
 
 int sffs_release(const char *, struct fuse_file_info *) { THUMB_FUNC; }
 
-int sffs_fsync(const char *, int, struct fuse_file_info *) { THUMB_FUNC; }
-
 
 int sffs_setxattr(const char *, const char *, const char *, size_t, int) { THUMB_FUNC; }
 
-int sffs_getxattr(const char *, const char *, char *, size_t) { THUMB_FUNC; }
-
 int sffs_listxattr(const char *, char *, size_t) { THUMB_FUNC; }
 
 int sffs_removexattr(const char *, const char *) { THUMB_FUNC; }
@@ -456,12 +1078,6 @@ int sffs_ioctl(const char *, int cmd, void *arg,
 int sffs_poll(const char *, struct fuse_file_info *,
             struct fuse_pollhandle *ph, unsigned *reventsp) { THUMB_FUNC; }
 
-int sffs_write_buf(const char *, struct fuse_bufvec *buf, off_t off,
-            struct fuse_file_info *) { THUMB_FUNC; }
-
-int sffs_read_buf(const char *, struct fuse_bufvec **bufp,
-            size_t size, off_t off, struct fuse_file_info *) { THUMB_FUNC; }
-
 int sffs_flock(const char *, struct fuse_file_info *, int op) { THUMB_FUNC; }
 
 int sffs_fallocate(const char *, int, off_t, off_t,
@@ -0,0 +1,451 @@
+/**
+ *  SPDX-License-Identifier: MIT
+ *  Copyright (c) 2023 Danylo Malapura
+*/
+
+/**
+ *  Write-back inode cache. Keeps recently used GIT entries, primary
+ *  and supplementary ones alike, in memory. Entries are looked up by
+ *  inode number through a hash table and evicted in LRU order.
+ *  sffs_write_inode only copies the entry into the cache and marks it
+ *  dirty, GIT blocks are patched on eviction and on sffs_icache_flush,
+ *  which is issued by sffs_sync. Callers that patch an entry in place
+ *  hold a reference to it, referenced entries are never evicted
+*/
+
+#include <sffs_device.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct sffs_icache_ent
+{
+    ino32_t i_ino;                      // Inode number
+    u32_t i_refs;                       // Number of holders, entry is pinned while not 0
+    bool i_dirty;                       // Entry differs from GIT copy
+    struct sffs_icache_ent *i_hnext;    // Next entry within hash chain
+    struct sffs_icache_ent *i_prev;     // LRU list links
+    struct sffs_icache_ent *i_next;
+    u8_t i_data[];                      // Inode entry with its block ids
+};
+
+struct sffs_icache
+{
+    pthread_mutex_t lock;
+    size_t nr_ents;                     // Number of allocated entries
+    size_t max_ents;                    // Cache capacity in inodes
+    size_t hash_size;
+    struct sffs_icache_ent **hash;
+
+    /**
+     *  LRU list sentinel. lru.i_next is the most recently used entry,
+     *  lru.i_prev is the least recently used one
+    */
+    struct sffs_icache_ent lru;
+
+    struct sffs_icache_ent **flush_list;    // Dirty entries sorted by flush
+    size_t flush_size;
+};
+
+static inline size_t __icache_hash(struct sffs_icache *ic, ino32_t ino)
+{
+    return (ino * 2654435761U) & (ic->hash_size - 1);
+}
+
+static inline ino32_t __icache_entry_size(sffs_context_t *sffs_ctx)
+{
+    return sffs_ctx->sb.s_inode_size + sffs_ctx->sb.s_inode_block_size;
+}
+
+static inline blk32_t __icache_git_block(sffs_context_t *sffs_ctx, ino32_t ino)
+{
+    ino32_t ino_per_block = sffs_ctx->sb.s_block_size / __icache_entry_size(sffs_ctx);
+    return sffs_ctx->sb.s_GIT_start + ino / ino_per_block;
+}
+
+static inline size_t __icache_git_offset(sffs_context_t *sffs_ctx, ino32_t ino)
+{
+    ino32_t ino_entry_size = __icache_entry_size(sffs_ctx);
+    ino32_t ino_per_block = sffs_ctx->sb.s_block_size / ino_entry_size;
+    return (size_t) (ino % ino_per_block) * ino_entry_size;
+}
+
+static struct sffs_icache_ent *__icache_lookup(struct sffs_icache *ic, ino32_t ino)
+{
+    struct sffs_icache_ent *ent = ic->hash[__icache_hash(ic, ino)];
+    while(ent && ent->i_ino != ino)
+        ent = ent->i_hnext;
+    return ent;
+}
+
+static void __icache_hash_remove(struct sffs_icache *ic, struct sffs_icache_ent *ent)
+{
+    struct sffs_icache_ent **pp = &ic->hash[__icache_hash(ic, ent->i_ino)];
+    while(*pp != ent)
+        pp = &(*pp)->i_hnext;
+    *pp = ent->i_hnext;
+    ent->i_hnext = NULL;
+}
+
+static void __icache_hash_insert(struct sffs_icache *ic, struct sffs_icache_ent *ent)
+{
+    size_t id = __icache_hash(ic, ent->i_ino);
+    ent->i_hnext = ic->hash[id];
+    ic->hash[id] = ent;
+}
+
+static void __icache_lru_unlink(struct sffs_icache_ent *ent)
+{
+    ent->i_prev->i_next = ent->i_next;
+    ent->i_next->i_prev = ent->i_prev;
+}
+
+static void __icache_lru_push(struct sffs_icache *ic, struct sffs_icache_ent *ent)
+{
+    ent->i_next = ic->lru.i_next;
+    ent->i_prev = &ic->lru;
+    ic->lru.i_next->i_prev = ent;
+    ic->lru.i_next = ent;
+}
+
+/**
+ *  Patches single entry into its GIT block
+*/
+static int __icache_writeback(sffs_context_t *sffs_ctx, struct sffs_icache_ent *ent)
+{
+    blk32_t git_block = __icache_git_block(sffs_ctx, ent->i_ino);
+    u8_t *buf = sffs_buf_get(sffs_ctx);
+    if(!buf)
+        return SFFS_ERR_MEMALLOC;
+
+    int errc = sffs_read_blk(sffs_ctx, git_block, buf, 1);
+    if(errc >= 0)
+    {
+        memcpy(buf + __icache_git_offset(sffs_ctx, ent->i_ino), ent->i_data,
+            __icache_entry_size(sffs_ctx));
+        errc = sffs_write_blk(sffs_ctx, git_block, buf, 1);
+    }
+    sffs_buf_put(sffs_ctx, buf);
+    return errc < 0 ? errc : 0;
+}
+
+/**
+ *  Returns entry that is not bound to any inode. Allocates a new one
+ *  while below capacity, otherwise evicts the least recently used
+ *  entry that is not referenced, writing it back if it is dirty. If
+ *  every entry is referenced, cache grows past its capacity. Must be
+ *  called with cache lock held
+*/
+static int __icache_get_free(sffs_context_t *sffs_ctx, struct sffs_icache_ent **res)
+{
+    struct sffs_icache *ic = sffs_ctx->icache;
+    struct sffs_icache_ent *ent = ic->lru.i_prev;
+
+    while(ent != &ic->lru && ent->i_refs != 0)
+        ent = ent->i_prev;
+
+    if(ic->nr_ents < ic->max_ents || ent == &ic->lru)
+    {
+        ent = malloc(sizeof(struct sffs_icache_ent) + __icache_entry_size(sffs_ctx));
+        if(!ent)
+            return SFFS_ERR_MEMALLOC;
+
+        ic->nr_ents++;
+        *res = ent;
+        return 0;
+    }
+
+    if(ent->i_dirty)
+    {
+        int errc = __icache_writeback(sffs_ctx, ent);
+        if(errc < 0)
+            return errc;
+        ent->i_dirty = false;
+    }
+
+    __icache_lru_unlink(ent);
+    __icache_hash_remove(ic, ent);
+    *res = ent;
+    return 0;
+}
+
+/**
+ *  Finds entry of inode, allocating it and optionally reading it from
+ *  the GIT on a miss. Entry becomes the most recently used. Must be
+ *  called with cache lock held
+*/
+static int __icache_getino(sffs_context_t *sffs_ctx, ino32_t ino, bool read_ino,
+    struct sffs_icache_ent **res)
+{
+    struct sffs_icache *ic = sffs_ctx->icache;
+    struct sffs_icache_ent *ent = __icache_lookup(ic, ino);
+
+    if(ent)
+    {
+        __icache_lru_unlink(ent);
+        __icache_lru_push(ic, ent);
+        *res = ent;
+        return 0;
+    }
+
+    int errc = __icache_get_free(sffs_ctx, &ent);
+    if(errc < 0)
+        return errc;
+
+    if(read_ino)
+    {
+        blk32_t git_block = __icache_git_block(sffs_ctx, ino);
+        size_t offset = __icache_git_offset(sffs_ctx, ino);
+        ino32_t ino_entry_size = __icache_entry_size(sffs_ctx);
+
+        u8_t *git_ptr = sffs_map_blk(sffs_ctx, git_block, 1);
+        if(git_ptr)
+            memcpy(ent->i_data, git_ptr + offset, ino_entry_size);
+        else
+        {
+            u8_t *buf = sffs_buf_get(sffs_ctx);
+            errc = buf ? sffs_read_blk(sffs_ctx, git_block, buf, 1) : SFFS_ERR_MEMALLOC;
+            if(errc >= 0)
+                memcpy(ent->i_data, buf + offset, ino_entry_size);
+            if(buf)
+                sffs_buf_put(sffs_ctx, buf);
+
+            if(errc < 0)
+            {
+                free(ent);
+                ic->nr_ents--;
+                return errc;
+            }
+        }
+    }
+
+    ent->i_ino = ino;
+    ent->i_refs = 0;
+    ent->i_dirty = false;
+    __icache_hash_insert(ic, ent);
+    __icache_lru_push(ic, ent);
+    *res = ent;
+    return 0;
+}
+
+sffs_err_t sffs_icache_init(sffs_context_t *sffs_ctx, size_t nr_inodes)
+{
+    if(!sffs_ctx || nr_inodes == 0)
+        return SFFS_ERR_INVARG;
+
+    struct sffs_icache *ic = malloc(sizeof(struct sffs_icache));
+    if(!ic)
+        return SFFS_ERR_MEMALLOC;
+
+    // Hash table is sized to the next power of two for cheap masking
+    size_t hash_size = 1;
+    while(hash_size < nr_inodes)
+        hash_size <<= 1;
+
+    ic->hash = calloc(hash_size, sizeof(struct sffs_icache_ent *));
+    ic->flush_list = malloc(sizeof(struct sffs_icache_ent *) * nr_inodes);
+    if(!ic->hash || !ic->flush_list)
+    {
+        free(ic->hash);
+        free(ic->flush_list);
+        free(ic);
+        return SFFS_ERR_MEMALLOC;
+    }
+
+    pthread_mutex_init(&ic->lock, NULL);
+    ic->nr_ents = 0;
+    ic->max_ents = nr_inodes;
+    ic->hash_size = hash_size;
+    ic->flush_size = nr_inodes;
+    ic->lru.i_next = &ic->lru;
+    ic->lru.i_prev = &ic->lru;
+
+    sffs_ctx->icache = ic;
+    return 0;
+}
+
+sffs_err_t sffs_icache_destroy(sffs_context_t *sffs_ctx)
+{
+    struct sffs_icache *ic = sffs_ctx->icache;
+    if(!ic)
+        return 0;
+
+    sffs_err_t errc = sffs_icache_flush(sffs_ctx);
+
+    // Detach first, so that nothing is served by a dying cache
+    sffs_ctx->icache = NULL;
+
+    struct sffs_icache_ent *ent = ic->lru.i_next;
+    while(ent != &ic->lru)
+    {
+        struct sffs_icache_ent *next = ent->i_next;
+        free(ent);
+        ent = next;
+    }
+
+    pthread_mutex_destroy(&ic->lock);
+    free(ic->hash);
+    free(ic->flush_list);
+    free(ic);
+    return errc;
+}
+
+sffs_err_t sffs_icache_read(sffs_context_t *sffs_ctx, ino32_t ino,
+    struct sffs_inode_mem *ino_mem)
+{
+    struct sffs_icache *ic = sffs_ctx->icache;
+    struct sffs_icache_ent *ent;
+
+    pthread_mutex_lock(&ic->lock);
+    int errc = __icache_getino(sffs_ctx, ino, true, &ent);
+    if(errc >= 0)
+        memcpy(ino_mem, ent->i_data, __icache_entry_size(sffs_ctx));
+    pthread_mutex_unlock(&ic->lock);
+    return errc < 0 ? errc : 0;
+}
+
+sffs_err_t sffs_icache_write(sffs_context_t *sffs_ctx, const struct sffs_inode_mem *ino_mem)
+{
+    struct sffs_icache *ic = sffs_ctx->icache;
+    struct sffs_icache_ent *ent;
+
+    pthread_mutex_lock(&ic->lock);
+
+    // Whole entry is overwritten, so there is no need to read it
+    int errc = __icache_getino(sffs_ctx, ino_mem->ino.i_inode_num, false, &ent);
+    if(errc >= 0)
+    {
+        memcpy(ent->i_data, ino_mem, __icache_entry_size(sffs_ctx));
+        ent->i_dirty = true;
+    }
+    pthread_mutex_unlock(&ic->lock);
+    return errc < 0 ? errc : 0;
+}
+
+sffs_err_t sffs_icache_get(sffs_context_t *sffs_ctx, ino32_t ino,
+    struct sffs_inode_mem **ino_mem)
+{
+    struct sffs_icache *ic = sffs_ctx->icache;
+    struct sffs_icache_ent *ent;
+
+    pthread_mutex_lock(&ic->lock);
+    int errc = __icache_getino(sffs_ctx, ino, true, &ent);
+    if(errc >= 0)
+    {
+        ent->i_refs++;
+        *ino_mem = (struct sffs_inode_mem *) ent->i_data;
+    }
+    pthread_mutex_unlock(&ic->lock);
+    return errc < 0 ? errc : 0;
+}
+
+void sffs_icache_put(sffs_context_t *sffs_ctx, ino32_t ino, bool dirty)
+{
+    struct sffs_icache *ic = sffs_ctx->icache;
+
+    pthread_mutex_lock(&ic->lock);
+    struct sffs_icache_ent *ent = __icache_lookup(ic, ino);
+    if(ent && ent->i_refs != 0)
+    {
+        ent->i_refs--;
+        if(dirty)
+            ent->i_dirty = true;
+    }
+    pthread_mutex_unlock(&ic->lock);
+}
+
+static int __icache_cmp_ino(const void *a, const void *b)
+{
+    ino32_t ino_a = (*(struct sffs_icache_ent * const *) a)->i_ino;
+    ino32_t ino_b = (*(struct sffs_icache_ent * const *) b)->i_ino;
+    return (ino_a > ino_b) - (ino_a < ino_b);
+}
+
+sffs_err_t sffs_icache_flush(sffs_context_t *sffs_ctx)
+{
+    struct sffs_icache *ic = sffs_ctx->icache;
+    if(!ic)
+        return 0;
+
+    sffs_err_t errc = 0;
+    pthread_mutex_lock(&ic->lock);
+
+    // Cache might have grown past its capacity while entries were referenced
+    if(ic->flush_size < ic->nr_ents)
+    {
+        struct sffs_icache_ent **list = realloc(ic->flush_list,
+            sizeof(struct sffs_icache_ent *) * ic->nr_ents);
+        if(!list)
+        {
+            pthread_mutex_unlock(&ic->lock);
+            return SFFS_ERR_MEMALLOC;
+        }
+        ic->flush_list = list;
+        ic->flush_size = ic->nr_ents;
+    }
+
+    size_t nr_dirty = 0;
+    for(struct sffs_icache_ent *ent = ic->lru.i_next; ent != &ic->lru; ent = ent->i_next)
+        if(ent->i_dirty)
+            ic->flush_list[nr_dirty++] = ent;
+
+    /**
+     *  Sorted by inode number, entries sharing a GIT block are adjacent.
+     *  Every touched block is read and written once, blocks go out in
+     *  vectored writes of ascending block numbers
+    */
+    qsort(ic->flush_list, nr_dirty, sizeof(struct sffs_icache_ent *), __icache_cmp_ino);
+
+    ino32_t ino_entry_size = __icache_entry_size(sffs_ctx);
+    blk32_t blocks[SFFS_IOV_MAX];
+    void *bufs[SFFS_IOV_MAX];
+    for(size_t done = 0; done < nr_dirty; )
+    {
+        size_t nr_blks = 0;
+        size_t end = done;
+        while(end < nr_dirty)
+        {
+            struct sffs_icache_ent *ent = ic->flush_list[end];
+            blk32_t git_block = __icache_git_block(sffs_ctx, ent->i_ino);
+
+            if(nr_blks == 0 || blocks[nr_blks - 1] != git_block)
+            {
+                if(nr_blks == SFFS_IOV_MAX)
+                    break;
+
+                bufs[nr_blks] = sffs_buf_get(sffs_ctx);
+                if(!bufs[nr_blks])
+                {
+                    errc = SFFS_ERR_MEMALLOC;
+                    break;
+                }
+                blocks[nr_blks] = git_block;
+                nr_blks++;
+
+                if(sffs_read_blk(sffs_ctx, git_block, bufs[nr_blks - 1], 1) < 0)
+                {
+                    errc = SFFS_ERR_DEV_READ;
+                    break;
+                }
+            }
+
+            memcpy((u8_t *) bufs[nr_blks - 1] + __icache_git_offset(sffs_ctx, ent->i_ino),
+                ent->i_data, ino_entry_size);
+            end++;
+        }
+
+        if(errc >= 0 && sffs_write_blkv(sffs_ctx, blocks, bufs, nr_blks) < 0)
+            errc = SFFS_ERR_DEV_WRITE;
+
+        for(size_t i = 0; i < nr_blks; i++)
+            sffs_buf_put(sffs_ctx, bufs[i]);
+        if(errc < 0)
+            break;
+
+        for(size_t i = done; i < end; i++)
+            ic->flush_list[i]->i_dirty = false;
+        done = end;
+    }
+    pthread_mutex_unlock(&ic->lock);
+    return errc;
+}
@@ -0,0 +1,445 @@
+/**
+ *  SPDX-License-Identifier: MIT
+ *  Copyright (c) 2023 Danylo Malapura
+*/
+
+/**
+ *  Batched block I/O. Callers queue any number of block reads into
+ *  struct sffs_io_batch, submit them at once and wait for all of them
+ *  to complete. When io_uring is available, every queued request is
+ *  turned into submission queue entry and the whole batch costs a
+ *  couple of io_uring_enter calls. Otherwise, the batch is executed
+ *  synchronously through the regular device path.
+ *
+ *  The ring is driven through raw system calls, so no additional
+ *  library is required
+*/
+
+#include <sffs_device.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SFFS_HAVE_IO_URING
+#endif
+#endif
+
+#ifdef SFFS_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+struct sffs_uring
+{
+    int ring_fd;
+    unsigned int depth;
+    pthread_mutex_t lock;
+
+    // Submission queue
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+
+    // Completion queue
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+int sffs_uring_init(sffs_context_t *sffs_ctx, unsigned int depth)
+{
+    if(!sffs_ctx || depth == 0)
+        return SFFS_ERR_INVARG;
+
+    struct sffs_uring *ring = malloc(sizeof(struct sffs_uring));
+    if(!ring)
+        return SFFS_ERR_MEMALLOC;
+    memset(ring, 0, sizeof(struct sffs_uring));
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring->ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+    if(ring->ring_fd < 0)
+    {
+        free(ring);
+        return SFFS_ERR_INIT;
+    }
+
+    ring->depth = p.sq_entries;
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+
+    if(ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED ||
+        ring->sqes == MAP_FAILED)
+    {
+        if(ring->sq_ptr != MAP_FAILED)
+            munmap(ring->sq_ptr, ring->sq_size);
+        if(ring->cq_ptr != MAP_FAILED)
+            munmap(ring->cq_ptr, ring->cq_size);
+        if(ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqes_size);
+        close(ring->ring_fd);
+        free(ring);
+        return SFFS_ERR_INIT;
+    }
+
+    u8_t *sq = (u8_t *) ring->sq_ptr;
+    ring->sq_head = (unsigned int *) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *) (sq + p.sq_off.array);
+
+    u8_t *cq = (u8_t *) ring->cq_ptr;
+    ring->cq_head = (unsigned int *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    pthread_mutex_init(&ring->lock, NULL);
+    sffs_ctx->uring = ring;
+    return 0;
+}
+
+void sffs_uring_destroy(sffs_context_t *sffs_ctx)
+{
+    struct sffs_uring *ring = sffs_ctx->uring;
+    if(!ring)
+        return;
+
+    munmap(ring->sq_ptr, ring->sq_size);
+    munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sqes, ring->sqes_size);
+    close(ring->ring_fd);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring);
+    sffs_ctx->uring = NULL;
+}
+
+/**
+ *  Pushes requests [first, first + count) to the submission queue
+ *  and reaps their completions. Must be called with ring lock held.
+ *  Buffers of the batch are owned by the kernel while requests are in
+ *  flight, so even on failure every submitted request is waited for
+*/
+static int __uring_run(sffs_context_t *sffs_ctx, struct sffs_io_batch *batch,
+    size_t first, size_t count)
+{
+    struct sffs_uring *ring = sffs_ctx->uring;
+    blk32_t block_size = sffs_ctx->sb.s_block_size;
+
+    unsigned int tail = *ring->sq_tail;
+    for(size_t i = 0; i < count; i++)
+    {
+        struct sffs_io_req *req = &batch->reqs[first + i];
+        unsigned int id = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[id];
+
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = sffs_ctx->disk_id;
+        sqe->addr = (unsigned long) req->data;
+        sqe->len = req->blks * block_size;
+        sqe->off = (uint64_t) req->block * block_size;
+        sqe->user_data = first + i;
+
+        ring->sq_array[id] = id;
+        tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    int errc = 0;
+    size_t to_submit = count;
+    size_t completed = 0;
+    while(completed < count)
+    {
+        int ret = syscall(__NR_io_uring_enter, ring->ring_fd, to_submit,
+            1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(ret >= 0)
+            to_submit -= ret;
+        else if(errno != EINTR)
+        {
+            errc = SFFS_ERR_DEV_READ;
+
+            /**
+             *  Entries the kernel has not consumed yet are taken back, 
+             *  nothing refers to their buffers. Those already consumed 
+             *  are in flight and are still reaped below
+            */
+            unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+            size_t unconsumed = tail - head;
+            if(unconsumed != 0)
+            {
+                __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+                for(size_t i = count - unconsumed; i < count; i++)
+                    batch->reqs[first + i].res = SFFS_ERR_DEV_READ;
+                count -= unconsumed;
+                tail = head;
+            }
+            to_submit = 0;
+        }
+
+        unsigned int head = *ring->cq_head;
+        while(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            struct sffs_io_req *req = &batch->reqs[cqe->user_data];
+            size_t bytes = req->blks * block_size;
+
+            /**
+             *  Kernel is allowed to complete read partially. Finish the
+             *  remaining part through the synchronous path
+            */
+            if(cqe->res >= 0 && (size_t) cqe->res < bytes)
+            {
+                if(__sffs_dev_pread(sffs_ctx, (u8_t *) req->data + cqe->res,
+                    bytes - cqe->res, (uint64_t) req->block * block_size + cqe->res) < 0)
+                    req->res = SFFS_ERR_DEV_READ;
+                else
+                    req->res = bytes;
+            }
+            // O_DIRECT rejects unaligned buffers, synchronous path bounces them
+            else if(cqe->res == -EINVAL && sffs_ctx->dev_align != 0)
+            {
+                if(__sffs_dev_pread(sffs_ctx, req->data, bytes, 
+                    (uint64_t) req->block * block_size) < 0)
+                    req->res = SFFS_ERR_DEV_READ;
+                else
+                    req->res = bytes;
+            }
+            else
+                req->res = cqe->res < 0 ? SFFS_ERR_DEV_READ : cqe->res;
+
+            head++;
+            completed++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return errc;
+}
+
+static int __uring_submit(sffs_context_t *sffs_ctx, struct sffs_io_batch *batch)
+{
+    struct sffs_uring *ring = sffs_ctx->uring;
+    int errc = 0;
+
+    pthread_mutex_lock(&ring->lock);
+    for(size_t done = 0; done < batch->count && errc == 0; )
+    {
+        size_t chunk = batch->count - done;
+        if(chunk > ring->depth)
+            chunk = ring->depth;
+
+        errc = __uring_run(sffs_ctx, batch, done, chunk);
+        done += chunk;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return errc;
+}
+
+#else
+
+int sffs_uring_init(sffs_context_t *sffs_ctx, unsigned int depth)
+{
+    (void) sffs_ctx;
+    (void) depth;
+    return SFFS_ERR_INIT;
+}
+
+void sffs_uring_destroy(sffs_context_t *sffs_ctx) 
+{ 
+    (void) sffs_ctx;
+}
+
+#endif // SFFS_HAVE_IO_URING
+
+int sffs_io_batch_init(struct sffs_io_batch *batch, size_t size)
+{
+    if(!batch || size == 0)
+        return SFFS_ERR_INVARG;
+
+    batch->reqs = malloc(sizeof(struct sffs_io_req) * size);
+    if(!batch->reqs)
+        return SFFS_ERR_MEMALLOC;
+
+    batch->size = size;
+    batch->count = 0;
+    return 0;
+}
+
+void sffs_io_batch_release(struct sffs_io_batch *batch)
+{
+    free(batch->reqs);
+    batch->reqs = NULL;
+    batch->size = 0;
+    batch->count = 0;
+}
+
+int sffs_io_queue_read(sffs_context_t *sffs_ctx, struct sffs_io_batch *batch,
+    blk32_t block, void *data)
+{
+    (void) sffs_ctx;
+    if(!batch || !data)
+        return SFFS_ERR_INVARG;
+
+    if(batch->count == batch->size)
+    {
+        size_t size = batch->size * 2;
+        struct sffs_io_req *reqs = realloc(batch->reqs, sizeof(struct sffs_io_req) * size);
+        if(!reqs)
+            return SFFS_ERR_MEMALLOC;
+        batch->reqs = reqs;
+        batch->size = size;
+    }
+
+    struct sffs_io_req *req = &batch->reqs[batch->count++];
+    req->block = block;
+    req->blks = 1;
+    req->data = data;
+    req->res = 0;
+    req->cached = false;
+    return 0;
+}
+
+int sffs_io_queue_read_data(sffs_context_t *sffs_ctx, struct sffs_io_batch *batch,
+    blk32_t block, void *data)
+{
+    return sffs_io_queue_read(sffs_ctx, batch, sffs_data_start(sffs_ctx) + block, data);
+}
+
+int sffs_io_submit(sffs_context_t *sffs_ctx, struct sffs_io_batch *batch)
+{
+    if(!sffs_ctx || !batch)
+        return SFFS_ERR_INVARG;
+
+    /**
+     *  Blocks residing in the block cache are served immediately, only
+     *  misses are forwarded to the device
+    */
+    if(sffs_ctx->bcache)
+    {
+        for(size_t i = 0; i < batch->count; i++)
+        {
+            struct sffs_io_req *req = &batch->reqs[i];
+            if(sffs_bcache_lookup(sffs_ctx, req->block, req->data, &req->seq) == 1)
+            {
+                req->cached = true;
+                req->res = sffs_ctx->sb.s_block_size;
+            }
+        }
+    }
+
+    int errc = 0;
+#ifdef SFFS_HAVE_IO_URING
+    if(sffs_ctx->uring)
+    {
+        struct sffs_io_batch misses;
+        errc = sffs_io_batch_init(&misses, batch->count ? batch->count : 1);
+        if(errc < 0)
+            return errc;
+
+        for(size_t i = 0; i < batch->count; i++)
+            if(!batch->reqs[i].cached)
+                misses.reqs[misses.count++] = batch->reqs[i];
+
+        if(misses.count != 0)
+            errc = __uring_submit(sffs_ctx, &misses);
+
+        // Propagate results back in submission order
+        for(size_t i = 0, k = 0; i < batch->count && errc == 0; i++)
+            if(!batch->reqs[i].cached)
+                batch->reqs[i].res = misses.reqs[k++].res;
+
+        sffs_io_batch_release(&misses);
+    }
+    else
+#endif
+    {
+        /**
+         *  Without io_uring, single block misses are handed over to the 
+         *  vectored path which merges adjacent ones into one transfer
+        */
+        blk32_t blocks[SFFS_IOV_MAX];
+        void *bufs[SFFS_IOV_MAX];
+        size_t reqs[SFFS_IOV_MAX];
+        size_t nr = 0;
+
+        for(size_t i = 0; i <= batch->count; i++)
+        {
+            if(i < batch->count)
+            {
+                struct sffs_io_req *req = &batch->reqs[i];
+                if(req->cached)
+                    continue;
+
+                if(req->blks != 1)
+                {
+                    req->res = __sffs_dev_read(sffs_ctx, req->block, req->data, req->blks);
+                    if(req->res < 0)
+                        req->res = SFFS_ERR_DEV_READ;
+                    continue;
+                }
+
+                blocks[nr] = req->block;
+                bufs[nr] = req->data;
+                reqs[nr] = i;
+                nr++;
+            }
+
+            if(nr == 0 || (i < batch->count && nr < SFFS_IOV_MAX))
+                continue;
+
+            int res = __sffs_dev_readv(sffs_ctx, blocks, bufs, nr);
+            for(size_t k = 0; k < nr; k++)
+                batch->reqs[reqs[k]].res = res < 0 ? res : (int) sffs_ctx->sb.s_block_size;
+            nr = 0;
+        }
+    }
+
+    return errc;
+}
+
+int sffs_io_wait(sffs_context_t *sffs_ctx, struct sffs_io_batch *batch)
+{
+    if(!sffs_ctx || !batch)
+        return SFFS_ERR_INVARG;
+
+    int errc = 0;
+    for(size_t i = 0; i < batch->count; i++)
+    {
+        struct sffs_io_req *req = &batch->reqs[i];
+        if(req->res < 0)
+        {
+            if(errc == 0)
+                errc = req->res;
+            continue;
+        }
+
+        // Populate block cache with freshly read blocks
+        if(!req->cached && sffs_ctx->bcache)
+            sffs_bcache_insert(sffs_ctx, req->block, req->data, req->seq);
+    }
+
+    batch->count = 0;
+    return errc;
+}
@@ -0,0 +1,287 @@
+/**
+ *  SPDX-License-Identifier: MIT
+ *  Copyright (c) 2023 Danylo Malapura
+*/
+
+/**
+ *  Sequential readahead. Every inode that is being read gets a slot
+ *  describing its current readahead window [start, start + size).
+ *  Reading a block at the async marker (start + size - async_size)
+ *  submits the following window, which grows on every step up to
+ *  max_window blocks, the same way Linux ondemand readahead does.
+ *  Windows are mapped to physical blocks by the reader and handed
+ *  to the worker thread, which reads them into the block cache
+*/
+
+#include <sffs_device.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct sffs_ra_state
+{
+    ino32_t ino;            // Inode the slot belongs to
+    bool valid;
+    blk32_t prev;           // Last logical block read
+    blk32_t start;          // First logical block of the current window
+    u32_t size;             // Window size in blocks, 0 if there is none
+    u32_t async_size;       // Blocks of the window read ahead of time
+};
+
+struct sffs_ra_job
+{
+    blk32_t *blocks;        // Data region relative block numbers
+    u32_t count;
+};
+
+struct sffs_readahead
+{
+    pthread_mutex_t lock;
+    u32_t max_window;       // Upper bound of the window in blocks
+    struct sffs_ra_state states[SFFS_RA_SLOTS];
+
+    // Queue of windows waiting for the worker
+    struct sffs_ra_job queue[SFFS_RA_QUEUE];
+    size_t q_head;
+    size_t q_count;
+
+    pthread_t worker;
+    pthread_cond_t cond;
+    bool stop;
+    void **bufs;            // Worker buffers, max_window blocks
+    u8_t *slab;
+};
+
+static u32_t __ra_roundup_pow2(u32_t val)
+{
+    u32_t res = 1;
+    while(res < val)
+        res <<= 1;
+    return res;
+}
+
+/**
+ *  Size of the first window of a stream, depends on the size of
+ *  the request that started it
+*/
+static u32_t __ra_init_size(struct sffs_readahead *ra, u32_t req)
+{
+    u32_t size = __ra_roundup_pow2(req);
+
+    if(size <= ra->max_window / 32)
+        size *= 4;
+    else if(size <= ra->max_window / 4)
+        size *= 2;
+    else
+        size = ra->max_window;
+    return size;
+}
+
+static u32_t __ra_next_size(struct sffs_readahead *ra, u32_t cur)
+{
+    if(cur < ra->max_window / 16)
+        return cur * 4;
+    if(cur <= ra->max_window / 2)
+        return cur * 2;
+    return ra->max_window;
+}
+
+/**
+ *  Updates the state of ino after a read of [block, block + count)
+ *  and returns the window which must be read ahead, if any. Must be
+ *  called with readahead lock held
+*/
+static u32_t __ra_ondemand(struct sffs_readahead *ra, ino32_t ino, blk32_t block,
+    u32_t count, blk32_t *ra_start)
+{
+    struct sffs_ra_state *st = &ra->states[ino % SFFS_RA_SLOTS];
+    blk32_t last = block + count - 1;
+    u32_t size = 0;
+
+    if(!st->valid || st->ino != ino)
+    {
+        memset(st, 0, sizeof(struct sffs_ra_state));
+        st->ino = ino;
+        st->valid = true;
+    }
+
+    if(st->size != 0 && block >= st->start && block < st->start + st->size)
+    {
+        // Window is being consumed, push the next one once marker is hit
+        blk32_t marker = st->start + st->size - st->async_size;
+        if(st->async_size != 0 && last >= marker)
+        {
+            st->start += st->size;
+            st->size = __ra_next_size(ra, st->size);
+            st->async_size = st->size;
+            size = st->size;
+        }
+    }
+    else if(block == 0 || block == st->prev + 1)
+    {
+        // Start of a sequential stream (or a stream which overran its window)
+        st->start = last + 1;
+        st->size = st->size ? __ra_next_size(ra, st->size) : __ra_init_size(ra, count);
+        st->async_size = st->size;
+        size = st->size;
+    }
+    else
+    {
+        // Random access, drop the window
+        st->size = 0;
+        st->async_size = 0;
+    }
+
+    st->prev = last;
+    *ra_start = st->start;
+    return size;
+}
+
+static void *__ra_worker(void *arg)
+{
+    sffs_context_t *sffs_ctx = (sffs_context_t *) arg;
+    struct sffs_readahead *ra = sffs_ctx->ra;
+
+    pthread_mutex_lock(&ra->lock);
+    while(!ra->stop)
+    {
+        if(ra->q_count == 0)
+        {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+            continue;
+        }
+
+        struct sffs_ra_job job = ra->queue[ra->q_head];
+        ra->q_head = (ra->q_head + 1) % SFFS_RA_QUEUE;
+        ra->q_count--;
+        pthread_mutex_unlock(&ra->lock);
+
+        // Blocks end up in the block cache, buffers are scratch space only
+        sffs_read_data_blkv(sffs_ctx, job.blocks, ra->bufs, job.count);
+        free(job.blocks);
+
+        pthread_mutex_lock(&ra->lock);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+int sffs_ra_init(sffs_context_t *sffs_ctx, u32_t max_window)
+{
+    if(!sffs_ctx)
+        return SFFS_ERR_INVARG;
+
+    // Prefetched blocks have nowhere to go without the block cache
+    if(max_window == 0 || !sffs_ctx->bcache)
+        return 0;
+
+    struct sffs_readahead *ra = malloc(sizeof(struct sffs_readahead));
+    if(!ra)
+        return SFFS_ERR_MEMALLOC;
+    memset(ra, 0, sizeof(struct sffs_readahead));
+
+    blk32_t block_size = sffs_ctx->sb.s_block_size;
+    ra->max_window = max_window;
+    ra->slab = sffs_aligned_alloc(sffs_ctx, (size_t) block_size * max_window);
+    ra->bufs = malloc(sizeof(void *) * max_window);
+    if(!ra->slab || !ra->bufs)
+    {
+        free(ra->slab);
+        free(ra->bufs);
+        free(ra);
+        return SFFS_ERR_MEMALLOC;
+    }
+
+    for(u32_t i = 0; i < max_window; i++)
+        ra->bufs[i] = ra->slab + (size_t) i * block_size;
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    sffs_ctx->ra = ra;
+
+    if(pthread_create(&ra->worker, NULL, __ra_worker, sffs_ctx) != 0)
+    {
+        sffs_ctx->ra = NULL;
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->lock);
+        free(ra->slab);
+        free(ra->bufs);
+        free(ra);
+        return SFFS_ERR_INIT;
+    }
+    return 0;
+}
+
+void sffs_ra_destroy(sffs_context_t *sffs_ctx)
+{
+    struct sffs_readahead *ra = sffs_ctx->ra;
+    if(!ra)
+        return;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = true;
+    pthread_cond_signal(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->worker, NULL);
+
+    // Windows that have not been read yet are simply dropped
+    for(size_t i = 0; i < ra->q_count; i++)
+        free(ra->queue[(ra->q_head + i) % SFFS_RA_QUEUE].blocks);
+
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    free(ra->slab);
+    free(ra->bufs);
+    free(ra);
+    sffs_ctx->ra = NULL;
+}
+
+void sffs_readahead(sffs_context_t *sffs_ctx, struct sffs_inode_mem *ino_mem,
+    blk32_t block, u32_t count)
+{
+    struct sffs_readahead *ra = sffs_ctx->ra;
+    if(!ra || !ino_mem || count == 0)
+        return;
+
+    blk32_t start;
+    pthread_mutex_lock(&ra->lock);
+    u32_t size = __ra_ondemand(ra, ino_mem->ino.i_inode_num, block, count, &start);
+    pthread_mutex_unlock(&ra->lock);
+
+    // Window is trimmed at the end of the file
+    blk32_t blks_count = ino_mem->ino.i_blks_count;
+    if(size == 0 || start >= blks_count)
+        return;
+    if(size > blks_count - start)
+        size = blks_count - start;
+
+    /**
+     *  Mapping walks the inode list, which is not safe to do from
+     *  the worker, since the caller owns ino_mem
+    */
+    blk32_t *blocks = malloc(sizeof(blk32_t) * size);
+    if(!blocks)
+        return;
+
+    if(sffs_get_data_blocks(sffs_ctx, ino_mem, start, size, blocks) < 0)
+    {
+        free(blocks);
+        return;
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    if(ra->q_count == SFFS_RA_QUEUE)
+    {
+        // Readahead is only a hint, so a busy worker drops the window
+        pthread_mutex_unlock(&ra->lock);
+        free(blocks);
+        return;
+    }
+
+    struct sffs_ra_job *job = &ra->queue[(ra->q_head + ra->q_count) % SFFS_RA_QUEUE];
+    job->blocks = blocks;
+    job->count = size;
+    ra->q_count++;
+    pthread_cond_signal(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+}
@@ -0,0 +1,211 @@
+/**
+ *  SPDX-License-Identifier: MIT
+ *  Copyright (c) 2023 Danylo Malapura
+*/
+
+/**
+ *  Block I/O statistics. Every block read and write is accounted to
+ *  the region of the image it touches, which is derived from the
+ *  superblock. Per region and direction, number of calls, bytes, total
+ *  time and a histogram of latencies with power of two buckets are
+ *  kept. Counters are updated with relaxed atomics, so accounting
+ *  takes no lock
+*/
+
+#include <sffs_device.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct sffs_io_stat
+{
+    atomic_ullong count;
+    atomic_ullong bytes;
+    atomic_ullong time_ns;
+    atomic_ullong hist[SFFS_STATS_BUCKETS];
+};
+
+struct sffs_stats
+{
+    struct sffs_io_stat io[SFFS_REGION_COUNT][2];
+};
+
+static const char *__sffs_region_names[SFFS_REGION_COUNT] =
+{
+    "superblock", "group_desc", "data_bitmap", "GIT_bitmap", "GIT", "data"
+};
+
+static inline u64_t __stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int __stats_region(sffs_context_t *sffs_ctx, blk32_t block)
+{
+    struct sffs_superblock *sb = &sffs_ctx->sb;
+
+    if(block < sb->s_data_bitmap_start)
+    {
+        if(sb->s_group_desc_size != 0 && block >= sb->s_group_desc_start)
+            return SFFS_REGION_GROUP_DESC;
+        return SFFS_REGION_SB;
+    }
+    if(block < sb->s_GIT_bitmap_start)
+        return SFFS_REGION_DATA_BM;
+    if(block < sb->s_GIT_start)
+        return SFFS_REGION_GIT_BM;
+    if(block < sffs_data_start(sffs_ctx))
+        return SFFS_REGION_GIT;
+    return SFFS_REGION_DATA;
+}
+
+/**
+ *  Bucket k holds latencies in [2^(k-1), 2^k) nanoseconds, the last
+ *  one everything above
+*/
+static inline int __stats_bucket(u64_t ns)
+{
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    return bucket < SFFS_STATS_BUCKETS ? bucket : SFFS_STATS_BUCKETS - 1;
+}
+
+int sffs_stats_init(sffs_context_t *sffs_ctx)
+{
+    struct sffs_stats *stats = malloc(sizeof(struct sffs_stats));
+    if(!stats)
+        return SFFS_ERR_MEMALLOC;
+
+    for(int r = 0; r < SFFS_REGION_COUNT; r++)
+    {
+        for(int op = 0; op < 2; op++)
+        {
+            struct sffs_io_stat *st = &stats->io[r][op];
+            atomic_init(&st->count, 0);
+            atomic_init(&st->bytes, 0);
+            atomic_init(&st->time_ns, 0);
+            for(int b = 0; b < SFFS_STATS_BUCKETS; b++)
+                atomic_init(&st->hist[b], 0);
+        }
+    }
+
+    sffs_ctx->stats = stats;
+    return 0;
+}
+
+void sffs_stats_destroy(sffs_context_t *sffs_ctx)
+{
+    free(sffs_ctx->stats);
+    sffs_ctx->stats = NULL;
+}
+
+u64_t sffs_stats_start(sffs_context_t *sffs_ctx)
+{
+    return sffs_ctx->stats ? __stats_now() : 0;
+}
+
+void sffs_stats_account(sffs_context_t *sffs_ctx, blk32_t block, int op,
+    size_t bytes, u64_t start)
+{
+    struct sffs_stats *stats = sffs_ctx->stats;
+    if(!stats)
+        return;
+
+    u64_t ns = __stats_now() - start;
+    struct sffs_io_stat *st = &stats->io[__stats_region(sffs_ctx, block)][op];
+
+    atomic_fetch_add_explicit(&st->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->time_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->hist[__stats_bucket(ns)], 1, memory_order_relaxed);
+}
+
+int sffs_stats_get(sffs_context_t *sffs_ctx, int region, int op,
+    struct sffs_io_stat_snap *snap)
+{
+    struct sffs_stats *stats = sffs_ctx->stats;
+    if(!stats || !snap || region < 0 || region >= SFFS_REGION_COUNT ||
+        (op != SFFS_STAT_READ && op != SFFS_STAT_WRITE))
+        return SFFS_ERR_INVARG;
+
+    struct sffs_io_stat *st = &stats->io[region][op];
+    snap->count = atomic_load_explicit(&st->count, memory_order_relaxed);
+    snap->bytes = atomic_load_explicit(&st->bytes, memory_order_relaxed);
+    snap->time_ns = atomic_load_explicit(&st->time_ns, memory_order_relaxed);
+    for(int b = 0; b < SFFS_STATS_BUCKETS; b++)
+        snap->hist[b] = atomic_load_explicit(&st->hist[b], memory_order_relaxed);
+    return 0;
+}
+
+/**
+ *  Appends to buf like snprintf does, keeping track of the length
+ *  the whole report would have
+*/
+static void __stats_append(char *buf, size_t size, size_t *len, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int res = vsnprintf(*len < size ? buf + *len : NULL, *len < size ? size - *len : 0,
+        fmt, ap);
+    va_end(ap);
+    if(res > 0)
+        *len += res;
+}
+
+size_t sffs_stats_format(sffs_context_t *sffs_ctx, char *buf, size_t size)
+{
+    size_t len = 0;
+    static const char *op_names[2] = { "read", "write" };
+
+    if(size != 0)
+        buf[0] = 0;
+
+    for(int r = 0; r < SFFS_REGION_COUNT; r++)
+    {
+        for(int op = 0; op < 2; op++)
+        {
+            struct sffs_io_stat_snap snap;
+            if(sffs_stats_get(sffs_ctx, r, op, &snap) < 0 || snap.count == 0)
+                continue;
+
+            __stats_append(buf, size, &len, "%s %s: %llu ops, %llu bytes, avg %llu ns\n",
+                __sffs_region_names[r], op_names[op], (unsigned long long) snap.count,
+                (unsigned long long) snap.bytes,
+                (unsigned long long) (snap.time_ns / snap.count));
+
+            for(int b = 0; b < SFFS_STATS_BUCKETS; b++)
+            {
+                if(snap.hist[b] == 0)
+                    continue;
+                if(b == SFFS_STATS_BUCKETS - 1)
+                    __stats_append(buf, size, &len, "  >= %llu ns: %llu\n", 1ULL << (b - 1),
+                        (unsigned long long) snap.hist[b]);
+                else
+                    __stats_append(buf, size, &len, "  < %llu ns: %llu\n", 1ULL << b,
+                        (unsigned long long) snap.hist[b]);
+            }
+        }
+    }
+    return len;
+}
+
+void sffs_stats_dump(sffs_context_t *sffs_ctx)
+{
+    if(!sffs_ctx->stats)
+        return;
+
+    size_t len = sffs_stats_format(sffs_ctx, NULL, 0);
+    char *buf = malloc(len + 1);
+    if(!buf)
+        return;
+
+    sffs_stats_format(sffs_ctx, buf, len + 1);
+    int fd = sffs_ctx->log_id >= 0 ? sffs_ctx->log_id : STDERR_FILENO;
+    dprintf(fd, "sffs I/O statistics\n%s", buf);
+    free(buf);
+}
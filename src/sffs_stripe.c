@@ -0,0 +1,598 @@
+/**
+ *  SPDX-License-Identifier: MIT
+ *  Copyright (c) 2023 Danylo Malapura
+*/
+
+/**
+ *  Striped (RAID-0) backend. Volume consists of several member images
+ *  with identical layout. Metadata region [0, data start) lives on the
+ *  first member only, data region is split into stripe units which are
+ *  distributed round robin over all members:
+ *
+ *      unit    = data block / stripe unit
+ *      member  = unit % stripe count
+ *      row     = unit / stripe count
+ *
+ *  and the block lands at row * stripe unit + data block % stripe unit
+ *  of the member's data region. Every member runs its own backend and
+ *  a worker thread, so a transfer spanning several members is issued
+ *  to all of them in parallel
+*/
+
+#include <sffs_device.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+enum sffs_stripe_op
+{
+    SFFS_STRIPE_READ,
+    SFFS_STRIPE_WRITE,
+    SFFS_STRIPE_SYNC
+};
+
+/**
+ *  Transfers of a single request share completion state
+*/
+struct sffs_stripe_req
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;            // Jobs not finished yet
+    int errc;
+};
+
+/**
+ *  Contiguous part of a request which belongs to one member
+*/
+struct sffs_stripe_job
+{
+    int op;
+    u32_t member;
+    const struct iovec *iov;
+    int iovcnt;
+    uint64_t offset;        // Offset within the member
+    uint64_t bytes;
+    struct sffs_stripe_req *req;
+    struct sffs_stripe_job *next;
+};
+
+struct sffs_stripe_member
+{
+    sffs_context_t ctx;     // Context the member backend works on
+    struct sffs_stripe_dev *dev;    // Volume the member belongs to
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct sffs_stripe_job *head;   // Jobs waiting for the worker
+    struct sffs_stripe_job *tail;
+    bool stop;
+    bool running;           // Worker thread has been started
+    pthread_t worker;
+};
+
+struct sffs_stripe_dev
+{
+    u32_t count;            // Number of members
+    uint64_t unit;          // Stripe unit in bytes
+    uint64_t data_off;      // Offset of the data region on every member
+    uint64_t member_size;   // Usable size of the smallest member
+    struct sffs_stripe_member *members;
+};
+
+/**
+ *  Maps volume offset to the member holding it. Returns member index,
+ *  offset within the member and number of bytes left until the next
+ *  boundary of the mapping
+*/
+static u32_t __stripe_map(struct sffs_stripe_dev *sd, uint64_t offset,
+    uint64_t *member_off, uint64_t *len)
+{
+    if(offset < sd->data_off)
+    {
+        *member_off = offset;
+        *len = sd->data_off - offset;
+        return 0;
+    }
+
+    uint64_t rel = offset - sd->data_off;
+    uint64_t unit = rel / sd->unit;
+    uint64_t row = unit / sd->count;
+
+    *member_off = sd->data_off + row * sd->unit + rel % sd->unit;
+    *len = sd->unit - rel % sd->unit;
+    return unit % sd->count;
+}
+
+static ssize_t __stripe_member_rw(sffs_context_t *mctx, const struct iovec *iov,
+    int iovcnt, uint64_t offset, bool write)
+{
+    const struct sffs_dev_ops *ops = mctx->dev_ops;
+
+    if(iovcnt == 1)
+        return write ? ops->pwrite(mctx, iov[0].iov_base, iov[0].iov_len, offset) :
+            ops->pread(mctx, iov[0].iov_base, iov[0].iov_len, offset);
+
+    if(write ? ops->pwritev != NULL : ops->preadv != NULL)
+        return write ? ops->pwritev(mctx, iov, iovcnt, offset) :
+            ops->preadv(mctx, iov, iovcnt, offset);
+
+    uint64_t done = 0;
+    for(int i = 0; i < iovcnt; i++)
+    {
+        ssize_t ret = write ?
+            ops->pwrite(mctx, iov[i].iov_base, iov[i].iov_len, offset + done) :
+            ops->pread(mctx, iov[i].iov_base, iov[i].iov_len, offset + done);
+        if(ret < 0)
+            return -1;
+        done += iov[i].iov_len;
+    }
+    return done;
+}
+
+static int __stripe_job_run(struct sffs_stripe_dev *sd, struct sffs_stripe_job *job)
+{
+    sffs_context_t *mctx = &sd->members[job->member].ctx;
+
+    if(job->op == SFFS_STRIPE_SYNC)
+        return mctx->dev_ops->sync(mctx);
+
+    ssize_t ret = __stripe_member_rw(mctx, job->iov, job->iovcnt, job->offset,
+        job->op == SFFS_STRIPE_WRITE);
+    return ret < 0 ? -1 : 0;
+}
+
+static void __stripe_job_done(struct sffs_stripe_job *job, int errc)
+{
+    struct sffs_stripe_req *req = job->req;
+
+    pthread_mutex_lock(&req->lock);
+    if(errc < 0)
+        req->errc = errc;
+    if(--req->pending == 0)
+        pthread_cond_signal(&req->cond);
+    pthread_mutex_unlock(&req->lock);
+}
+
+static void *__stripe_worker(void *arg)
+{
+    struct sffs_stripe_member *sm = (struct sffs_stripe_member *) arg;
+    struct sffs_stripe_dev *sd = sm->dev;
+
+    pthread_mutex_lock(&sm->lock);
+    while(!sm->stop || sm->head)
+    {
+        if(!sm->head)
+        {
+            pthread_cond_wait(&sm->cond, &sm->lock);
+            continue;
+        }
+
+        struct sffs_stripe_job *job = sm->head;
+        sm->head = job->next;
+        if(!sm->head)
+            sm->tail = NULL;
+        pthread_mutex_unlock(&sm->lock);
+
+        __stripe_job_done(job, __stripe_job_run(sd, job));
+
+        pthread_mutex_lock(&sm->lock);
+    }
+    pthread_mutex_unlock(&sm->lock);
+    return NULL;
+}
+
+/**
+ *  Runs jobs and waits for all of them. The first job is run by the
+ *  caller itself, the rest is handed to the workers of their members
+*/
+static int __stripe_submit(struct sffs_stripe_dev *sd, struct sffs_stripe_job *jobs,
+    size_t nr_jobs)
+{
+    if(nr_jobs == 1)
+        return __stripe_job_run(sd, &jobs[0]);
+
+    struct sffs_stripe_req req;
+    pthread_mutex_init(&req.lock, NULL);
+    pthread_cond_init(&req.cond, NULL);
+    req.pending = nr_jobs;
+    req.errc = 0;
+
+    for(size_t i = 1; i < nr_jobs; i++)
+    {
+        struct sffs_stripe_member *sm = &sd->members[jobs[i].member];
+        jobs[i].req = &req;
+        jobs[i].next = NULL;
+
+        pthread_mutex_lock(&sm->lock);
+        if(sm->tail)
+            sm->tail->next = &jobs[i];
+        else
+            sm->head = &jobs[i];
+        sm->tail = &jobs[i];
+        pthread_cond_signal(&sm->cond);
+        pthread_mutex_unlock(&sm->lock);
+    }
+
+    jobs[0].req = &req;
+    __stripe_job_done(&jobs[0], __stripe_job_run(sd, &jobs[0]));
+
+    pthread_mutex_lock(&req.lock);
+    while(req.pending != 0)
+        pthread_cond_wait(&req.cond, &req.lock);
+    pthread_mutex_unlock(&req.lock);
+
+    pthread_cond_destroy(&req.cond);
+    pthread_mutex_destroy(&req.lock);
+    return req.errc;
+}
+
+/**
+ *  Splits vector into pieces that do not cross the mapping boundaries
+ *  and groups pieces into per member jobs. Pieces of one member which
+ *  are adjacent on the member (consecutive units of the same member
+ *  are) end up in a single job
+*/
+static ssize_t __stripe_rw(sffs_context_t *sffs_ctx, const struct iovec *iov, int iovcnt,
+    uint64_t offset, bool write)
+{
+    struct sffs_stripe_dev *sd = (struct sffs_stripe_dev *) sffs_ctx->dev_priv;
+
+    // Every piece ends at a boundary or at the end of an iovec
+    size_t total = 0, nr_pieces = 0;
+    for(int i = 0; i < iovcnt; i++)
+    {
+        uint64_t off = offset + total, left = iov[i].iov_len;
+        while(left != 0)
+        {
+            uint64_t moff, len;
+            __stripe_map(sd, off, &moff, &len);
+            if(len > left)
+                len = left;
+            off += len;
+            left -= len;
+            nr_pieces++;
+        }
+        total += iov[i].iov_len;
+    }
+
+    if(nr_pieces == 0)
+        return 0;
+
+    // Member vectors are carved from one array, nr_pieces slots per member
+    struct iovec *piov = malloc(sizeof(struct iovec) * nr_pieces * sd->count);
+    struct sffs_stripe_job *jobs = malloc(sizeof(struct sffs_stripe_job) * nr_pieces);
+    size_t *used = calloc(sd->count, sizeof(size_t));
+    ssize_t *last = malloc(sizeof(ssize_t) * sd->count);
+    if(!piov || !jobs || !used || !last)
+    {
+        free(piov);
+        free(jobs);
+        free(used);
+        free(last);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for(u32_t m = 0; m < sd->count; m++)
+        last[m] = -1;
+
+    size_t nr_jobs = 0;
+    uint64_t pos = 0;
+    for(int i = 0; i < iovcnt; i++)
+    {
+        u8_t *base = (u8_t *) iov[i].iov_base;
+        uint64_t done = 0;
+        while(done < iov[i].iov_len)
+        {
+            uint64_t moff, len;
+            u32_t m = __stripe_map(sd, offset + pos, &moff, &len);
+            if(len > iov[i].iov_len - done)
+                len = iov[i].iov_len - done;
+
+            struct sffs_stripe_job *job = last[m] >= 0 ? &jobs[last[m]] : NULL;
+            if(!job || job->offset + job->bytes != moff)
+            {
+                job = &jobs[nr_jobs];
+                job->op = write ? SFFS_STRIPE_WRITE : SFFS_STRIPE_READ;
+                job->member = m;
+                job->iov = piov + m * nr_pieces + used[m];
+                job->iovcnt = 0;
+                job->offset = moff;
+                job->bytes = 0;
+                last[m] = nr_jobs++;
+            }
+
+            struct iovec *piece = &piov[m * nr_pieces + used[m]++];
+            piece->iov_base = base + done;
+            piece->iov_len = len;
+            job->iovcnt++;
+            job->bytes += len;
+
+            done += len;
+            pos += len;
+        }
+    }
+
+    int errc = __stripe_submit(sd, jobs, nr_jobs);
+
+    free(piov);
+    free(jobs);
+    free(used);
+    free(last);
+    if(errc < 0)
+    {
+        errno = EIO;
+        return -1;
+    }
+    return total;
+}
+
+static ssize_t __stripe_pread(sffs_context_t *sffs_ctx, void *data, size_t bytes,
+    uint64_t offset)
+{
+    struct iovec iov = { data, bytes };
+    return __stripe_rw(sffs_ctx, &iov, 1, offset, false);
+}
+
+static ssize_t __stripe_pwrite(sffs_context_t *sffs_ctx, const void *data, size_t bytes,
+    uint64_t offset)
+{
+    struct iovec iov = { (void *) data, bytes };
+    return __stripe_rw(sffs_ctx, &iov, 1, offset, true);
+}
+
+static ssize_t __stripe_preadv(sffs_context_t *sffs_ctx, const struct iovec *iov, int iovcnt,
+    uint64_t offset)
+{
+    return __stripe_rw(sffs_ctx, iov, iovcnt, offset, false);
+}
+
+static ssize_t __stripe_pwritev(sffs_context_t *sffs_ctx, const struct iovec *iov, int iovcnt,
+    uint64_t offset)
+{
+    return __stripe_rw(sffs_ctx, iov, iovcnt, offset, true);
+}
+
+/**
+ *  Members are flushed in parallel, volume is synced only when
+ *  all of them are
+*/
+static int __stripe_sync(sffs_context_t *sffs_ctx)
+{
+    struct sffs_stripe_dev *sd = (struct sffs_stripe_dev *) sffs_ctx->dev_priv;
+    struct sffs_stripe_job jobs[sd->count];
+
+    for(u32_t m = 0; m < sd->count; m++)
+    {
+        memset(&jobs[m], 0, sizeof(struct sffs_stripe_job));
+        jobs[m].op = SFFS_STRIPE_SYNC;
+        jobs[m].member = m;
+    }
+    return __stripe_submit(sd, jobs, sd->count);
+}
+
+static int __stripe_size(sffs_context_t *sffs_ctx, uint64_t *size)
+{
+    struct sffs_stripe_dev *sd = (struct sffs_stripe_dev *) sffs_ctx->dev_priv;
+    uint64_t rows = (sd->member_size - sd->data_off) / sd->unit;
+
+    *size = sd->data_off + rows * sd->unit * sd->count;
+    return 0;
+}
+
+static int __stripe_member_discard(struct sffs_stripe_dev *sd, u32_t member,
+    uint64_t offset, uint64_t bytes)
+{
+    sffs_context_t *mctx = &sd->members[member].ctx;
+    if(!mctx->dev_ops->discard)
+        return 0;
+    return mctx->dev_ops->discard(mctx, offset, bytes);
+}
+
+/**
+ *  Range is split per member, adjacent pieces of a member are merged
+ *  into a single discard. Discard is advisory, members without it are
+ *  skipped
+*/
+static int __stripe_discard(sffs_context_t *sffs_ctx, uint64_t offset, uint64_t bytes)
+{
+    struct sffs_stripe_dev *sd = (struct sffs_stripe_dev *) sffs_ctx->dev_priv;
+    uint64_t start[sd->count], len[sd->count];
+    int errc = 0;
+
+    memset(len, 0, sizeof(len));
+    for(uint64_t done = 0; done < bytes; )
+    {
+        uint64_t moff, plen;
+        u32_t m = __stripe_map(sd, offset + done, &moff, &plen);
+        if(plen > bytes - done)
+            plen = bytes - done;
+
+        if(len[m] != 0 && start[m] + len[m] != moff)
+        {
+            if(__stripe_member_discard(sd, m, start[m], len[m]) < 0)
+                errc = -1;
+            len[m] = 0;
+        }
+
+        if(len[m] == 0)
+            start[m] = moff;
+        len[m] += plen;
+        done += plen;
+    }
+
+    for(u32_t m = 0; m < sd->count; m++)
+        if(len[m] != 0 && __stripe_member_discard(sd, m, start[m], len[m]) < 0)
+            errc = -1;
+    return errc;
+}
+
+static void __stripe_close(sffs_context_t *sffs_ctx)
+{
+    struct sffs_stripe_dev *sd = (struct sffs_stripe_dev *) sffs_ctx->dev_priv;
+    if(!sd)
+        return;
+
+    for(u32_t m = 0; m < sd->count; m++)
+    {
+        struct sffs_stripe_member *sm = &sd->members[m];
+        if(sm->running)
+        {
+            pthread_mutex_lock(&sm->lock);
+            sm->stop = true;
+            pthread_cond_signal(&sm->cond);
+            pthread_mutex_unlock(&sm->lock);
+            pthread_join(sm->worker, NULL);
+        }
+
+        pthread_cond_destroy(&sm->cond);
+        pthread_mutex_destroy(&sm->lock);
+        if(sm->ctx.dev_ops)
+            sffs_dev_close(&sm->ctx);
+    }
+
+    free(sd->members);
+    free(sd);
+    sffs_ctx->dev_priv = NULL;
+}
+
+/**
+ *  Checks that member holds part index of the volume described by
+ *  the first member's superblock
+*/
+static int __stripe_check_member(sffs_context_t *mctx, const struct sffs_superblock *sb0,
+    u32_t index)
+{
+    struct sffs_superblock sb;
+    if(mctx->dev_ops->pread(mctx, &sb, SFFS_SB_SIZE, 1024) < 0)
+        return SFFS_ERR_DEV_READ;
+
+    if(sb.s_magic != SFFS_MAGIC || sb.s_stripe_count != sb0->s_stripe_count ||
+        sb.s_stripe_index != index || sb.s_volume_id != sb0->s_volume_id ||
+        sb.s_block_size != sb0->s_block_size)
+        return SFFS_ERR_FS;
+    return 0;
+}
+
+static int __stripe_open(sffs_context_t *sffs_ctx, const char *path, int oflags)
+{
+    char *paths = strdup(path);
+    if(!paths)
+        return SFFS_ERR_MEMALLOC;
+
+    // Member paths are separated by commas
+    u32_t count = 1;
+    for(const char *p = paths; *p; p++)
+        if(*p == ',')
+            count++;
+
+    struct sffs_stripe_dev *sd = calloc(1, sizeof(struct sffs_stripe_dev));
+    struct sffs_stripe_member *members = calloc(count, sizeof(struct sffs_stripe_member));
+    if(!sd || !members)
+    {
+        free(sd);
+        free(members);
+        free(paths);
+        return SFFS_ERR_MEMALLOC;
+    }
+
+    sd->count = count;
+    sd->members = members;
+    sffs_ctx->dev_priv = sd;
+    for(u32_t m = 0; m < count; m++)
+    {
+        members[m].dev = sd;
+        pthread_mutex_init(&members[m].lock, NULL);
+        pthread_cond_init(&members[m].cond, NULL);
+    }
+
+    // Members get the backend matching their type
+    int errc = 0;
+    char *save, *member_path = strtok_r(paths, ",", &save);
+    for(u32_t m = 0; m < count && errc == 0; m++)
+    {
+        sffs_context_t *mctx = &members[m].ctx;
+        mctx->log_id = -1;
+        errc = member_path ? sffs_dev_open(mctx, member_path, NULL, oflags) :
+            SFFS_ERR_INVARG;
+        if(errc == 0 && mctx->dev_ops->map)
+            errc = SFFS_ERR_INVARG;
+
+        if(errc == 0 && mctx->dev_align > sffs_ctx->dev_align)
+            sffs_ctx->dev_align = mctx->dev_align;
+        member_path = strtok_r(NULL, ",", &save);
+    }
+    free(paths);
+
+    // Layout is described by the superblock of the first member
+    struct sffs_superblock sb;
+    if(errc == 0 && members[0].ctx.dev_ops->pread(&members[0].ctx, &sb,
+        SFFS_SB_SIZE, 1024) < 0)
+        errc = SFFS_ERR_DEV_READ;
+
+    if(errc == 0 && (sb.s_magic != SFFS_MAGIC || sb.s_stripe_count != count ||
+        sb.s_stripe_unit == 0))
+        errc = SFFS_ERR_FS;
+
+    for(u32_t m = 0; m < count && errc == 0; m++)
+        errc = __stripe_check_member(&members[m].ctx, &sb, m);
+
+    if(errc == 0)
+    {
+        sffs_context_t layout;
+        memset(&layout, 0, sizeof(sffs_context_t));
+        layout.sb = sb;
+
+        sd->unit = (uint64_t) sb.s_stripe_unit * sb.s_block_size;
+        sd->data_off = (uint64_t) sffs_data_start(&layout) * sb.s_block_size;
+        sd->member_size = UINT64_MAX;
+        for(u32_t m = 0; m < count && errc == 0; m++)
+        {
+            uint64_t size;
+            sffs_context_t *mctx = &members[m].ctx;
+            errc = mctx->dev_ops->size(mctx, &size);
+            if(errc == 0 && size < sd->member_size)
+                sd->member_size = size;
+        }
+
+        if(errc == 0 && sd->member_size < sd->data_off + sd->unit)
+            errc = SFFS_ERR_FS;
+    }
+
+    for(u32_t m = 0; m < count && errc == 0; m++)
+    {
+        if(pthread_create(&members[m].worker, NULL, __stripe_worker, &members[m]) != 0)
+        {
+            errc = SFFS_ERR_INIT;
+            break;
+        }
+        members[m].running = true;
+    }
+
+    if(errc < 0)
+    {
+        __stripe_close(sffs_ctx);
+        sffs_ctx->dev_align = 0;
+        return errc;
+    }
+
+    // Members keep their own descriptors, volume has none
+    sffs_ctx->disk_id = -1;
+    return 0;
+}
+
+const struct sffs_dev_ops sffs_stripe_ops =
+{
+    .name       = "stripe",
+    .open       = __stripe_open,
+    .close      = __stripe_close,
+    .pread      = __stripe_pread,
+    .pwrite     = __stripe_pwrite,
+    .sync       = __stripe_sync,
+    .size       = __stripe_size,
+    .map        = NULL,
+    .preadv     = __stripe_preadv,
+    .pwritev    = __stripe_pwritev,
+    .discard    = __stripe_discard,
+};
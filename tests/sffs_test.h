@@ -0,0 +1,30 @@
+/**
+ *  SPDX-License-Identifier: MIT
+ *  Copyright (c) 2023 Danylo Malapura
+*/
+
+#ifndef SFFS_TEST_H
+#define SFFS_TEST_H
+
+#include <stdio.h>
+
+/**
+ *  Checks for the unit tests of in-memory structures. A failed check 
+ *  is reported and counted, test fails if any check did
+*/
+static int sffs_test_failed;
+
+#define SFFS_CHECK(cond)                                                    \
+    do                                                                      \
+    {                                                                       \
+        if(!(cond))                                                         \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,          \
+                __LINE__, #cond);                                           \
+            sffs_test_failed++;                                             \
+        }                                                                   \
+    } while(0)
+
+#define SFFS_TEST_RESULT()  (sffs_test_failed == 0 ? 0 : 1)
+
+#endif  // SFFS_TEST_H
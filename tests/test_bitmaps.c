@@ -0,0 +1,189 @@
+/**
+ *  SPDX-License-Identifier: MIT
+ *  Copyright (c) 2023 Danylo Malapura
+*/
+
+/**
+ *  Bitmap search primitives checked against a bit by bit reference 
+ *  on random bitmaps of varying density, range claims checked for 
+ *  taking either the whole range or nothing, also with threads racing 
+ *  for the same bits
+*/
+
+#include <sffs.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sffs_test.h"
+
+#define BITS    4096
+#define THREADS 8
+
+static u64_t bm[BITS / 64];
+
+static int __bit(u64_t id)
+{
+    return (((const u8_t *) bm)[id / 8] >> (id % 8)) & 1;
+}
+
+static void __fill(int density)
+{
+    memset(bm, 0, sizeof(bm));
+    for(u64_t id = 0; id < BITS; id++)
+        if(rand() % 100 < density)
+            ((u8_t *) bm)[id / 8] |= 1 << (id % 8);
+}
+
+static u64_t __ref_find(u64_t start, u64_t end, int value)
+{
+    for(u64_t id = start; id < end; id++)
+        if(__bit(id) == value)
+            return id;
+    return end;
+}
+
+static u64_t __ref_find_run(u64_t start, u64_t end, u64_t len)
+{
+    u64_t run = 0;
+    for(u64_t id = start; id < end; id++)
+    {
+        run = __bit(id) ? 0 : run + 1;
+        if(run == len)
+            return id + 1 - len;
+    }
+    return end;
+}
+
+static u64_t __ref_count(u64_t start, u64_t end)
+{
+    u64_t count = 0;
+    for(u64_t id = start; id < end; id++)
+        count += !__bit(id);
+    return count;
+}
+
+static void test_search(void)
+{
+    static const int density[] = { 0, 3, 50, 97, 100 };
+
+    for(size_t d = 0; d < sizeof(density) / sizeof(density[0]); d++)
+    {
+        __fill(density[d]);
+        for(int i = 0; i < 2000; i++)
+        {
+            u64_t start = rand() % BITS;
+            u64_t end = start + rand() % (BITS - start + 1);
+            u64_t len = 1 + rand() % 80;
+
+            SFFS_CHECK(__find_zero_bm(bm, start, end) == __ref_find(start, end, 0));
+            SFFS_CHECK(__find_one_bm(bm, start, end) == __ref_find(start, end, 1));
+            SFFS_CHECK(__find_zero_run_bm(bm, start, end, len) == 
+                __ref_find_run(start, end, len));
+            SFFS_CHECK(__count_zero_bm(bm, start, end) == __ref_count(start, end));
+        }
+    }
+}
+
+static void test_search_edges(void)
+{
+    memset(bm, 0xff, sizeof(bm));
+
+    // Zero bits at word boundaries, a run crossing one
+    ((u8_t *) bm)[0] &= ~1;
+    ((u8_t *) bm)[7] &= ~0x80;
+    for(u64_t id = 120; id < 140; id++)
+        ((u8_t *) bm)[id / 8] &= ~(1 << (id % 8));
+
+    SFFS_CHECK(__find_zero_bm(bm, 0, BITS) == 0);
+    SFFS_CHECK(__find_zero_bm(bm, 1, BITS) == 63);
+    SFFS_CHECK(__find_zero_bm(bm, 64, BITS) == 120);
+    SFFS_CHECK(__find_zero_bm(bm, 140, BITS) == BITS);
+    SFFS_CHECK(__find_zero_run_bm(bm, 0, BITS, 20) == 120);
+    SFFS_CHECK(__find_zero_run_bm(bm, 0, BITS, 21) == BITS);
+    SFFS_CHECK(__find_zero_run_bm(bm, 0, 139, 20) == 139);
+    SFFS_CHECK(__find_zero_run_bm(bm, 125, BITS, 0) == 125);
+    SFFS_CHECK(__count_zero_bm(bm, 0, BITS) == 22);
+
+    // Empty range
+    SFFS_CHECK(__find_zero_bm(bm, 120, 120) == 120);
+    SFFS_CHECK(__count_zero_bm(bm, 130, 130) == 0);
+}
+
+static void test_claim_range(void)
+{
+    memset(bm, 0, sizeof(bm));
+
+    // Range spanning three words is claimed as a whole
+    SFFS_CHECK(__set_range_bm(bm, 60, 200, 1) == 0);
+    SFFS_CHECK(__find_one_bm(bm, 0, BITS) == 60);
+    SFFS_CHECK(__find_zero_bm(bm, 60, BITS) == 200);
+    SFFS_CHECK(__check_bm((blk32_t *) bm, 199) == 1);
+    SFFS_CHECK(__check_bm((blk32_t *) bm, 200) == 0);
+
+    // Single set bit at the far end refuses the range, claimed words are undone
+    SFFS_CHECK(__set_range_bm(bm, 300, 400, 1) == 0);
+    SFFS_CHECK(__set_range_bm(bm, 200, 301, 1) == SFFS_ERR_FS);
+    SFFS_CHECK(__count_zero_bm(bm, 200, 300) == 100);
+    SFFS_CHECK(__set_range_bm(bm, 200, 300, 1) == 0);
+    SFFS_CHECK(__find_zero_bm(bm, 60, BITS) == 400);
+
+    // Clearing refuses bits that are already clear the same way
+    SFFS_CHECK(__set_range_bm(bm, 390, 410, 0) == SFFS_ERR_FS);
+    SFFS_CHECK(__count_zero_bm(bm, 60, 400) == 0);
+    SFFS_CHECK(__set_range_bm(bm, 100, 150, 0) == 0);
+    SFFS_CHECK(__find_zero_run_bm(bm, 0, BITS, 100) == 400);
+    SFFS_CHECK(__find_zero_run_bm(bm, 60, BITS, 50) == 100);
+    SFFS_CHECK(__count_zero_bm(bm, 0, BITS) == BITS - 290);
+
+    // Empty range changes nothing
+    SFFS_CHECK(__set_range_bm(bm, 120, 120, 1) == 0);
+    SFFS_CHECK(__count_zero_bm(bm, 0, BITS) == BITS - 290);
+}
+
+static u32_t owners[BITS];
+
+static void *__claimer(void *arg)
+{
+    unsigned seed = (unsigned) (size_t) arg;
+    for(int i = 0; i < 20000; i++)
+    {
+        u64_t start = rand_r(&seed) % BITS;
+        u64_t end = start + 1 + rand_r(&seed) % 8;
+        if(end > BITS)
+            end = BITS;
+
+        if(__set_range_bm(bm, start, end, 1) == 0)
+            for(u64_t id = start; id < end; id++)
+                __atomic_fetch_add(&owners[id], 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void test_claim_race(void)
+{
+    pthread_t threads[THREADS];
+    memset(bm, 0, sizeof(bm));
+    memset(owners, 0, sizeof(owners));
+
+    for(size_t t = 0; t < THREADS; t++)
+        pthread_create(&threads[t], NULL, __claimer, (void *) (t + 1));
+    for(size_t t = 0; t < THREADS; t++)
+        pthread_join(threads[t], NULL);
+
+    // Every set bit has been claimed by exactly one range, no bit by two
+    u64_t bad = 0;
+    for(u64_t id = 0; id < BITS; id++)
+        if(owners[id] != (u32_t) __bit(id))
+            bad++;
+    SFFS_CHECK(bad == 0);
+}
+
+int main(void)
+{
+    srand(1);
+    test_search();
+    test_search_edges();
+    test_claim_range();
+    test_claim_race();
+    return SFFS_TEST_RESULT();
+}
@@ -0,0 +1,120 @@
+/**
+ *  SPDX-License-Identifier: MIT
+ *  Copyright (c) 2023 Danylo Malapura
+*/
+
+/**
+ *  Block map cache of an inode whose blocks fit into its primary 
+ *  inode. Block ids in the inode are changed behind the cache, so a 
+ *  lookup tells whether it was served by the map or rebuilt it
+*/
+
+#include <sffs.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sffs_test.h"
+
+#define PR_BLKS     16
+#define INO         7
+
+static sffs_context_t ctx;
+
+static void __ino_set(struct sffs_inode_mem *ino_mem, blk32_t base, u32_t count)
+{
+    ino_mem->ino.i_blks_count = count;
+    for(u32_t k = 0; k < count; k++)
+        ino_mem->blks[k] = base + k;
+}
+
+static bool __lookup_is(struct sffs_inode_mem *ino_mem, blk32_t first, 
+    const blk32_t *expect, u32_t count)
+{
+    blk32_t got[PR_BLKS];
+    ino32_t entry = 0;
+    if(sffs_bmap_lookup(&ctx, ino_mem, first, count, got, &entry) < 0)
+        return false;
+    return entry == INO && memcmp(got, expect, sizeof(blk32_t) * count) == 0;
+}
+
+static void test_append(struct sffs_inode_mem *ino_mem)
+{
+    const blk32_t built[] = { 10, 11, 12, 13 };
+    const blk32_t appended[] = { 10, 11, 12, 13, 20, 21 };
+    const blk32_t overlap[] = { 10, 11, 40, 41, 42 };
+    blk32_t got[PR_BLKS];
+
+    // First lookup builds the map, later ones do not look at the inode
+    __ino_set(ino_mem, 10, 4);
+    SFFS_CHECK(__lookup_is(ino_mem, 0, built, 4));
+    __ino_set(ino_mem, 500, 4);
+    SFFS_CHECK(__lookup_is(ino_mem, 0, built, 4));
+
+    // Appended blocks are served by the map
+    const blk32_t more[] = { 20, 21 };
+    sffs_bmap_append(&ctx, INO, 4, more, 2);
+    SFFS_CHECK(__lookup_is(ino_mem, 0, appended, 6));
+    SFFS_CHECK(__lookup_is(ino_mem, 4, appended + 4, 2));
+
+    // Append over the tail replaces it
+    const blk32_t over[] = { 40, 41, 42 };
+    sffs_bmap_append(&ctx, INO, 2, over, 3);
+    SFFS_CHECK(__lookup_is(ino_mem, 0, overlap, 5));
+
+    // Appends of another inode sharing the slot are ignored
+    const blk32_t other[] = { 90 };
+    sffs_bmap_append(&ctx, INO + SFFS_BMAP_SLOTS, 5, other, 1);
+    SFFS_CHECK(__lookup_is(ino_mem, 0, overlap, 5));
+
+    // Append leaving a hole is not recorded, lookup past the map rebuilds it
+    sffs_bmap_append(&ctx, INO, 8, other, 1);
+    SFFS_CHECK(sffs_bmap_lookup(&ctx, ino_mem, 8, 1, got, NULL) == SFFS_ERR_INVARG);
+    const blk32_t rebuilt[] = { 500, 501, 502, 503 };
+    SFFS_CHECK(__lookup_is(ino_mem, 0, rebuilt, 4));
+}
+
+static void test_truncate(struct sffs_inode_mem *ino_mem)
+{
+    const blk32_t built[] = { 10, 11, 12, 13, 14, 15 };
+    const blk32_t rebuilt[] = { 300, 301, 302, 303 };
+
+    __ino_set(ino_mem, 10, 6);
+    sffs_bmap_truncate(&ctx, INO, 0);
+    SFFS_CHECK(__lookup_is(ino_mem, 0, built, 6));
+
+    // Blocks below the cut are still served by the map
+    sffs_bmap_truncate(&ctx, INO, 3);
+    __ino_set(ino_mem, 300, 4);
+    SFFS_CHECK(__lookup_is(ino_mem, 0, built, 3));
+
+    // Blocks past it are not, the map is built again from the inode
+    SFFS_CHECK(__lookup_is(ino_mem, 0, rebuilt, 4));
+
+    // Truncation to zero drops the map
+    sffs_bmap_truncate(&ctx, INO, 0);
+    __ino_set(ino_mem, 700, 2);
+    SFFS_CHECK(__lookup_is(ino_mem, 0, (const blk32_t[]) { 700, 701 }, 2));
+}
+
+int main(void)
+{
+    ctx.sb.s_inode_size = sizeof(struct sffs_inode);
+    ctx.sb.s_inode_block_size = PR_BLKS * sizeof(blk32_t);
+
+    struct sffs_inode_mem *ino_mem = calloc(1, ctx.sb.s_inode_size + 
+        ctx.sb.s_inode_block_size);
+    SFFS_CHECK(ino_mem != NULL);
+    SFFS_CHECK(sffs_bmap_lookup(&ctx, ino_mem, 0, 1, NULL, NULL) == SFFS_ERR_INIT);
+    SFFS_CHECK(sffs_bmap_init(&ctx) == 0);
+    if(!ino_mem || !ctx.bmap)
+        return SFFS_TEST_RESULT();
+
+    ino_mem->ino.i_inode_num = INO;
+    ino_mem->ino.i_list_size = 1;
+
+    test_append(ino_mem);
+    test_truncate(ino_mem);
+
+    sffs_bmap_destroy(&ctx);
+    free(ino_mem);
+    return SFFS_TEST_RESULT();
+}
@@ -0,0 +1,154 @@
+/**
+ *  SPDX-License-Identifier: MIT
+ *  Copyright (c) 2023 Danylo Malapura
+*/
+
+/**
+ *  Extent mapping of an inode whose extents fit into its primary 
+ *  slots, so no inode list and no device is involved. Checks merging 
+ *  of appended runs, lookups and truncation within and between extents
+*/
+
+#include <sffs.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sffs_test.h"
+
+#define PR_SLOTS    8
+
+static sffs_context_t ctx;
+
+static struct sffs_inode_mem *__ino_alloc(void)
+{
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.sb.s_features = SFFS_FEATURE_EXTENTS;
+    ctx.sb.s_inode_size = sizeof(struct sffs_inode);
+    ctx.sb.s_inode_block_size = PR_SLOTS * sizeof(struct sffs_inode_extent);
+
+    struct sffs_inode_mem *ino_mem = calloc(1, ctx.sb.s_inode_size + 
+        ctx.sb.s_inode_block_size);
+    if(ino_mem)
+    {
+        ino_mem->ino.i_inode_num = 5;
+        ino_mem->ino.i_list_size = 1;
+    }
+    return ino_mem;
+}
+
+static struct sffs_inode_extent *__ext(struct sffs_inode_mem *ino_mem, u32_t k)
+{
+    return (struct sffs_inode_extent *) ino_mem->blks + k;
+}
+
+static bool __blocks_are(struct sffs_inode_mem *ino_mem, const blk32_t *expect, u32_t count)
+{
+    blk32_t got[32];
+    if(sffs_ext_get_blocks(&ctx, ino_mem, 0, count, got) < 0)
+        return false;
+    return memcmp(got, expect, sizeof(blk32_t) * count) == 0;
+}
+
+static void test_append(struct sffs_inode_mem *ino_mem)
+{
+    const blk32_t first[] = { 100, 101, 102, 103, 104 };
+    const blk32_t cont[] = { 105, 106 };
+    const blk32_t runs[] = { 200, 201, 300 };
+    const blk32_t all[] = { 100, 101, 102, 103, 104, 105, 106, 200, 201, 300 };
+
+    // Consecutive blocks take a single extent
+    SFFS_CHECK(sffs_ext_append(&ctx, ino_mem, first, 5) == 0);
+    SFFS_CHECK(ino_mem->ino.i_extents_count == 1);
+
+    // Blocks continuing the last extent are merged into it
+    SFFS_CHECK(sffs_ext_append(&ctx, ino_mem, cont, 2) == 0);
+    SFFS_CHECK(ino_mem->ino.i_extents_count == 1);
+    SFFS_CHECK(__ext(ino_mem, 0)->e_start == 100 && __ext(ino_mem, 0)->e_len == 7);
+
+    // Every other run takes an extent of its own
+    SFFS_CHECK(sffs_ext_append(&ctx, ino_mem, runs, 3) == 0);
+    SFFS_CHECK(ino_mem->ino.i_extents_count == 3);
+    SFFS_CHECK(__ext(ino_mem, 1)->e_start == 200 && __ext(ino_mem, 1)->e_len == 2);
+    SFFS_CHECK(__ext(ino_mem, 2)->e_start == 300 && __ext(ino_mem, 2)->e_len == 1);
+    SFFS_CHECK(__blocks_are(ino_mem, all, 10));
+
+    blk32_t block_id;
+    ino32_t entry;
+    u32_t ext_id;
+    SFFS_CHECK(sffs_ext_lookup(&ctx, ino_mem, 7, &block_id, &entry, &ext_id) == 0);
+    SFFS_CHECK(block_id == 200 && entry == 5 && ext_id == 1);
+    SFFS_CHECK(sffs_ext_lookup(&ctx, ino_mem, 9, &block_id, NULL, NULL) == 0);
+    SFFS_CHECK(block_id == 300);
+
+    // Past the last block
+    SFFS_CHECK(sffs_ext_lookup(&ctx, ino_mem, 10, &block_id, NULL, NULL) == SFFS_ERR_INVARG);
+    blk32_t tail[11];
+    SFFS_CHECK(sffs_ext_get_blocks(&ctx, ino_mem, 0, 11, tail) == SFFS_ERR_FS);
+}
+
+static void test_truncate(struct sffs_inode_mem *ino_mem)
+{
+    const blk32_t cut[] = { 100, 101, 102, 103, 104, 105, 106, 200 };
+    const blk32_t grown[] = { 100, 101, 102, 103, 104, 105, 106, 107 };
+
+    // Cut within an extent drops the ones after it
+    SFFS_CHECK(sffs_ext_truncate(&ctx, ino_mem, 8) == 0);
+    SFFS_CHECK(ino_mem->ino.i_extents_count == 2);
+    SFFS_CHECK(__ext(ino_mem, 1)->e_len == 1);
+    SFFS_CHECK(__blocks_are(ino_mem, cut, 8));
+
+    // Cut at an extent boundary keeps the extent before it whole
+    SFFS_CHECK(sffs_ext_truncate(&ctx, ino_mem, 7) == 0);
+    SFFS_CHECK(ino_mem->ino.i_extents_count == 1);
+    SFFS_CHECK(__ext(ino_mem, 0)->e_len == 7);
+
+    // Growing the file again merges into the shortened extent
+    const blk32_t next[] = { 107 };
+    SFFS_CHECK(sffs_ext_append(&ctx, ino_mem, next, 1) == 0);
+    SFFS_CHECK(ino_mem->ino.i_extents_count == 1);
+    SFFS_CHECK(__blocks_are(ino_mem, grown, 8));
+
+    // Truncating past the end changes nothing
+    SFFS_CHECK(sffs_ext_truncate(&ctx, ino_mem, 50) == 0);
+    SFFS_CHECK(ino_mem->ino.i_extents_count == 1 && __ext(ino_mem, 0)->e_len == 8);
+
+    SFFS_CHECK(sffs_ext_truncate(&ctx, ino_mem, 0) == 0);
+    SFFS_CHECK(ino_mem->ino.i_extents_count == 0);
+}
+
+static void test_fill_slots(struct sffs_inode_mem *ino_mem)
+{
+    // Runs one block apart never merge, every primary slot is used
+    blk32_t blocks[PR_SLOTS];
+    for(u32_t k = 0; k < PR_SLOTS; k++)
+        blocks[k] = 1000 + 2 * k;
+
+    SFFS_CHECK(sffs_ext_append(&ctx, ino_mem, blocks, PR_SLOTS) == 0);
+    SFFS_CHECK(ino_mem->ino.i_extents_count == PR_SLOTS);
+    SFFS_CHECK(__blocks_are(ino_mem, blocks, PR_SLOTS));
+
+    blk32_t block_id;
+    u32_t ext_id;
+    SFFS_CHECK(sffs_ext_lookup(&ctx, ino_mem, PR_SLOTS - 1, &block_id, NULL, &ext_id) == 0);
+    SFFS_CHECK(block_id == 1000 + 2 * (PR_SLOTS - 1) && ext_id == PR_SLOTS - 1);
+
+    // No free inodes for the list entry the second run needs, merge is not applied either
+    const blk32_t more[] = { 1000 + 2 * PR_SLOTS - 1, 5000 };
+    SFFS_CHECK(sffs_ext_append(&ctx, ino_mem, more, 2) == SFFS_ERR_NOSPC);
+    SFFS_CHECK(ino_mem->ino.i_extents_count == PR_SLOTS);
+    SFFS_CHECK(__ext(ino_mem, PR_SLOTS - 1)->e_len == 1);
+}
+
+int main(void)
+{
+    struct sffs_inode_mem *ino_mem = __ino_alloc();
+    SFFS_CHECK(ino_mem != NULL);
+    if(!ino_mem)
+        return SFFS_TEST_RESULT();
+
+    test_append(ino_mem);
+    test_truncate(ino_mem);
+    test_fill_slots(ino_mem);
+
+    free(ino_mem);
+    return SFFS_TEST_RESULT();
+}
@@ -0,0 +1,159 @@
+/**
+ *  SPDX-License-Identifier: MIT
+ *  Copyright (c) 2023 Danylo Malapura
+*/
+
+/**
+ *  Free extent index checked on a bitmap of its own. Takes are checked 
+ *  for the goal and best fit rules, then random takes and frees are 
+ *  checked against the bitmap the index follows
+*/
+
+#include <sffs.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sffs_test.h"
+
+#define BLOCKS  20000
+
+static u64_t bits[(BLOCKS + 63) / 64];
+
+static void __set(u64_t start, u64_t end, u8_t value)
+{
+    SFFS_CHECK(__set_range_bm(bits, start, end, value) == 0);
+}
+
+/**
+ *  Takes blocks out of the index and marks them in the bitmap, the way 
+ *  the allocator claims them
+*/
+static sffs_err_t __take(sffs_context_t *sffs_ctx, blk32_t goal, u32_t len, 
+    blk32_t *start, u32_t *count)
+{
+    sffs_err_t errc = sffs_freeidx_take(sffs_ctx, goal, len, start, count);
+    if(errc < 0)
+        return errc;
+
+    SFFS_CHECK(__count_zero_bm(bits, *start, (u64_t) *start + *count) == *count);
+    __set(*start, (u64_t) *start + *count, 1);
+    sffs_freeidx_stale(sffs_ctx, *start, *count);
+    return 0;
+}
+
+static void __ctx_init(sffs_context_t *sffs_ctx, u32_t blocks)
+{
+    memset(sffs_ctx, 0, sizeof(*sffs_ctx));
+    sffs_ctx->sb.s_blocks_count = blocks;
+}
+
+static void test_take_rules(void)
+{
+    sffs_context_t ctx;
+    __ctx_init(&ctx, 4096);
+
+    // Free extents [10, 20), [30, 35) and [100, 200)
+    memset(bits, 0xff, sizeof(bits));
+    __set(10, 20, 0);
+    __set(30, 35, 0);
+    __set(100, 200, 0);
+    SFFS_CHECK(sffs_freeidx_init(&ctx, bits) == 0);
+
+    blk32_t start;
+    u32_t count;
+
+    // Goal within an extent is taken as is
+    SFFS_CHECK(__take(&ctx, 15, 3, &start, &count) == 0);
+    SFFS_CHECK(start == 15 && count == 3);
+
+    // Goal is gone now, the smallest extent that fits is used
+    SFFS_CHECK(__take(&ctx, 15, 10, &start, &count) == 0);
+    SFFS_CHECK(start == 100 && count == 10);
+
+    // Equally long extents [10, 15) and [30, 35), the lower one wins
+    SFFS_CHECK(__take(&ctx, 0, 4, &start, &count) == 0);
+    SFFS_CHECK(start == 10 && count == 4);
+
+    // Nothing fits, the longest extent is handed out
+    SFFS_CHECK(__take(&ctx, 0, 500, &start, &count) == 0);
+    SFFS_CHECK(start == 110 && count == 90);
+
+    // Bitmap changes reach the index through stale regions
+    __set(30, 35, 1);
+    __set(1000, 1100, 0);
+    sffs_freeidx_stale(&ctx, 30, 5);
+    sffs_freeidx_stale(&ctx, 1000, 100);
+    SFFS_CHECK(__take(&ctx, 30, 50, &start, &count) == 0);
+    SFFS_CHECK(start == 1000 && count == 50);
+
+    // Left are [14, 15), [18, 20) and [1050, 1100)
+    u32_t total = 0;
+    while(__take(&ctx, 0, 1000, &start, &count) == 0)
+        total += count;
+    SFFS_CHECK(total == 53);
+
+    sffs_freeidx_destroy(&ctx);
+    SFFS_CHECK(ctx.freeidx == NULL);
+}
+
+static void test_random(void)
+{
+    sffs_context_t ctx;
+    __ctx_init(&ctx, BLOCKS);
+
+    memset(bits, 0, sizeof(bits));
+    for(u64_t id = 0; id < BLOCKS; id++)
+        if(rand() % 2)
+            __set(id, id + 1, 1);
+    SFFS_CHECK(sffs_freeidx_init(&ctx, bits) == 0);
+
+    for(int i = 0; i < 20000; i++)
+    {
+        blk32_t goal = rand() % BLOCKS;
+        u32_t len = 1 + rand() % 16;
+
+        if(rand() % 2)
+        {
+            bool goal_free = __find_zero_bm(bits, goal, goal + 1) == goal;
+            bool fits = __find_zero_run_bm(bits, 0, BLOCKS, len) != BLOCKS;
+
+            blk32_t start;
+            u32_t count;
+            if(__take(&ctx, goal, len, &start, &count) < 0)
+            {
+                SFFS_CHECK(__count_zero_bm(bits, 0, BLOCKS) == 0);
+                continue;
+            }
+
+            SFFS_CHECK(count >= 1 && count <= len);
+            SFFS_CHECK(!goal_free || start == goal);
+            SFFS_CHECK(goal_free || !fits || count == len);
+        }
+        else
+        {
+            u64_t end = (u64_t) goal + len < BLOCKS ? goal + len : BLOCKS;
+            for(u64_t id = goal; id < end; id++)
+                if(__find_one_bm(bits, id, id + 1) == id)
+                    __set(id, id + 1, 0);
+            sffs_freeidx_stale(&ctx, goal, end - goal);
+        }
+    }
+
+    // Index holds exactly the free blocks of the bitmap
+    u64_t free_blks = __count_zero_bm(bits, 0, BLOCKS);
+    u64_t total = 0;
+    blk32_t start;
+    u32_t count;
+    while(__take(&ctx, 0, BLOCKS, &start, &count) == 0)
+        total += count;
+    SFFS_CHECK(total == free_blks);
+
+    sffs_freeidx_destroy(&ctx);
+}
+
+int main(void)
+{
+    srand(1);
+    test_take_rules();
+    test_random();
+    return SFFS_TEST_RESULT();
+}
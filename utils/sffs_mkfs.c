@@ -1,10 +1,12 @@
 #include <sffs.h>
 #include <sffs_err.h>
+#include <sffs_device.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <string.h>
 #include <sys/types.h>
 #include <time.h>
 #include <sys/statfs.h>
@@ -25,9 +27,21 @@ struct sffs_mount_opts
 };
 
 /**
- *  SFFS file system initialization code
+ *  Number of blocks holding group descriptors of data_blocks
 */
-sffs_err_t __sffs_init(sffs_context_t *sffs_ctx, size_t fs_size)
+static blk32_t __grp_desc_blks(blk32_t data_blocks, blk32_t grp_size_blks, 
+    blk32_t block_size)
+{
+    return ((data_blocks / grp_size_blks) * sizeof(u32_t)) / block_size + 1;
+}
+
+/**
+ *  SFFS file system initialization code. fs_size is the size of 
+ *  a single image, striped volume consists of stripe_count of them. 
+ *  features are optional s_features flags requested by the user
+*/
+sffs_err_t __sffs_init(sffs_context_t *sffs_ctx, size_t fs_size, u32_t stripe_count,
+    u32_t stripe_unit, u32_t features)
 {
     struct sffs_superblock sffs_sb;
     memset(&sffs_sb, 0, sizeof(struct sffs_superblock));
@@ -47,7 +61,8 @@ sffs_err_t __sffs_init(sffs_context_t *sffs_ctx, size_t fs_size)
     */
     blk32_t resv_inodes = SFFS_RESV_INODES;
 
-    blk32_t total_blocks = (fs_size / block_size) - resv_inodes;
+    blk32_t image_blocks = fs_size / block_size;
+    blk32_t total_blocks = (image_blocks * stripe_count) - resv_inodes;
     blk32_t total_inodes = (total_blocks * block_size) / SFFS_INODE_RATIO;
     
     blk32_t GIT_size_blks = (total_inodes / (block_size / (SFFS_INODE_SIZE * 2))) + 1;
@@ -63,15 +78,38 @@ sffs_err_t __sffs_init(sffs_context_t *sffs_ctx, size_t fs_size)
     // Number of data blocks is effectively reduced by a data bitmap
     data_blocks -= data_bitmap_blks;
 
+    // Group descriptors hold a free blocks counter per group
+    blk32_t grp_size_blks = SFFS_INODE_DATA_SIZE / 4;
+    blk32_t grp_desc_blks = __grp_desc_blks(data_blocks, grp_size_blks, block_size);
+    data_blocks -= grp_desc_blks;
+
+    /**
+     *  Metadata is kept on the first image only, but the data region 
+     *  starts at the same offset on every member, so each of them 
+     *  holds the same number of whole stripe units
+    */
+    if(stripe_count > 1)
+    {
+        if(image_blocks <= meta_blks + data_bitmap_blks + grp_desc_blks)
+            return SFFS_ERR_INIT;
+
+        blk32_t rows = (image_blocks - meta_blks - data_bitmap_blks - grp_desc_blks) / 
+            stripe_unit;
+        data_blocks = rows * stripe_unit * stripe_count;
+
+        // Rows were fitted with the larger estimate, descriptors only shrink
+        grp_desc_blks = __grp_desc_blks(data_blocks, grp_size_blks, block_size);
+        total_blocks = meta_blks + data_bitmap_blks + grp_desc_blks + data_blocks;
+    }
+
     /**
      *  The size of the GIT must corrected.
      *  This is because first size of Global Inode Table has been evaluated
      *  without bitmaps
     */
-    blk32_t grp_size_blks = SFFS_INODE_DATA_SIZE / 4;
     total_inodes = data_blocks / grp_size_blks;
 
-    blk32_t result = meta_blks + data_bitmap_blks + data_blocks;
+    blk32_t result = meta_blks + data_bitmap_blks + grp_desc_blks + data_blocks;
     if(result != total_blocks)
         return SFFS_ERR_INIT;
     
@@ -90,18 +128,31 @@ sffs_err_t __sffs_init(sffs_context_t *sffs_ctx, size_t fs_size)
     sffs_sb.s_max_mount_count = SFFS_MAX_MOUNT;
     sffs_sb.s_max_inode_list = SFFS_MAX_INODE_LIST;
     sffs_sb.s_magic = SFFS_MAGIC;
-    sffs_sb.s_features = 0;
+    sffs_sb.s_features = SFFS_FEATURE_GROUP_DESC | features;
     sffs_sb.s_error = 0;
     sffs_sb.s_prealloc_blocks = 0;
     sffs_sb.s_prealloc_dir_blocks = 0;
     sffs_sb.s_inode_size = sizeof(struct sffs_inode);
     sffs_sb.s_inode_block_size = SFFS_INODE_DATA_SIZE;
+    if(stripe_count > 1)
+    {
+        sffs_sb.s_stripe_count = stripe_count;
+        sffs_sb.s_stripe_unit = stripe_unit;
+        sffs_sb.s_volume_id = time(NULL) ^ (getpid() << 16);
+    }
     time_t mount_time = time(NULL);
     sffs_sb.s_mount_count = mount_time;
     sffs_sb.s_write_time = mount_time;
 
     u32_t acc_address = sb_start + 1;
 
+    /**
+     *  Group descriptors location and size
+    */
+    sffs_sb.s_group_desc_start = acc_address;
+    sffs_sb.s_group_desc_size = grp_desc_blks;
+    acc_address += grp_desc_blks;
+
     /**
      *  Data bitmap location and size
     */
@@ -122,16 +173,25 @@ sffs_err_t __sffs_init(sffs_context_t *sffs_ctx, size_t fs_size)
 
     sffs_ctx->sb = sffs_sb;
 
+    /**
+     *  Every group starts completely free
+    */
+    u32_t *grp_desc = calloc(grp_desc_blks, block_size);
+    if(!grp_desc)
+        return SFFS_ERR_MEMALLOC;
+    for(blk32_t i = 0; i < sffs_sb.s_group_count; i++)
+        grp_desc[i] = grp_size_blks;
+
+    sffs_err_t errc = sffs_write_blk(sffs_ctx, sffs_sb.s_group_desc_start, grp_desc, 
+        grp_desc_blks);
+    free(grp_desc);
+    if(errc < 0)
+        return errc;
+
     /**
      *  SFFS superblock serialization
     */
-    if(lseek64(sffs_ctx->disk_id, 1024, SEEK_SET) < 0)
-        return SFFS_ERR_DEV_SEEK;
-    
-    if(write(sffs_ctx->disk_id, &sffs_ctx->sb, SFFS_SB_SIZE) == 0)
-        return SFFS_ERR_DEV_WRITE;
-    
-    return 0;
+    return sffs_write_sb(sffs_ctx, &sffs_ctx->sb);
 }
 
 
@@ -187,9 +247,41 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
-    if(access(device_argv, F_OK) == 0)
+    /**
+     *  Comma separated list of images creates a striped volume, 
+     *  every image gets size bytes
+    */
+    char *images_argv = strdup(device_argv);
+    if(!images_argv)
+        abort();
+
+    u32_t nr_images = 1;
+    for(const char *p = images_argv; *p; p++)
+        if(*p == ',')
+            nr_images++;
+
+    char **images = malloc(sizeof(char *) * nr_images);
+    int *fds = malloc(sizeof(int) * nr_images);
+    if(!images || !fds)
+        abort();
+
+    char *save;
+    for(u32_t i = 0; i < nr_images; i++)
     {
-        fprintf(stdout, "mkfs.sffs: Image [%s] already exist. Do you want to rewrite it? (y/n): ", device_argv);
+        images[i] = strtok_r(i == 0 ? images_argv : NULL, ",", &save);
+        if(!images[i])
+        {
+            fprintf(stderr, "mkfs.sffs: Invalid image list: %s\n", device_argv);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for(u32_t i = 0; i < nr_images; i++)
+    {
+        if(access(images[i], F_OK) != 0)
+            continue;
+
+        fprintf(stdout, "mkfs.sffs: Image [%s] already exist. Do you want to rewrite it? (y/n): ", images[i]);
         char answer;
         do 
         {
@@ -205,23 +297,34 @@ int main(int argc, char **argv)
      *  Initialize user-specified options
     */
     int opt;
-    blk32_t block_size;
-    blk32_t blocks_per_grp;
+    blk32_t block_size = 0;
+    blk32_t blocks_per_grp = 0;
     u32_t inodes_ratio = SFFS_INODE_RATIO;
+    u32_t stripe_unit = SFFS_STRIPE_UNIT;
+    u32_t features = 0;
 
-    while ((opt = getopt(argc, argv, "b:g:i:t:")) != -1) 
+    while ((opt = getopt(argc, argv, "b:g:i:t:s:e")) != -1) 
     {
         // Just primary initialization, check goes next
         switch (opt) 
         {
             case 'b':
                 block_size = atoi(optarg);
+                break;
             case 'g':
                 blocks_per_grp = atoi(optarg); 
+                break;
             case 'i':
                 inodes_ratio = atoi(optarg);
+                break;
+            case 's':
+                stripe_unit = atoi(optarg);
+                break;
             case 't':
-                ;
+                break;
+            case 'e':
+                features |= SFFS_FEATURE_EXTENTS;
+                break;
             case '?':
             {
                 if (optopt == 'f' || optopt == 'o')
@@ -237,22 +340,30 @@ int main(int argc, char **argv)
         }
     }
 
-    int flags = O_RDWR | O_CREAT | O_TRUNC;
-    mode_t fmode = S_IRWXU | S_IRWXG | S_IRWXO;
-
-    int fd;
-    if((fd = open(device_argv, flags, fmode)) < 0)
+    if(stripe_unit == 0)
     {
-        fprintf(stderr, "mkfs.sffs: Cannot creat SFFS image: %s\n", device_argv);
+        fprintf(stderr, "mkfs.sffs: Invalid stripe unit: %u\n", stripe_unit);
         exit(EXIT_FAILURE);
     }
 
-    if(ftruncate(fd, fs_size) < 0)
+    int flags = O_RDWR | O_CREAT | O_TRUNC;
+    mode_t fmode = S_IRWXU | S_IRWXG | S_IRWXO;
+
+    for(u32_t i = 0; i < nr_images; i++)
     {
-        fprintf(stderr, "mkfs.sffs: Cannot creat %s image with specified size: %d\n", 
-            device_argv, fs_size);
-        remove(device_argv);
-        exit(EXIT_FAILURE);
+        if((fds[i] = open(images[i], flags, fmode)) < 0)
+        {
+            fprintf(stderr, "mkfs.sffs: Cannot creat SFFS image: %s\n", images[i]);
+            exit(EXIT_FAILURE);
+        }
+
+        if(ftruncate(fds[i], fs_size) < 0)
+        {
+            fprintf(stderr, "mkfs.sffs: Cannot creat %s image with specified size: %d\n", 
+                images[i], fs_size);
+            remove(images[i]);
+            exit(EXIT_FAILURE);
+        }
     }
 
     /*          SFFS arguments correction           */
@@ -270,7 +381,7 @@ int main(int argc, char **argv)
     if(block_size == 0)
     {
         struct statfs cwd_fs;
-        if(statfs(device_argv, &cwd_fs) < 0)
+        if(statfs(images[0], &cwd_fs) < 0)
             return SFFS_ERR_DEV_STAT;
 
         block_size = cwd_fs.f_bsize;
@@ -298,20 +409,53 @@ int main(int argc, char **argv)
     }
 
     sffs_context_t sffs_ctx;
+    memset(&sffs_ctx, 0, sizeof(sffs_context_t));
     sffs_ctx.sb.s_block_size = block_size;
-    sffs_ctx.disk_id = fd;
+    sffs_ctx.disk_id = fds[0];
     void *cache = malloc(sffs_ctx.sb.s_block_size);
     if(!cache)
         abort();
     sffs_ctx.cache = cache;
 
-    sffs_err_t errc = __sffs_init(&sffs_ctx, fs_size);
+    sffs_err_t errc = __sffs_init(&sffs_ctx, fs_size, nr_images, stripe_unit, features);
     if(errc < 0)
     {
         fprintf(stderr, "mkfs.sffs: Error during SFFS image initialization\n");
         abort();
     }
 
+    if(nr_images > 1)
+    {
+        // Every member carries the superblock telling its place in the volume
+        for(u32_t i = 1; i < nr_images; i++)
+        {
+            struct sffs_superblock sb = sffs_ctx.sb;
+            sb.s_stripe_index = i;
+            if(pwrite(fds[i], &sb, SFFS_SB_SIZE, 1024) != SFFS_SB_SIZE)
+            {
+                fprintf(stderr, "mkfs.sffs: Cannot write superblock to %s\n", images[i]);
+                abort();
+            }
+        }
+
+        // Rest of the volume is written through the striped backend
+        for(u32_t i = 0; i < nr_images; i++)
+            close(fds[i]);
+
+        if(sffs_dev_open(&sffs_ctx, device_argv, "stripe", 0) < 0)
+        {
+            fprintf(stderr, "mkfs.sffs: Cannot open striped volume: %s\n", device_argv);
+            abort();
+        }
+    }
+
+    // Root directory is allocated the way a mounted file system does it
+    if(sffs_bm_load(&sffs_ctx) < 0)
+    {
+        fprintf(stderr, "mkfs.sffs: Cannot load bitmaps\n");
+        abort();
+    }
+
     ino32_t inode;
     struct sffs_inode_mem *ino_mem;
     errc = sffs_alloc_inode(&sffs_ctx, &inode, SFFS_IFDIR);
@@ -339,15 +483,27 @@ int main(int argc, char **argv)
     if(errc < 0)
         abort();
 
+    // Writes are not synchronous, so commit everything before exit
+    if(sffs_bm_unload(&sffs_ctx) < 0 || sffs_sync(&sffs_ctx) < 0)
+        abort();
+
     printf("File system successfully created\n");
     printf("SFFS_PATH: %s\n", device_argv);
+    if(nr_images > 1)
+        printf("SFFS_STRIPE: %u x %u blocks\n", nr_images, stripe_unit);
     printf("SFFS_SIZE: %d\n", fs_size);
     printf("SFFS_BLOCK_SIZE: %d\n", sffs_ctx.sb.s_block_size);
     printf("SFFS_BLOCKS_COUNT: %d\n", sffs_ctx.sb.s_blocks_count);
     printf("SFFS_INODES_COUNT: %d\n", sffs_ctx.sb.s_inodes_count);
     printf("SFFS_ROOT: %d\n", ino_mem->ino.i_inode_num);
 
-    close(fd);
+    if(nr_images > 1)
+        sffs_dev_close(&sffs_ctx);
+    else
+        close(fds[0]);
+    free(fds);
+    free(images);
+    free(images_argv);
     free(ino_mem);
     free(sffs_ctx.cache);
     exit(EXIT_SUCCESS);
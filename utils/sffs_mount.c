@@ -15,9 +15,17 @@ struct fuse_operations sffs_ops =
     .opendir        = sffs_opendir,
     .mkdir          = sffs_mkdir,
     .readdir        = sffs_readdir,
+    .read           = sffs_read,
+    .read_buf       = sffs_read_buf,
+    .write_buf      = sffs_write_buf,
+    .truncate       = sffs_truncate,
     .init           = sffs_init,
     .destroy        = sffs_destroy,
-    .statfs         = sffs_statfs
+    .statfs         = sffs_statfs,
+    .flush          = sffs_flush,
+    .fsync          = sffs_fsync,
+    .fsyncdir       = sffs_fsync,
+    .getxattr       = sffs_getxattr
 };
 
 #else
@@ -73,6 +81,13 @@ static const struct fuse_opt sffs_option_spec[] =
 {
     SFFS_OPT_INIT("--fs-image=%s", fs_image),
     SFFS_OPT_INIT("--log-file=%s", log_file),
+    SFFS_OPT_INIT("--cache-size=%u", cache_size),
+    SFFS_OPT_INIT("--icache-size=%u", icache_size),
+    SFFS_OPT_INIT("--io-depth=%d", io_depth),
+    SFFS_OPT_INIT("--backend=%s", backend),
+    SFFS_OPT_INIT("--direct-io", direct_io),
+    SFFS_OPT_INIT("--readahead=%u", readahead),
+    SFFS_OPT_INIT("--discard", discard),
     FUSE_OPT_END
 };
 
@@ -81,6 +96,8 @@ int main(int argc, char **argv)
     struct fuse_args sffs_args = FUSE_ARGS_INIT(argc, argv);
     struct sffs_options options;
     memset(&options, 0, sizeof(options));
+    options.io_depth = SFFS_IO_DEPTH;
+    options.readahead = SFFS_READAHEAD;
 
     if(fuse_opt_parse(&sffs_args, &options, sffs_option_spec, NULL) == -1)
     {